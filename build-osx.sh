@@ -9,5 +9,28 @@ gcc \
   -framework OpenGL \
   -fwrapv \
   -fno-strict-aliasing \
+  -pthread \
   source/*.c \
   -o cogsim
+
+# libcogsim: the simulation core without the visualizer, see source/cogsim.h
+LIB_SOURCES="cog landing level mario objects ol rng state surface thread trajectory util cogsim"
+
+rm -rf build/lib
+mkdir -p build/lib
+for name in $LIB_SOURCES; do
+  gcc \
+    -std=c99 \
+    -O3 \
+    -Wall -Wextra \
+    -Wno-missing-braces \
+    -fwrapv \
+    -fno-strict-aliasing \
+    -pthread \
+    -fPIC \
+    -c source/$name.c \
+    -o build/lib/$name.o
+done
+
+ar rcs libcogsim.a build/lib/*.o
+gcc -dynamiclib -pthread build/lib/*.o -o libcogsim.dylib
@@ -13,5 +13,26 @@ gcc ^
   -lopengl32 ^
   -fwrapv ^
   -fno-strict-aliasing ^
+  -pthread ^
   -IC:\Dev\GLFW\include ^
   -o build/cogsim.exe
+
+rem libcogsim: the simulation core without the visualizer, see source/cogsim.h
+if not exist build\lib mkdir build\lib
+del /q build\lib\*.o 2>nul
+for %%n in (cog landing level mario objects ol rng state surface thread trajectory util cogsim) do (
+  gcc ^
+    -DWIN32 ^
+    -std=c99 ^
+    -O3 ^
+    -Wall -Wextra ^
+    -Wno-missing-braces ^
+    -fwrapv ^
+    -fno-strict-aliasing ^
+    -pthread ^
+    -c source/%%n.c ^
+    -o build/lib/%%n.o
+)
+
+ar rcs build/libcogsim.a build/lib/*.o
+gcc -shared -pthread build/lib/*.o -o build/cogsim.dll
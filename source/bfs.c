@@ -0,0 +1,373 @@
+#include "cog.h"
+#include "frontier.h"
+#include "search.h"
+#include "state.h"
+#include "thread.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Frontier nodes expanded in parallel at once
+#define BFS_BATCH 4096
+
+// Bytes of BfsNode that identify its state
+#define BFS_KEY_SIZE (sizeof(PackedState) + sizeof(s32))
+
+
+// A state just before a cog roll, stored in the file of the roll it's
+// reached after. parent is its index in the previous roll's file, which is
+// sorted, so sequences can be rebuilt once the search is done.
+typedef struct {
+  PackedState state;
+  s32 frame;
+  u32 parent;
+  s8 roll;
+  u8 padding[3];
+} BfsNode;
+
+
+typedef struct {
+  BfsNode node;
+  f32 hSpeed;
+  bool done;
+  bool lastRollUnused;
+  RollOutcome outcome;
+} BfsChild;
+
+
+typedef struct {
+  RollOutcome outcome;
+  s32 numRolls;
+  u32 parent;
+  s8 roll;
+} BfsResult;
+
+
+typedef struct {
+  SimState start;
+  s32 horizon;
+  char *spillDir;
+
+  BfsNode *batch;
+  u32 batchStart;
+  BfsChild *children;
+
+  BfsResult *best;
+  s32 numBest;
+  s32 topCount;
+
+  SpillSorter sorter;
+  s32 numLevels;
+} Bfs;
+
+
+static int compareNodes(const void *p1, const void *p2) {
+  const BfsNode *a = (const BfsNode *) p1;
+  const BfsNode *b = (const BfsNode *) p2;
+
+  int c = memcmp(a, b, BFS_KEY_SIZE);
+  if (c != 0) return c;
+  if (a->parent != b->parent)
+    return a->parent < b->parent ? -1 : 1;
+  return a->roll - b->roll;
+}
+
+
+static int sameNode(const void *p1, const void *p2) {
+  return memcmp(p1, p2, BFS_KEY_SIZE);
+}
+
+
+static char *levelName(Bfs *b, s32 level) {
+  char *name = (char *) malloc(strlen(b->spillDir) + 32);
+  sprintf(name, "%s/cogsim-bfs-%d.bin", b->spillDir, level);
+  return name;
+}
+
+
+static void removeLevels(Bfs *b) {
+  for (s32 i = 0; i < b->numLevels; i++) {
+    char *name = levelName(b, i);
+    remove(name);
+    free(name);
+  }
+  b->numLevels = 0;
+}
+
+
+// Exits without leaving the roll files and spill runs behind
+static void abortBfs(Bfs *b) {
+  removeLevels(b);
+  freeSpillSorter(&b->sorter);
+  exit(1);
+}
+
+
+static void expandBfsNode(s32 index, void *arg) {
+  Bfs *b = (Bfs *) arg;
+  BfsNode *src = &b->batch[index];
+
+  RollNode parent;
+  unpackState(&src->state, &b->start, &parent.state);
+  // Node frames count from the input state, like the state's own
+  parent.state.frame = src->frame;
+  parent.frame = src->frame;
+  parent.hSpeed = src->state.hSpeed;
+  parent.done = false;
+  parent.result = fr_success;
+  parent.lastRollUnused = false;
+
+  for (s32 i = 0; i < NUM_ROLLS; i++) {
+    RollNode child;
+    expandRoll(&parent, MIN_ROLL + i, b->horizon, INFINITY, &child);
+
+    BfsChild *out = &b->children[index * NUM_ROLLS + i];
+    memset(&out->node, 0, sizeof(BfsNode));
+    packState(&child.state, &out->node.state);
+    out->node.frame = child.frame;
+    out->node.parent = b->batchStart + (u32) index;
+    out->node.roll = (s8) (MIN_ROLL + i);
+    out->hSpeed = child.hSpeed;
+    out->done = child.done;
+    out->lastRollUnused = child.lastRollUnused;
+    if (child.done)
+      nodeOutcome(&child, &out->outcome);
+  }
+}
+
+
+// Outcomes are ranked the same way as by the roll search. The sequence listed
+// for an outcome is the one with the fewest rolls, and then the first found.
+static bool isBetter(BfsResult *r, BfsResult *than) {
+  if (!sameOutcome(&r->outcome, &than->outcome))
+    return isBetterOutcome(&r->outcome, &than->outcome);
+  if (r->numRolls != than->numRolls)
+    return r->numRolls < than->numRolls;
+  if (r->parent != than->parent)
+    return r->parent < than->parent;
+  return r->roll < than->roll;
+}
+
+
+// Each outcome is kept once, like in the roll search
+static void offerResult(Bfs *b, BfsResult *r) {
+  for (s32 i = 0; i < b->numBest; i++) {
+    if (!sameOutcome(&b->best[i].outcome, &r->outcome)) continue;
+    if (!isBetter(r, &b->best[i])) return;
+
+    memmove(&b->best[i], &b->best[i + 1], (b->numBest - i - 1) * sizeof(BfsResult));
+    b->numBest -= 1;
+    break;
+  }
+
+  s32 i = b->numBest;
+  while (i > 0 && isBetter(r, &b->best[i - 1]))
+    i -= 1;
+  if (i >= b->topCount) return;
+
+  if (b->numBest < b->topCount)
+    b->numBest += 1;
+  memmove(&b->best[i + 1], &b->best[i], (b->numBest - 1 - i) * sizeof(BfsResult));
+  b->best[i] = *r;
+}
+
+
+static f32 threshold(Bfs *b) {
+  if (b->numBest < b->topCount) return -INFINITY;
+  return b->best[b->numBest - 1].outcome.hSpeed;
+}
+
+
+// Follows parent indices back through the roll files
+static void printResult(Bfs *b, s32 rank, BfsResult *r) {
+  s8 *rolls = (s8 *) malloc(r->numRolls + 1);
+
+  if (r->numRolls > 0) {
+    rolls[r->numRolls - 1] = r->roll;
+    u32 index = r->parent;
+    for (s32 level = r->numRolls - 1; level >= 1; level--) {
+      char *name = levelName(b, level);
+      BfsNode node;
+      if (!readRecordAt(name, sizeof(BfsNode), index, &node)) {
+        fprintf(stderr, "Failed to read '%s'\n", name);
+        abortBfs(b);
+      }
+      free(name);
+
+      rolls[level - 1] = node.roll;
+      index = node.parent;
+    }
+  }
+
+  RollOutcome *o = &r->outcome;
+  printf("%3d. Final H speed \x1b[1m%f\x1b[0m after %d frames (%s)\n",
+    rank, o->hSpeed, o->frames,
+    o->result == fr_success ? "reached horizon" : frameResultName(o->result));
+  printf("     ");
+  writeRolls(stdout, rolls, r->numRolls, "     ");
+  free(rolls);
+}
+
+
+// Breadth-first search over cog rolls that keeps the frontier on disk. Each
+// roll's frontier is written to a sorted file without duplicate states, so
+// sequences that end in the same state are only expanded once, and only
+// memoryBytes of new states are held in memory at a time.
+void runBfs(s32 horizon, s32 topCount, u64 memoryBytes, char *spillDir) {
+  if (ttcSpeedSetting != 2) {
+    printf("Breadth-first search only applies to the random speed setting (2)\n");
+    return;
+  }
+  if (topCount < 1) topCount = 1;
+
+  Bfs b;
+  memset(&b, 0, sizeof(Bfs));
+  b.horizon = horizon;
+  b.spillDir = spillDir;
+  b.topCount = topCount;
+  b.best = (BfsResult *) malloc(topCount * sizeof(BfsResult));
+  b.batch = (BfsNode *) malloc(BFS_BATCH * sizeof(BfsNode));
+  b.children = (BfsChild *) malloc(BFS_BATCH * NUM_ROLLS * sizeof(BfsChild));
+
+  RollNode root;
+  searchRoot(&root, horizon, INFINITY);
+  b.start = root.state;
+
+  char *prefix = (char *) malloc(strlen(spillDir) + 16);
+  sprintf(prefix, "%s/cogsim-bfs", spillDir);
+  SpillSorter *sorter = &b.sorter;
+  initSpillSorter(sorter, prefix, sizeof(BfsNode), memoryBytes, compareNodes, sameNode);
+
+  printf("Searching roll sequences over %d frames breadth first (%llu MB in memory, %u bytes per state)\n",
+    horizon, (unsigned long long) (memoryBytes >> 20), (u32) sizeof(BfsNode));
+
+  u64 frontierSize = 0;
+  if (root.done) {
+    BfsResult r;
+    nodeOutcome(&root, &r.outcome);
+    r.numRolls = 0;
+    r.parent = 0;
+    r.roll = 0;
+    offerResult(&b, &r);
+  }
+  else {
+    BfsNode node;
+    memset(&node, 0, sizeof(BfsNode));
+    packState(&root.state, &node.state);
+    node.frame = root.frame;
+    spillAdd(sorter, &node);
+
+    char *name = levelName(&b, 0);
+    frontierSize = spillFinish(sorter, name);
+    b.numLevels = 1;
+    free(name);
+  }
+
+  s32 level = 0;
+  u64 totalStates = frontierSize;
+  u64 peakFrontier = frontierSize;
+
+  while (frontierSize > 0) {
+    char *name = levelName(&b, level);
+    RecordReader reader;
+    if (!openRecordReader(&reader, name, sizeof(BfsNode))) {
+      fprintf(stderr, "Failed to open '%s'\n", name);
+      abortBfs(&b);
+    }
+
+    u64 pruned = 0;
+    u64 finished = 0;
+    b.batchStart = 0;
+
+    while (true) {
+      s32 n = 0;
+      BfsNode *node;
+      while (n < BFS_BATCH && (node = (BfsNode *) readRecord(&reader)) != NULL)
+        b.batch[n++] = *node;
+      if (n == 0) break;
+
+      parallelFor(n, expandBfsNode, &b);
+
+      // Results and pruning are handled in order so that the output doesn't
+      // depend on the number of threads
+      for (s32 i = 0; i < n * NUM_ROLLS; i++) {
+        BfsChild *c = &b.children[i];
+        if (c->done && c->lastRollUnused) {
+          // Every roll gives the same result, which is the parent's sequence
+          // without a final roll
+          if (c->node.roll != MIN_ROLL) continue;
+          BfsNode *parent = &b.batch[i / NUM_ROLLS];
+          BfsResult r = { c->outcome, level, parent->parent, parent->roll };
+          offerResult(&b, &r);
+          finished += 1;
+        }
+        else if (c->done) {
+          BfsResult r = { c->outcome, level + 1, c->node.parent, c->node.roll };
+          offerResult(&b, &r);
+          finished += 1;
+        }
+        else if (maxHSpeedAfter(c->hSpeed, horizon - c->node.frame) < threshold(&b)) {
+          pruned += 1;
+        }
+        else {
+          spillAdd(sorter, &c->node);
+        }
+      }
+
+      b.batchStart += (u32) n;
+    }
+
+    closeRecordReader(&reader);
+    free(name);
+
+    u64 generated = sorter->numAdded;
+    s32 numRuns = sorter->numRuns + (sorter->numRuns > 0 && sorter->count > 0);
+
+    level += 1;
+    name = levelName(&b, level);
+    frontierSize = spillFinish(sorter, name);
+    b.numLevels = level + 1;
+    free(name);
+
+    printf("Roll %3d: %llu states, %llu duplicates, %llu pruned, %llu sequences ended",
+      level,
+      (unsigned long long) frontierSize,
+      (unsigned long long) (generated - frontierSize),
+      (unsigned long long) pruned,
+      (unsigned long long) finished);
+    if (numRuns > 0)
+      printf(" (merged %d runs)", numRuns);
+    printf("\n");
+
+    totalStates += frontierSize;
+    if (frontierSize > peakFrontier)
+      peakFrontier = frontierSize;
+
+    // Nodes refer to their parent by a 32-bit index into the previous roll's
+    // file
+    if (frontierSize > UINT32_MAX) {
+      fprintf(stderr, "Roll %d has more than %u states, which the search can't index\n",
+        level, UINT32_MAX);
+      abortBfs(&b);
+    }
+  }
+
+  printf("Stored %llu states, at most %llu per roll (%.1f MB)\n",
+    (unsigned long long) totalStates, (unsigned long long) peakFrontier,
+    (f64) peakFrontier * sizeof(BfsNode) / (1 << 20));
+
+  for (s32 i = 0; i < b.numBest; i++)
+    printResult(&b, i + 1, &b.best[i]);
+
+  removeLevels(&b);
+  freeSpillSorter(sorter);
+  free(prefix);
+  free(b.best);
+  free(b.batch);
+  free(b.children);
+}
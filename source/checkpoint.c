@@ -0,0 +1,353 @@
+#include "checkpoint.h"
+
+#include "cog.h"
+#include "level.h"
+#include "objects.h"
+#include "surface.h"
+#include "state.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+
+static char checkpointMagic[8] = { 'C', 'O', 'G', 'S', 'I', 'M', 'C', '3' };
+
+
+// Writes to a temporary file next to filename and renames it over filename
+// once complete, so an interrupted write never leaves a partial file behind
+bool writeFileAtomic(char *filename, FileWriter write, void *arg) {
+  size_t n = strlen(filename);
+  char *temp = (char *) malloc(n + 5);
+  memcpy(temp, filename, n);
+  memcpy(temp + n, ".tmp", 5);
+
+  FILE *f = fopen(temp, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open '%s' for writing\n", temp);
+    free(temp);
+    return false;
+  }
+
+  bool ok = write(f, arg);
+  ok = fflush(f) == 0 && ok;
+#if !defined(WIN32)
+  ok = fsync(fileno(f)) == 0 && ok;
+#endif
+  ok = fclose(f) == 0 && ok;
+
+#if defined(WIN32)
+  ok = ok && MoveFileExA(temp, filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+  ok = ok && rename(temp, filename) == 0;
+#endif
+
+  if (!ok) {
+    fprintf(stderr, "Failed to write '%s'\n", filename);
+    remove(temp);
+  }
+  free(temp);
+  return ok;
+}
+
+
+s32 shardSize(Shard *shard, s32 total) {
+  if (shard->index >= total) return 0;
+  return (total - shard->index + shard->count - 1) / shard->count;
+}
+
+
+// Work unit of the whole sweep for the shard's i-th unit
+s32 shardUnit(Shard *shard, s32 i) {
+  return shard->index + i * shard->count;
+}
+
+
+u64 mixHash(u64 h, u64 x) {
+  h ^= x;
+  return splitMix64(&h);
+}
+
+
+// Identifies a start state, so that a checkpoint isn't resumed with a
+// different input
+static u64 vertexBits(v3h *v) {
+  return ((u64) (u16) v->x << 32) | ((u64) (u16) v->y << 16) | (u16) v->z;
+}
+
+
+u64 hashStartState(SimState *s) {
+  u64 h = 0;
+  h = mixHash(h, floatBits(s->mario.pos.x));
+  h = mixHash(h, floatBits(s->mario.pos.z));
+  h = mixHash(h, (u16) s->mario.facingYaw);
+  h = mixHash(h, floatBits(s->mario.hSpeed));
+  h = mixHash(h, (u16) s->cog.displayAngle.yaw);
+  h = mixHash(h, floatBits(s->cog.yawVel));
+  h = mixHash(h, floatBits(s->cog.yawVelTarget));
+  h = mixHash(h, s->rngState);
+  h = mixHash(h, (u64) ttcSpeedSetting);
+  h = mixHash(h, (u64) extraRngCalls);
+
+  for (s8 *roll = s->cogRngOverride; roll != NULL && *roll != 127; roll++)
+    h = mixHash(h, (u8) *roll);
+
+  // Results also depend on the level geometry
+  if (level != NULL) {
+    for (s32 i = 0; i < level->numSurfaces; i++) {
+      Surface *tri = &level->surfaces[i];
+      h = mixHash(h, vertexBits(&tri->vertex1));
+      h = mixHash(h, vertexBits(&tri->vertex2));
+      h = mixHash(h, vertexBits(&tri->vertex3));
+    }
+  }
+
+  for (s32 i = 0; i < numOtherObjects; i++) {
+    ObjectSpec *spec = &otherObjects[i];
+    h = mixHash(h, floatBits(spec->pos.x));
+    h = mixHash(h, floatBits(spec->pos.y));
+    h = mixHash(h, floatBits(spec->pos.z));
+    h = mixHash(h, (u32) spec->yaw);
+    h = mixHash(h, (u32) spec->yawVel);
+
+    s32 length = collisionModelLength(spec->model, 0x7FFFFFFF);
+    for (s32 j = 0; j < length; j++)
+      h = mixHash(h, (u16) spec->model[j]);
+  }
+  return h;
+}
+
+
+// Position of a unit of the whole sweep in the shard's arrays
+static s32 unitSlot(Checkpoint *c, s32 index) {
+  return (index - c->shard.index) / c->shard.count;
+}
+
+
+static bool writeUnits(FILE *f, void *arg) {
+  Checkpoint *c = (Checkpoint *) arg;
+  s32 bytes = (c->numUnits + 7) / 8;
+
+  // Units may finish while saving, so only results whose bit was already
+  // set are written
+  u8 *done = (u8 *) malloc(bytes);
+  for (s32 i = 0; i < bytes; i++)
+    done[i] = __atomic_load_n(&c->done[i], __ATOMIC_ACQUIRE);
+
+  bool ok = fwrite(checkpointMagic, 1, 8, f) == 8;
+  ok = ok && fwrite(&c->mode, sizeof(s32), 1, f) == 1;
+  ok = ok && fwrite(c->params, sizeof(s32), CHECKPOINT_PARAMS, f) == CHECKPOINT_PARAMS;
+  ok = ok && fwrite(&c->count, sizeof(s32), 1, f) == 1;
+  ok = ok && fwrite(&c->key, sizeof(u64), 1, f) == 1;
+  ok = ok && fwrite(&c->shard.index, sizeof(s32), 1, f) == 1;
+  ok = ok && fwrite(&c->shard.count, sizeof(s32), 1, f) == 1;
+  ok = ok && fwrite(done, 1, bytes, f) == (size_t) bytes;
+
+  SimResult empty;
+  memset(&empty, 0, sizeof(SimResult));
+  for (s32 i = 0; ok && i < c->numUnits; i++) {
+    bool isDone = (done[i / 8] >> (i % 8)) & 1;
+    ok = fwrite(isDone ? &c->results[i] : &empty, sizeof(SimResult), 1, f) == 1;
+  }
+
+  free(done);
+  return ok;
+}
+
+
+// Empty checkpoint for the shard's units of a sweep of count units, or for
+// all of them if shard is NULL
+Checkpoint *newCheckpoint(s32 mode, u64 key, s32 count, s32 *params, Shard *shard) {
+  Checkpoint *c = (Checkpoint *) calloc(1, sizeof(Checkpoint));
+  pthread_mutex_init(&c->lock, NULL);
+  c->mode = mode;
+  c->key = key;
+  c->count = count;
+  if (params != NULL)
+    memcpy(c->params, params, sizeof(c->params));
+  c->shard.index = shard != NULL ? shard->index : 0;
+  c->shard.count = shard != NULL ? shard->count : 1;
+  c->numUnits = shardSize(&c->shard, count);
+  c->done = (u8 *) calloc((c->numUnits + 7) / 8 + 1, 1);
+  c->results = (SimResult *) calloc(c->numUnits + 1, sizeof(SimResult));
+  if (c->done == NULL || c->results == NULL) {
+    fprintf(stderr, "Out of memory for a checkpoint of %d units\n", c->numUnits);
+    exit(1);
+  }
+  return c;
+}
+
+
+bool isCheckpointFile(char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) return false;
+
+  char magic[8];
+  bool result = fread(magic, 1, 8, f) == 8 && memcmp(magic, checkpointMagic, 8) == 0;
+  fclose(f);
+  return result;
+}
+
+
+// Loads a checkpoint or shard result file, or returns NULL with a message
+Checkpoint *readCheckpointFile(char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open '%s'\n", filename);
+    return NULL;
+  }
+
+  char magic[8];
+  s32 mode;
+  s32 params[CHECKPOINT_PARAMS];
+  s32 count;
+  u64 key;
+  Shard shard;
+
+  if (fread(magic, 1, 8, f) != 8 || memcmp(magic, checkpointMagic, 8) != 0 ||
+    fread(&mode, sizeof(s32), 1, f) != 1 ||
+    fread(params, sizeof(s32), CHECKPOINT_PARAMS, f) != CHECKPOINT_PARAMS ||
+    fread(&count, sizeof(s32), 1, f) != 1 ||
+    fread(&key, sizeof(u64), 1, f) != 1 ||
+    fread(&shard.index, sizeof(s32), 1, f) != 1 ||
+    fread(&shard.count, sizeof(s32), 1, f) != 1 ||
+    count < 0 || shard.count < 1 || shard.index < 0 || shard.index >= shard.count)
+  {
+    fprintf(stderr, "'%s' isn't a checkpoint file\n", filename);
+    fclose(f);
+    return NULL;
+  }
+
+  Checkpoint *c = newCheckpoint(mode, key, count, params, &shard);
+  c->filename = filename;
+
+  s32 bytes = (c->numUnits + 7) / 8;
+  if (fread(c->done, 1, bytes, f) != (size_t) bytes ||
+    fread(c->results, sizeof(SimResult), c->numUnits, f) != (size_t) c->numUnits)
+  {
+    fprintf(stderr, "'%s' is truncated\n", filename);
+    fclose(f);
+    c->filename = NULL;
+    closeCheckpoint(c);
+    return NULL;
+  }
+
+  fclose(f);
+  return c;
+}
+
+
+// Returns NULL if checkpointing isn't enabled. If resuming, units already
+// finished by the previous run are loaded; a missing file means starting
+// from scratch.
+Checkpoint *openCheckpoint(CheckpointConfig *config, s32 mode, u64 key, s32 count, s32 *params,
+  Shard *shard)
+{
+  if (config->filename == NULL) return NULL;
+
+  Checkpoint *c = newCheckpoint(mode, key, count, params, shard);
+  c->filename = config->filename;
+  c->interval = config->interval;
+  c->lastSave = time(NULL);
+
+  if (config->resume) {
+    FILE *f = fopen(c->filename, "rb");
+    if (f == NULL) {
+      printf("No checkpoint at '%s', starting from the beginning\n", c->filename);
+      return c;
+    }
+    fclose(f);
+
+    Checkpoint *saved = readCheckpointFile(c->filename);
+    if (saved == NULL) exit(1);
+    if (saved->mode != mode || saved->count != count || saved->key != key) {
+      fprintf(stderr, "'%s' is a checkpoint of a different run\n", c->filename);
+      exit(1);
+    }
+    if (saved->shard.index != c->shard.index || saved->shard.count != c->shard.count) {
+      fprintf(stderr, "'%s' is a checkpoint of a different shard\n", c->filename);
+      exit(1);
+    }
+
+    memcpy(c->done, saved->done, (c->numUnits + 7) / 8);
+    memcpy(c->results, saved->results, c->numUnits * sizeof(SimResult));
+    saved->filename = NULL;
+    closeCheckpoint(saved);
+
+    s32 numDone = 0;
+    for (s32 i = 0; i < c->numUnits; i++)
+      numDone += isUnitDone(c, shardUnit(&c->shard, i));
+    printf("Resuming with %d of %d done\n", numDone, c->numUnits);
+  }
+
+  return c;
+}
+
+
+bool isUnitDone(Checkpoint *c, s32 index) {
+  if (c == NULL) return false;
+  s32 slot = unitSlot(c, index);
+  return (__atomic_load_n(&c->done[slot / 8], __ATOMIC_ACQUIRE) >> (slot % 8)) & 1;
+}
+
+
+SimResult *unitResult(Checkpoint *c, s32 index) {
+  return &c->results[unitSlot(c, index)];
+}
+
+
+// Marks a unit as done without saving, e.g. when merging shards
+void setUnitResult(Checkpoint *c, s32 index, SimResult *r) {
+  s32 slot = unitSlot(c, index);
+  c->results[slot] = *r;
+  __atomic_fetch_or(&c->done[slot / 8], (u8) (1 << (slot % 8)), __ATOMIC_RELEASE);
+}
+
+
+// Records a unit's result, and saves the checkpoint if the interval has
+// passed and no other thread is already saving
+void finishUnit(Checkpoint *c, s32 index, SimResult *r) {
+  if (c == NULL) return;
+
+  setUnitResult(c, index, r);
+
+  // Read without the lock, so it's written atomically too
+  if (time(NULL) - __atomic_load_n(&c->lastSave, __ATOMIC_RELAXED) < c->interval) return;
+  if (pthread_mutex_trylock(&c->lock) != 0) return;
+
+  if (time(NULL) - c->lastSave >= c->interval) {
+    writeFileAtomic(c->filename, writeUnits, c);
+    __atomic_store_n(&c->lastSave, time(NULL), __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+
+void saveCheckpoint(Checkpoint *c) {
+  if (c == NULL) return;
+
+  pthread_mutex_lock(&c->lock);
+  writeFileAtomic(c->filename, writeUnits, c);
+  __atomic_store_n(&c->lastSave, time(NULL), __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&c->lock);
+}
+
+
+// Saves the final state, unless the checkpoint has no file, and frees it
+void closeCheckpoint(Checkpoint *c) {
+  if (c == NULL) return;
+
+  if (c->filename != NULL)
+    saveCheckpoint(c);
+  pthread_mutex_destroy(&c->lock);
+  free(c->done);
+  free(c->results);
+  free(c);
+}
@@ -0,0 +1,81 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+
+#include "state.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+
+// Sweep modes that can be checkpointed
+#define CHECKPOINT_ULP 1
+#define CHECKPOINT_SEEDS 2
+#define CHECKPOINT_MC 3
+
+// Options of the run that are needed to report its results
+#define CHECKPOINT_PARAMS 8
+
+
+typedef struct {
+  char *filename;
+  s32 interval;
+  bool resume;
+} CheckpointConfig;
+
+
+// Interleaved slice of a sweep's work units, so that runs on separate
+// machines can split the work without coordinating. index is 0-based.
+typedef struct {
+  s32 index;
+  s32 count;
+} Shard;
+
+
+// Progress of a sweep made of independent, deterministic work units that
+// each produce a SimResult. Units are finished from any thread. count is the
+// number of units in the whole sweep, but only the shard's numUnits are
+// stored, so units are looked up by their index in the whole sweep.
+typedef struct {
+  char *filename;
+  s32 interval;
+  time_t lastSave;
+  pthread_mutex_t lock;
+
+  s32 mode;
+  s32 params[CHECKPOINT_PARAMS];
+  u64 key;
+  s32 count;
+  Shard shard;
+  s32 numUnits;
+  u8 *done;
+  SimResult *results;
+} Checkpoint;
+
+
+typedef bool (*FileWriter)(FILE *f, void *arg);
+
+bool writeFileAtomic(char *filename, FileWriter write, void *arg);
+
+u64 mixHash(u64 h, u64 x);
+u64 hashStartState(SimState *s);
+
+s32 shardSize(Shard *shard, s32 total);
+s32 shardUnit(Shard *shard, s32 i);
+
+Checkpoint *newCheckpoint(s32 mode, u64 key, s32 count, s32 *params, Shard *shard);
+Checkpoint *openCheckpoint(CheckpointConfig *config, s32 mode, u64 key, s32 count, s32 *params,
+  Shard *shard);
+Checkpoint *readCheckpointFile(char *filename);
+bool isCheckpointFile(char *filename);
+bool isUnitDone(Checkpoint *c, s32 index);
+SimResult *unitResult(Checkpoint *c, s32 index);
+void setUnitResult(Checkpoint *c, s32 index, SimResult *r);
+void finishUnit(Checkpoint *c, s32 index, SimResult *r);
+void saveCheckpoint(Checkpoint *c);
+void closeCheckpoint(Checkpoint *c);
+
+
+#endif
@@ -1,16 +1,20 @@
 #include "cog.h"
 
+#include "rng.h"
 #include "util.h"
 
 #include <stdlib.h>
 
 
-s8 *cogRngOverride;
-s32 numCogRngCalls = 0;
-s8 cogRngCall = 127;
+THREAD_LOCAL s8 *cogRngOverride;
+THREAD_LOCAL s32 numCogRngCalls = 0;
+THREAD_LOCAL s8 cogRngCall = 127;
 
 s16 ttcSpeedSetting = 0;
 
+// RNG calls made each frame by other objects that update before the cog
+s32 extraRngCalls = 0;
+
 static s16 ttcCogSpeeds[] = { 200, 400 };
 
 s16 cogModel[] = {
@@ -30,9 +34,34 @@ s16 cogModel[] = {
 };
 
 
+// The roll the cog makes from the game's RNG, consuming two calls
+s32 randomCogRoll(void) {
+  return (randomU16() % 7) * randomUnit();
+}
+
+
+static void rollCogTarget(Object *o) {
+  s32 rngResult;
+  if (cogRngOverride != NULL && *cogRngOverride != 127)
+    rngResult = *cogRngOverride++;
+  else
+    rngResult = randomCogRoll();
+  cogRngCall = rngResult;
+
+  numCogRngCalls += 1;
+
+  // Note: Different associativity than in the actual game, but doesn't
+  // matter here.
+  o->yawVelTarget = 200.0f * rngResult;
+}
+
+
 void updateTtcCog(Object *o) {
   cogRngCall = 127;
 
+  for (s32 i = 0; i < extraRngCalls; i++)
+    randomU16();
+
   switch (ttcSpeedSetting) {
   case 0:
   case 1:
@@ -40,20 +69,8 @@ void updateTtcCog(Object *o) {
     break;
   
   case 2:
-    if (incTowardSymFP(&o->yawVel, o->yawVelTarget, 50.0f)) {
-      s32 rngResult;
-      if (cogRngOverride != NULL && *cogRngOverride != 127)
-        rngResult = *cogRngOverride++;
-      else
-        rngResult = (randomU16() % 7) * randomUnit();
-      cogRngCall = rngResult;
-
-      numCogRngCalls += 1;
-
-      // Note: Different associativity than in the actual game, but doesn't
-      // matter here.
-      o->yawVelTarget = 200.0f * rngResult;
-    }
+    if (incTowardSymFP(&o->yawVel, o->yawVelTarget, 50.0f))
+      rollCogTarget(o);
     break;
 
   case 3:
@@ -62,3 +79,77 @@ void updateTtcCog(Object *o) {
 
   o->displayAngle.yaw += (s32) o->yawVel;
 }
+
+
+// yawVel and yawVelTarget are exact integers in practice, in which case a
+// whole ramp toward the target can be summed in closed form
+static bool isSmallInt(f32 x) {
+  return x >= -8388608.0f && x <= 8388608.0f && x == (f32) (s32) x;
+}
+
+
+// Equivalent to calling updateTtcCog frames times, but takes time
+// proportional to the number of RNG rolls rather than the number of frames.
+void skipTtcCog(Object *o, s64 frames) {
+  if (frames <= 0) return;
+  cogRngCall = 127;
+
+  if (ttcSpeedSetting != 2)
+    advanceRng(frames * extraRngCalls);
+
+  switch (ttcSpeedSetting) {
+  case 0:
+  case 1:
+    o->yawVel = ttcCogSpeeds[ttcSpeedSetting];
+    o->displayAngle.yaw += (s32) ((u32) (s32) o->yawVel * (u32) frames);
+    return;
+
+  case 3:
+    o->displayAngle.yaw += (s32) ((u32) (s32) o->yawVel * (u32) frames);
+    return;
+  }
+
+  while (frames > 0) {
+    if (!isSmallInt(o->yawVel) || !isSmallInt(o->yawVelTarget)) {
+      updateTtcCog(o);
+      frames -= 1;
+      continue;
+    }
+
+    s64 v = (s64) o->yawVel;
+    s64 target = (s64) o->yawVelTarget;
+    s64 dir = v > target ? -50 : 50;
+    s64 dist = v > target ? v - target : target - v;
+
+    // Number of frames until incTowardSymFP reaches the target; it overshoots
+    // and snaps on the last one, and rolls immediately if already there
+    s64 rampFrames = dist == 0 ? 1 : (dist + 49) / 50;
+
+    s64 n = rampFrames - 1 < frames ? rampFrames - 1 : frames;
+    s64 sum = n * v + dir * (n * (n + 1) / 2);
+
+    if (n == frames) {
+      advanceRng(n * extraRngCalls);
+      o->yawVel = (f32) (v + dir * n);
+      o->displayAngle.yaw += (s32) (u32) (u64) sum;
+      cogRngCall = 127;
+      return;
+    }
+
+    o->yawVel = (f32) target;
+    o->displayAngle.yaw += (s32) (u32) (u64) (sum + target);
+    frames -= rampFrames;
+
+    advanceRng(rampFrames * extraRngCalls);
+    rollCogTarget(o);
+  }
+}
+
+
+// Whether the next call to updateTtcCog will consume an RNG roll
+bool cogNeedsRoll(Object *o) {
+  if (ttcSpeedSetting != 2) return false;
+
+  f32 yawVel = o->yawVel;
+  return incTowardSymFP(&yawVel, o->yawVelTarget, 50.0f);
+}
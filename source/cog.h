@@ -5,15 +5,19 @@
 #include "util.h"
 
 
-extern s8 *cogRngOverride;
-extern s32 numCogRngCalls;
-extern s8 cogRngCall;
+extern THREAD_LOCAL s8 *cogRngOverride;
+extern THREAD_LOCAL s32 numCogRngCalls;
+extern THREAD_LOCAL s8 cogRngCall;
 
 extern s16 ttcSpeedSetting;
+extern s32 extraRngCalls;
 extern s16 cogModel[];
 
 
+s32 randomCogRoll(void);
 void updateTtcCog(Object *o);
+void skipTtcCog(Object *o, s64 frames);
+bool cogNeedsRoll(Object *o);
 
 
 #endif
\ No newline at end of file
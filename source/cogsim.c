@@ -0,0 +1,214 @@
+#include "cogsim.h"
+
+#include "cog.h"
+#include "level.h"
+#include "objects.h"
+#include "state.h"
+#include "thread.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// Simulation globals are thread local, so a context keeps its own copy of
+// the state and swaps it in for each call
+struct CogsimContext {
+  SimState state;
+  s8 *rolls;
+};
+
+
+typedef struct {
+  CogsimContext *cx;
+  const CogsimState *starts;
+  s32 maxFrames;
+  CogsimResult *results;
+} CogsimBatch;
+
+
+void cogsim_setSpeedSetting(int32_t setting) {
+  if (setting >= 0 && setting <= 3)
+    ttcSpeedSetting = (s16) setting;
+}
+
+
+void cogsim_setExtraRngCalls(int32_t calls) {
+  extraRngCalls = calls;
+}
+
+
+void cogsim_setThreads(int32_t threads) {
+  numThreads = threads;
+}
+
+
+int32_t cogsim_loadLevel(const char *filename) {
+  return loadLevel((char *) filename);
+}
+
+
+int32_t cogsim_addObject(const int16_t *model, int32_t modelLength,
+  float x, float y, float z, int32_t yaw, int32_t yawSpeed)
+{
+  if (model == NULL)
+    return addOtherObject(cogModel, collisionModelLength(cogModel, 0x7FFFFFFF),
+      (v3f) { x, y, z }, yaw, yawSpeed);
+  return addOtherObject((s16 *) model, modelLength, (v3f) { x, y, z }, yaw, yawSpeed);
+}
+
+
+CogsimContext *cogsim_create(void) {
+  CogsimContext *cx = (CogsimContext *) calloc(1, sizeof(CogsimContext));
+
+  SimState saved;
+  saveState(&saved);
+
+  memset(&mario, 0, sizeof(MarioState));
+  memset(&cog, 0, sizeof(Object));
+  initState();
+  rngState = 0;
+  cogRngOverride = NULL;
+  numCogRngCalls = 0;
+  cogTrajectory = NULL;
+  trajectoryFrame = 0;
+  currentFrame = 0;
+  saveState(&cx->state);
+
+  restoreState(&saved);
+  return cx;
+}
+
+
+void cogsim_destroy(CogsimContext *cx) {
+  free(cx->rolls);
+  free(cx);
+}
+
+
+static void applyState(SimState *s, const CogsimState *state) {
+  s->mario.pos.x = state->marioX;
+  s->mario.pos.z = state->marioZ;
+  s->mario.facingYaw = state->marioYaw;
+  s->mario.hSpeed = state->hSpeed;
+
+  s->cog.displayAngle.yaw = state->cogYaw;
+  s->cog.yawVel = state->cogSpeed;
+  s->cog.yawVelTarget = state->cogSpeedTarget;
+
+  s->rngState = state->rngState;
+}
+
+
+// Also resets the cog's roll count and the other objects' yaws, and restarts
+// the rolls set by cogsim_setRolls from the first one
+void cogsim_setState(CogsimContext *cx, const CogsimState *state) {
+  applyState(&cx->state, state);
+  cx->state.numCogRngCalls = 0;
+  cx->state.cogRngOverride = cx->rolls;
+  cx->state.frame = 0;
+}
+
+
+void cogsim_getState(CogsimContext *cx, CogsimState *state) {
+  SimState *s = &cx->state;
+
+  state->marioX = s->mario.pos.x;
+  state->marioZ = s->mario.pos.z;
+  state->marioYaw = s->mario.facingYaw;
+  state->hSpeed = s->mario.hSpeed;
+
+  state->cogYaw = (s16) s->cog.displayAngle.yaw;
+  state->cogSpeed = s->cog.yawVel;
+  state->cogSpeedTarget = s->cog.yawVelTarget;
+
+  state->rngState = s->rngState;
+}
+
+
+// Rolls for the cog to use before falling back to the RNG, each in -6...6.
+// The rolls are copied.
+void cogsim_setRolls(CogsimContext *cx, const int8_t *rolls, int32_t count) {
+  free(cx->rolls);
+  cx->rolls = NULL;
+
+  if (count > 0) {
+    cx->rolls = (s8 *) malloc(count + 1);
+    memcpy(cx->rolls, rolls, count);
+    cx->rolls[count] = 127;
+  }
+  cx->state.cogRngOverride = cx->rolls;
+}
+
+
+// Advances up to frames frames, stopping early if a frame fails. If
+// frames_out is non-NULL, the state after each completed frame is written to
+// it. Returns the number of frames completed.
+int32_t cogsim_step(CogsimContext *cx, int32_t frames, CogsimFrame *frames_out, CogsimResult *result) {
+  SimState saved;
+  saveState(&saved);
+  restoreState(&cx->state);
+
+  FrameResult r = fr_success;
+  s32 done = 0;
+  while (done < frames) {
+    r = frameAdvance();
+    if (r != fr_success) break;
+
+    if (frames_out != NULL) {
+      CogsimFrame *f = &frames_out[done];
+      f->rng = cogRngCall;
+      f->intendedYaw = (s16) mario.intendedYaw;
+      f->hSpeed = mario.hSpeed;
+      f->cogYaw = (s16) cog.displayAngle.yaw;
+      f->cogSpeed = cog.yawVel;
+      f->cogSpeedTarget = cog.yawVelTarget;
+    }
+    done += 1;
+  }
+
+  if (result != NULL) {
+    result->result = (s32) r;
+    result->frames = done;
+    result->cogRngCalls = numCogRngCalls;
+    result->hSpeed = mario.hSpeed;
+  }
+
+  saveState(&cx->state);
+  restoreState(&saved);
+  return done;
+}
+
+
+static void runBatchItem(s32 index, void *arg) {
+  CogsimBatch *b = (CogsimBatch *) arg;
+
+  SimState start = b->cx->state;
+  applyState(&start, &b->starts[index]);
+  start.numCogRngCalls = 0;
+  start.cogRngOverride = b->cx->rolls;
+  start.frame = 0;
+  restoreState(&start);
+
+  SimResult r = runUntilFailure(b->maxFrames);
+  CogsimResult *out = &b->results[index];
+  out->result = (s32) r.result;
+  out->frames = r.frames;
+  out->cogRngCalls = r.numCogRngCalls;
+  out->hSpeed = r.hSpeed;
+}
+
+
+// Runs every start state until failure or maxFrames, in parallel, using the
+// context's rolls. The context's own state is left unchanged.
+void cogsim_runBatch(CogsimContext *cx, const CogsimState *starts, int32_t count,
+  int32_t maxFrames, CogsimResult *results)
+{
+  SimState saved;
+  saveState(&saved);
+
+  CogsimBatch b = { cx, starts, maxFrames, results };
+  parallelFor(count, runBatchItem, &b);
+
+  restoreState(&saved);
+}
@@ -0,0 +1,94 @@
+#ifndef COGSIM_H
+#define COGSIM_H
+
+
+// C API of libcogsim. Only fixed-size standard types are used so that
+// bindings don't need the simulator's own headers.
+
+#include <stdint.h>
+
+
+typedef struct CogsimContext CogsimContext;
+
+// Threading: each context may be used by one thread at a time, and different
+// contexts may run on different threads. Contexts may be created on any
+// thread, including while others run. Batches from several threads share
+// one worker pool and run one after another. The process-wide settings,
+// cogsim_loadLevel and cogsim_addObject change state that every context reads
+// (loading a level frees the previous one), so they must not be called while
+// any context is stepping or running a batch.
+
+
+// The part of the simulation state that varies between runs. Mario's y and
+// the cog's position are fixed.
+typedef struct {
+  float marioX;
+  float marioZ;
+  int16_t marioYaw;
+  float hSpeed;
+
+  int16_t cogYaw;
+  float cogSpeed;
+  float cogSpeedTarget;
+
+  uint16_t rngState;
+} CogsimState;
+
+
+// result is 0 if the run reached its frame limit, otherwise the reason it
+// stopped:
+//   1 = cog slid under Mario
+//   2 = no input lands
+//   3 = impossible to land without losing speed
+//   4 = not under ceiling
+typedef struct {
+  int32_t result;
+  int32_t frames;
+  int32_t cogRngCalls;
+  float hSpeed;
+} CogsimResult;
+
+
+// State after a frame. rng is the cog's roll on that frame, or 127 if it
+// didn't roll.
+typedef struct {
+  int32_t rng;
+  int16_t intendedYaw;
+  float hSpeed;
+  int16_t cogYaw;
+  float cogSpeed;
+  float cogSpeedTarget;
+} CogsimFrame;
+
+
+// Process-wide settings, shared by every context. Speed settings outside
+// 0...3 are ignored.
+void cogsim_setSpeedSetting(int32_t setting);
+void cogsim_setExtraRngCalls(int32_t calls);
+void cogsim_setThreads(int32_t threads);
+
+// Loads static level collision from a collision.inc.c file. Returns 0 on
+// failure.
+int32_t cogsim_loadLevel(const char *filename);
+
+// Adds an object whose collision is loaded after the cog's every frame,
+// turning by yawSpeed per frame from yaw. Only constant turning and floors
+// are supported. model is in the game's collision format (0x40 ... 0x41), or
+// NULL for the cog's. Returns 0 if the model is malformed or has walls or
+// ceilings.
+int32_t cogsim_addObject(const int16_t *model, int32_t modelLength,
+  float x, float y, float z, int32_t yaw, int32_t yawSpeed);
+
+CogsimContext *cogsim_create(void);
+void cogsim_destroy(CogsimContext *cx);
+
+void cogsim_setState(CogsimContext *cx, const CogsimState *state);
+void cogsim_getState(CogsimContext *cx, CogsimState *state);
+void cogsim_setRolls(CogsimContext *cx, const int8_t *rolls, int32_t count);
+
+int32_t cogsim_step(CogsimContext *cx, int32_t frames, CogsimFrame *frames_out, CogsimResult *result);
+void cogsim_runBatch(CogsimContext *cx, const CogsimState *starts, int32_t count,
+  int32_t maxFrames, CogsimResult *results);
+
+
+#endif
@@ -0,0 +1,357 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "frontier.h"
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// Runs merged at once, to stay well under open file limits. More runs are
+// merged in several passes.
+#define MAX_MERGE 256
+
+#define READ_BUFFER_RECORDS 4096
+#define WRITE_BUFFER_BYTES (1 << 20)
+
+
+static void fail(char *message, char *filename) {
+  fprintf(stderr, "%s '%s'\n", message, filename);
+  exit(1);
+}
+
+
+bool openRecordReader(RecordReader *r, char *filename, u32 recordSize) {
+  memset(r, 0, sizeof(RecordReader));
+  r->recordSize = recordSize;
+
+#if !defined(WIN32)
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  r->count = (u64) st.st_size / recordSize;
+  r->mapSize = (u64) st.st_size;
+
+  if (r->mapSize > 0) {
+    void *data = mmap(NULL, r->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    posix_madvise(data, r->mapSize, POSIX_MADV_SEQUENTIAL);
+    r->data = (u8 *) data;
+  }
+
+  close(fd);
+  return true;
+#else
+  r->f = fopen(filename, "rb");
+  if (r->f == NULL) return false;
+
+  _fseeki64(r->f, 0, SEEK_END);
+  r->count = (u64) _ftelli64(r->f) / recordSize;
+  _fseeki64(r->f, 0, SEEK_SET);
+
+  r->buffer = (u8 *) malloc((size_t) READ_BUFFER_RECORDS * recordSize);
+  return true;
+#endif
+}
+
+
+// Returns NULL at the end of the file. The record is valid until the next
+// call.
+void *readRecord(RecordReader *r) {
+  if (r->next >= r->count) return NULL;
+
+  if (r->data != NULL)
+    return r->data + (r->next++) * r->recordSize;
+
+  if (r->bufferPos == r->buffered) {
+    r->buffered = (u32) fread(r->buffer, r->recordSize, READ_BUFFER_RECORDS, r->f);
+    r->bufferPos = 0;
+    if (r->buffered == 0) return NULL;
+  }
+
+  r->next += 1;
+  return r->buffer + (r->bufferPos++) * r->recordSize;
+}
+
+
+void closeRecordReader(RecordReader *r) {
+#if !defined(WIN32)
+  if (r->data != NULL)
+    munmap(r->data, r->mapSize);
+#endif
+  if (r->f != NULL)
+    fclose(r->f);
+  free(r->buffer);
+  memset(r, 0, sizeof(RecordReader));
+}
+
+
+bool readRecordAt(char *filename, u32 recordSize, u64 index, void *record) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) return false;
+
+#if defined(WIN32)
+  bool ok = _fseeki64(f, (s64) (index * recordSize), SEEK_SET) == 0;
+#else
+  bool ok = fseeko(f, (off_t) (index * recordSize), SEEK_SET) == 0;
+#endif
+  ok = ok && fread(record, recordSize, 1, f) == 1;
+  fclose(f);
+  return ok;
+}
+
+
+void initSpillSorter(SpillSorter *s, char *prefix, u32 recordSize, u64 memoryBytes,
+  RecordCompare compare, RecordCompare same)
+{
+  memset(s, 0, sizeof(SpillSorter));
+  s->prefix = prefix;
+  s->recordSize = recordSize;
+  s->compare = compare;
+  s->same = same;
+
+  u64 capacity = memoryBytes / recordSize;
+  if (capacity < 1024) capacity = 1024;
+  if (capacity > 0x7FFFFFFF) capacity = 0x7FFFFFFF;
+  s->capacity = (u32) capacity;
+  s->buffer = (u8 *) malloc((size_t) s->capacity * recordSize);
+  if (s->buffer == NULL) {
+    fprintf(stderr, "Not enough memory for a %llu byte spill buffer\n",
+      (unsigned long long) memoryBytes);
+    exit(1);
+  }
+}
+
+
+// Sorts the buffer and removes duplicates, returning the new count
+static u32 sortBuffer(SpillSorter *s) {
+  if (s->count == 0) return 0;
+  qsort(s->buffer, s->count, s->recordSize, s->compare);
+
+  u32 n = 1;
+  for (u32 i = 1; i < s->count; i++) {
+    u8 *record = s->buffer + (size_t) i * s->recordSize;
+    u8 *last = s->buffer + (size_t) (n - 1) * s->recordSize;
+    if (s->same(record, last) == 0) continue;
+    if (n != i)
+      memcpy(s->buffer + (size_t) n * s->recordSize, record, s->recordSize);
+    n += 1;
+  }
+  return n;
+}
+
+
+static FILE *openOutput(char *filename) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) fail("Failed to open", filename);
+  setvbuf(f, NULL, _IOFBF, WRITE_BUFFER_BYTES);
+  return f;
+}
+
+
+static void closeOutput(FILE *f, char *filename) {
+  if (fclose(f) != 0) fail("Failed to write", filename);
+}
+
+
+static char *runName(SpillSorter *s) {
+  char *name = (char *) malloc(strlen(s->prefix) + 32);
+  sprintf(name, "%s-run-%d.bin", s->prefix, s->nextRunId++);
+  return name;
+}
+
+
+static void addRun(SpillSorter *s, char *name) {
+  if (s->numRuns == s->maxRuns) {
+    s->maxRuns = s->maxRuns > 0 ? 2 * s->maxRuns : 16;
+    s->runs = (char **) realloc(s->runs, s->maxRuns * sizeof(char *));
+  }
+  s->runs[s->numRuns++] = name;
+}
+
+
+static void spillBuffer(SpillSorter *s) {
+  u32 n = sortBuffer(s);
+
+  char *name = runName(s);
+  FILE *f = openOutput(name);
+  if (fwrite(s->buffer, s->recordSize, n, f) != n) fail("Failed to write", name);
+  closeOutput(f, name);
+
+  addRun(s, name);
+  s->numSpilled += n;
+  s->count = 0;
+}
+
+
+void spillAdd(SpillSorter *s, void *record) {
+  if (s->count == s->capacity)
+    spillBuffer(s);
+  memcpy(s->buffer + (size_t) s->count * s->recordSize, record, s->recordSize);
+  s->count += 1;
+  s->numAdded += 1;
+}
+
+
+typedef struct {
+  SpillSorter *s;
+  RecordReader *readers;
+  void **heads;
+  s32 *heap;
+  s32 heapSize;
+} Merge;
+
+
+// Ties go to the earlier run, so the result doesn't depend on heap order
+static bool mergeLess(Merge *m, s32 a, s32 b) {
+  int c = m->s->compare(m->heads[a], m->heads[b]);
+  return c < 0 || (c == 0 && a < b);
+}
+
+
+static void siftDown(Merge *m, s32 i) {
+  while (true) {
+    s32 c = 2 * i + 1;
+    if (c >= m->heapSize) break;
+    if (c + 1 < m->heapSize && mergeLess(m, m->heap[c + 1], m->heap[c])) c += 1;
+    if (!mergeLess(m, m->heap[c], m->heap[i])) break;
+
+    s32 t = m->heap[i];
+    m->heap[i] = m->heap[c];
+    m->heap[c] = t;
+    i = c;
+  }
+}
+
+
+// Streams the runs through a heap into one sorted file without duplicates,
+// and deletes them
+static u64 mergeRuns(SpillSorter *s, char **runs, s32 numRuns, char *filename) {
+  Merge m;
+  m.s = s;
+  m.readers = (RecordReader *) malloc(numRuns * sizeof(RecordReader));
+  m.heads = (void **) malloc(numRuns * sizeof(void *));
+  m.heap = (s32 *) malloc(numRuns * sizeof(s32));
+  m.heapSize = 0;
+
+  for (s32 i = 0; i < numRuns; i++) {
+    if (!openRecordReader(&m.readers[i], runs[i], s->recordSize))
+      fail("Failed to open", runs[i]);
+    m.heads[i] = readRecord(&m.readers[i]);
+    if (m.heads[i] != NULL)
+      m.heap[m.heapSize++] = i;
+  }
+  for (s32 i = m.heapSize / 2 - 1; i >= 0; i--)
+    siftDown(&m, i);
+
+  FILE *f = openOutput(filename);
+  u8 *last = (u8 *) malloc(s->recordSize);
+  u64 count = 0;
+
+  while (m.heapSize > 0) {
+    s32 top = m.heap[0];
+    void *record = m.heads[top];
+
+    if (count == 0 || s->same(record, last) != 0) {
+      if (fwrite(record, s->recordSize, 1, f) != 1) fail("Failed to write", filename);
+      memcpy(last, record, s->recordSize);
+      count += 1;
+    }
+
+    m.heads[top] = readRecord(&m.readers[top]);
+    if (m.heads[top] == NULL)
+      m.heap[0] = m.heap[--m.heapSize];
+    siftDown(&m, 0);
+  }
+
+  closeOutput(f, filename);
+
+  for (s32 i = 0; i < numRuns; i++) {
+    closeRecordReader(&m.readers[i]);
+    remove(runs[i]);
+  }
+
+  free(last);
+  free(m.readers);
+  free(m.heads);
+  free(m.heap);
+  return count;
+}
+
+
+// Writes every record added so far to filename, sorted and without
+// duplicates, and returns how many were written. The sorter is empty
+// afterwards and can be reused.
+u64 spillFinish(SpillSorter *s, char *filename) {
+  u64 count;
+
+  if (s->numRuns == 0) {
+    u32 n = sortBuffer(s);
+    FILE *f = openOutput(filename);
+    if (fwrite(s->buffer, s->recordSize, n, f) != n) fail("Failed to write", filename);
+    closeOutput(f, filename);
+    count = n;
+  }
+  else {
+    if (s->count > 0)
+      spillBuffer(s);
+
+    // Earlier runs are merged first so that ties still favor them
+    while (s->numRuns > MAX_MERGE) {
+      char **runs = s->runs;
+      s32 numRuns = s->numRuns;
+      s->runs = NULL;
+      s->numRuns = 0;
+      s->maxRuns = 0;
+
+      for (s32 i = 0; i < numRuns; i += MAX_MERGE) {
+        s32 n = numRuns - i < MAX_MERGE ? numRuns - i : MAX_MERGE;
+        char *name = runName(s);
+        mergeRuns(s, &runs[i], n, name);
+        addRun(s, name);
+      }
+
+      for (s32 i = 0; i < numRuns; i++)
+        free(runs[i]);
+      free(runs);
+    }
+
+    count = mergeRuns(s, s->runs, s->numRuns, filename);
+    for (s32 i = 0; i < s->numRuns; i++)
+      free(s->runs[i]);
+    s->numRuns = 0;
+  }
+
+  s->count = 0;
+  s->numAdded = 0;
+  s->numSpilled = 0;
+  return count;
+}
+
+
+void freeSpillSorter(SpillSorter *s) {
+  for (s32 i = 0; i < s->numRuns; i++) {
+    remove(s->runs[i]);
+    free(s->runs[i]);
+  }
+  free(s->runs);
+  free(s->buffer);
+  memset(s, 0, sizeof(SpillSorter));
+}
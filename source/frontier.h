@@ -0,0 +1,67 @@
+#ifndef FRONTIER_H
+#define FRONTIER_H
+
+
+#include "util.h"
+
+#include <stdio.h>
+
+
+typedef int (*RecordCompare)(const void *a, const void *b);
+
+
+// Sequential reader of a file of fixed-size records. The file is mapped into
+// memory where possible, and read through a buffer otherwise.
+typedef struct {
+  u32 recordSize;
+  u64 count;
+  u64 next;
+
+  u8 *data;
+  u64 mapSize;
+
+  FILE *f;
+  u8 *buffer;
+  u32 buffered;
+  u32 bufferPos;
+} RecordReader;
+
+
+// Sorts a stream of fixed-size records that may not fit in memory. Records
+// are collected in a buffer that is sorted, deduplicated and written to a run
+// file whenever it fills up, and the runs are then merged into one sorted file
+// without duplicates. Records are equal if same says so; the first in compare
+// order is kept.
+typedef struct {
+  char *prefix;
+  u32 recordSize;
+  RecordCompare compare;
+  RecordCompare same;
+
+  u8 *buffer;
+  u32 capacity;
+  u32 count;
+
+  char **runs;
+  s32 numRuns;
+  s32 maxRuns;
+  s32 nextRunId;
+
+  u64 numAdded;
+  u64 numSpilled;
+} SpillSorter;
+
+
+bool openRecordReader(RecordReader *r, char *filename, u32 recordSize);
+void *readRecord(RecordReader *r);
+void closeRecordReader(RecordReader *r);
+bool readRecordAt(char *filename, u32 recordSize, u64 index, void *record);
+
+void initSpillSorter(SpillSorter *s, char *prefix, u32 recordSize, u64 memoryBytes,
+  RecordCompare compare, RecordCompare same);
+void spillAdd(SpillSorter *s, void *record);
+u64 spillFinish(SpillSorter *s, char *filename);
+void freeSpillSorter(SpillSorter *s);
+
+
+#endif
@@ -0,0 +1,277 @@
+#include "json.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// Deepest nesting of arrays and objects accepted, so that a hostile document
+// can't overflow the parser's stack
+#define MAX_DEPTH 64
+
+
+typedef struct {
+  char *s;
+  char *error;
+  int depth;
+} ParseCxt;
+
+
+static JsonValue *newValue(JsonType type) {
+  JsonValue *v = (JsonValue *) calloc(1, sizeof(JsonValue));
+  v->type = type;
+  return v;
+}
+
+
+static void skipSpace(ParseCxt *p) {
+  while (*p->s == ' ' || *p->s == '\t' || *p->s == '\n' || *p->s == '\r')
+    p->s += 1;
+}
+
+
+static bool eat(ParseCxt *p, char c) {
+  skipSpace(p);
+  if (*p->s != c) return false;
+  p->s += 1;
+  return true;
+}
+
+
+static bool eatWord(ParseCxt *p, char *word) {
+  size_t n = strlen(word);
+  if (strncmp(p->s, word, n) != 0) return false;
+  p->s += n;
+  return true;
+}
+
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+
+// Expects the opening quote to have been consumed. Escapes outside of ASCII
+// are replaced with '?'.
+static char *parseString(ParseCxt *p) {
+  size_t cap = 16;
+  size_t len = 0;
+  char *out = (char *) malloc(cap);
+
+  while (*p->s != '"') {
+    if (*p->s == '\0') {
+      p->error = "Unterminated string";
+      free(out);
+      return NULL;
+    }
+
+    char c = *p->s++;
+    if (c == '\\') {
+      c = *p->s++;
+      switch (c) {
+      case '"': case '\\': case '/': break;
+      case 'b': c = '\b'; break;
+      case 'f': c = '\f'; break;
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 't': c = '\t'; break;
+      case 'u': {
+        int code = 0;
+        for (int i = 0; i < 4; i++) {
+          int d = hexDigit(*p->s);
+          if (d < 0) {
+            p->error = "Invalid \\u escape";
+            free(out);
+            return NULL;
+          }
+          code = 16 * code + d;
+          p->s += 1;
+        }
+        c = code < 0x80 ? (char) code : '?';
+        break;
+      }
+      default:
+        p->error = "Invalid escape";
+        free(out);
+        return NULL;
+      }
+    }
+
+    if (len + 2 > cap) {
+      cap *= 2;
+      out = (char *) realloc(out, cap);
+    }
+    out[len++] = c;
+  }
+
+  p->s += 1;
+  out[len] = '\0';
+  return out;
+}
+
+
+static JsonValue *parseValue(ParseCxt *p);
+
+
+static JsonValue *parseArray(ParseCxt *p) {
+  JsonValue *v = newValue(json_array);
+  JsonValue **tail = &v->head;
+
+  if (eat(p, ']')) return v;
+  do {
+    JsonValue *e = parseValue(p);
+    if (e == NULL) {
+      json_free(v);
+      return NULL;
+    }
+    *tail = e;
+    tail = &e->next;
+  } while (eat(p, ','));
+
+  if (!eat(p, ']')) {
+    p->error = "Expected ',' or ']'";
+    json_free(v);
+    return NULL;
+  }
+  return v;
+}
+
+
+static JsonValue *parseObject(ParseCxt *p) {
+  JsonValue *v = newValue(json_object);
+  JsonValue **tail = &v->head;
+
+  if (eat(p, '}')) return v;
+  do {
+    char *key = NULL;
+    JsonValue *m = NULL;
+
+    if (!eat(p, '"'))
+      p->error = "Expected member name";
+    else if ((key = parseString(p)) != NULL && !eat(p, ':'))
+      p->error = "Expected ':'";
+    else if (key != NULL)
+      m = parseValue(p);
+
+    if (m == NULL) {
+      free(key);
+      json_free(v);
+      return NULL;
+    }
+    m->key = key;
+    *tail = m;
+    tail = &m->next;
+  } while (eat(p, ','));
+
+  if (!eat(p, '}')) {
+    p->error = "Expected ',' or '}'";
+    json_free(v);
+    return NULL;
+  }
+  return v;
+}
+
+
+static JsonValue *parseValue(ParseCxt *p) {
+  skipSpace(p);
+  char c = *p->s;
+
+  if (c == '{' || c == '[') {
+    if (p->depth >= MAX_DEPTH) {
+      p->error = "Nested too deeply";
+      return NULL;
+    }
+    p->s += 1;
+    p->depth += 1;
+    JsonValue *v = c == '{' ? parseObject(p) : parseArray(p);
+    p->depth -= 1;
+    return v;
+  }
+  if (c == '"') {
+    p->s += 1;
+    char *s = parseString(p);
+    if (s == NULL) return NULL;
+    JsonValue *v = newValue(json_string);
+    v->string = s;
+    return v;
+  }
+  if (eatWord(p, "true") || eatWord(p, "false")) {
+    JsonValue *v = newValue(json_bool);
+    v->boolean = c == 't';
+    return v;
+  }
+  if (eatWord(p, "null"))
+    return newValue(json_null);
+
+  char *end;
+  double number = strtod(p->s, &end);
+  if (end == p->s || (c != '-' && (c < '0' || c > '9'))) {
+    p->error = "Unexpected character";
+    return NULL;
+  }
+  p->s = end;
+
+  JsonValue *v = newValue(json_number);
+  v->number = number;
+  return v;
+}
+
+
+// Parses a complete JSON document. On failure returns NULL and sets *error
+// to a static message.
+JsonValue *json_parse(char *text, char **error) {
+  ParseCxt p = { text, NULL, 0 };
+
+  JsonValue *v = parseValue(&p);
+  if (v != NULL) {
+    skipSpace(&p);
+    if (*p.s != '\0') {
+      p.error = "Trailing characters";
+      json_free(v);
+      v = NULL;
+    }
+  }
+
+  if (error != NULL)
+    *error = p.error;
+  return v;
+}
+
+
+void json_free(JsonValue *v) {
+  while (v != NULL) {
+    JsonValue *next = v->next;
+    json_free(v->head);
+    free(v->string);
+    free(v->key);
+    free(v);
+    v = next;
+  }
+}
+
+
+// Member of an object, or NULL if absent
+JsonValue *json_get(JsonValue *object, char *key) {
+  if (object == NULL || object->type != json_object) return NULL;
+  for (JsonValue *m = object->head; m != NULL; m = m->next) {
+    if (strcmp(m->key, key) == 0) return m;
+  }
+  return NULL;
+}
+
+
+void json_writeString(FILE *f, char *s) {
+  fputc('"', f);
+  for (; *s != '\0'; s++) {
+    unsigned char c = (unsigned char) *s;
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\u%04x", c);
+    else
+      fputc(c, f);
+  }
+  fputc('"', f);
+}
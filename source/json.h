@@ -0,0 +1,43 @@
+#ifndef JSON_H
+#define JSON_H
+
+
+#include "util.h"
+
+#include <stdio.h>
+
+
+typedef struct JsonValue JsonValue;
+
+
+typedef enum {
+  json_null,
+  json_bool,
+  json_number,
+  json_string,
+  json_array,
+  json_object,
+} JsonType;
+
+
+// Array elements and object members are linked through next, and object
+// members also have a key
+struct JsonValue {
+  JsonType type;
+  bool boolean;
+  double number;
+  char *string;
+  char *key;
+  JsonValue *head;
+  JsonValue *next;
+};
+
+
+JsonValue *json_parse(char *text, char **error);
+void json_free(JsonValue *v);
+
+JsonValue *json_get(JsonValue *object, char *key);
+void json_writeString(FILE *f, char *s);
+
+
+#endif
@@ -0,0 +1,248 @@
+#include "landing.h"
+
+#include "level.h"
+#include "mario.h"
+#include "objects.h"
+#include "state.h"
+#include "surface.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// A yaw's map is built once it has been needed this many times. Building one
+// costs about as much as a hundred frames, and most yaws in a search that
+// doesn't share the cog's motion between runs are only seen a few times.
+#define BUILD_AFTER 64
+
+#define MAX_FLOORS 32
+
+
+s32 landingCacheMb = 256;
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cacheBuilt = PTHREAD_COND_INITIALIZER;
+
+static LandingMap *maps[0x10000];
+static u32 timesNeeded[0x10000];
+
+// Most recently used first
+static LandingMap *newest;
+static LandingMap *oldest;
+static u64 cacheBytes;
+
+
+static void unlinkMap(LandingMap *map) {
+  if (map->newer != NULL) map->newer->older = map->older;
+  else newest = map->older;
+  if (map->older != NULL) map->older->newer = map->newer;
+  else oldest = map->newer;
+  map->newer = NULL;
+  map->older = NULL;
+}
+
+
+static void pushNewest(LandingMap *map) {
+  map->older = newest;
+  map->newer = NULL;
+  if (newest != NULL) newest->newer = map;
+  newest = map;
+  if (oldest == NULL) oldest = map;
+}
+
+
+// Evicts unused maps, least recently used first, until under the cap
+static void evict(void) {
+  u64 cap = (u64) landingCacheMb << 20;
+  LandingMap *map = oldest;
+
+  while (cacheBytes > cap && map != NULL) {
+    LandingMap *next = map->newer;
+    if (map->refs == 0 && map->ready) {
+      unlinkMap(map);
+      __atomic_store_n(&maps[map->yaw], NULL, __ATOMIC_RELEASE);
+      __atomic_store_n(&timesNeeded[map->yaw], 0, __ATOMIC_RELAXED);
+      cacheBytes -= map->bytes;
+      free(map->bits);
+      free(map);
+    }
+    map = next;
+  }
+}
+
+
+// Same test as findTriFromListBelow for every cell in a row, written so that
+// the compiler can vectorize it
+static void markRow(Surface *tri, s32 y, s32 z, s32 xa, s32 xb, u8 *row) {
+  s32 x1 = tri->vertex1.x;
+  s32 z1 = tri->vertex1.z;
+  s32 x2 = tri->vertex2.x;
+  s32 z2 = tri->vertex2.z;
+  s32 x3 = tri->vertex3.x;
+  s32 z3 = tri->vertex3.z;
+
+  f32 nx = tri->normal.x;
+  f32 ny = tri->normal.y;
+  f32 nz = tri->normal.z;
+  f32 oo = tri->originOffset;
+  if (ny == 0.0f) return;
+
+  for (s32 x = xa; x <= xb; x++) {
+    bool inside =
+      (z1 - z) * (x2 - x1) - (x1 - x) * (z2 - z1) >= 0 &&
+      (z2 - z) * (x3 - x2) - (x2 - x) * (z3 - z2) >= 0 &&
+      (z3 - z) * (x1 - x3) - (x3 - x) * (z1 - z3) >= 0;
+
+    f32 height = -(x * nx + nz * z + oo) / ny;
+    bool below = !(y - (height + -78.0f) < 0.0f);
+
+    row[x - xa] |= inside & below;
+  }
+}
+
+
+// Builds the map from the floors currently loaded, which must be the cog's at
+// map->yaw
+static void buildMap(LandingMap *map) {
+  Surface floors[MAX_FLOORS];
+  s32 numFloors = copySurfaces(floors, MAX_FLOORS);
+
+  s32 minX = 0x7FFF, maxX = -0x8000, minZ = 0x7FFF, maxZ = -0x8000;
+  for (s32 i = 0; i < numFloors; i++) {
+    v3h *v[3] = { &floors[i].vertex1, &floors[i].vertex2, &floors[i].vertex3 };
+    for (s32 j = 0; j < 3; j++) {
+      if (v[j]->x < minX) minX = v[j]->x;
+      if (v[j]->x > maxX) maxX = v[j]->x;
+      if (v[j]->z < minZ) minZ = v[j]->z;
+      if (v[j]->z > maxZ) maxZ = v[j]->z;
+    }
+  }
+  if (numFloors == 0) {
+    minX = maxX = minZ = maxZ = 0;
+  }
+
+  map->x0 = minX;
+  map->z0 = minZ;
+  map->width = maxX - minX + 1;
+  map->height = maxZ - minZ + 1;
+  map->stride = (map->width + 63) / 64;
+  map->bytes = (u64) map->stride * map->height * sizeof(u64) + sizeof(LandingMap);
+  map->bits = (u64 *) calloc((size_t) map->stride * map->height, sizeof(u64));
+
+  u8 *row = (u8 *) malloc(map->width);
+  for (s32 r = 0; r < map->height; r++) {
+    s32 z = map->z0 + r;
+    memset(row, 0, map->width);
+
+    for (s32 i = 0; i < numFloors; i++) {
+      Surface *tri = &floors[i];
+      s32 triMinZ = tri->vertex1.z, triMaxZ = tri->vertex1.z;
+      if (tri->vertex2.z < triMinZ) triMinZ = tri->vertex2.z;
+      if (tri->vertex3.z < triMinZ) triMinZ = tri->vertex3.z;
+      if (tri->vertex2.z > triMaxZ) triMaxZ = tri->vertex2.z;
+      if (tri->vertex3.z > triMaxZ) triMaxZ = tri->vertex3.z;
+      if (z < triMinZ || z > triMaxZ) continue;
+
+      s32 xa = tri->vertex1.x, xb = tri->vertex1.x;
+      if (tri->vertex2.x < xa) xa = tri->vertex2.x;
+      if (tri->vertex3.x < xa) xa = tri->vertex3.x;
+      if (tri->vertex2.x > xb) xb = tri->vertex2.x;
+      if (tri->vertex3.x > xb) xb = tri->vertex3.x;
+
+      markRow(tri, map->y, z, xa, xb, row + (xa - map->x0));
+    }
+
+    u64 *bits = &map->bits[(size_t) r * map->stride];
+    for (s32 c = 0; c < map->width; c++)
+      bits[c / 64] |= (u64) row[c] << (c % 64);
+  }
+  free(row);
+}
+
+
+// Returns the map for the cog's current yaw, or NULL if the yaw hasn't been
+// needed often enough yet or the cache is disabled. The loaded floors must be
+// exactly the cog's. Maps only cover the cog's floors, so none are used once a
+// level or other objects are loaded. The map must be released once done with.
+LandingMap *acquireLandingMap(s16 y) {
+  if (landingCacheMb <= 0 || level != NULL || numOtherObjects > 0) return NULL;
+
+  u16 yaw = (u16) cog.displayAngle.yaw;
+  if (__atomic_load_n(&maps[yaw], __ATOMIC_ACQUIRE) == NULL &&
+    __atomic_add_fetch(&timesNeeded[yaw], 1, __ATOMIC_RELAXED) < BUILD_AFTER)
+  {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cacheLock);
+
+  LandingMap *map = maps[yaw];
+  if (map == NULL) {
+    map = (LandingMap *) calloc(1, sizeof(LandingMap));
+    map->yaw = yaw;
+    map->y = y;
+    map->refs = 1;
+    __atomic_store_n(&maps[yaw], map, __ATOMIC_RELEASE);
+    pushNewest(map);
+    pthread_mutex_unlock(&cacheLock);
+
+    // Other threads needing this yaw wait for it instead of building it too
+    buildMap(map);
+
+    pthread_mutex_lock(&cacheLock);
+    map->ready = true;
+    cacheBytes += map->bytes;
+    evict();
+    pthread_cond_broadcast(&cacheBuilt);
+  }
+  else {
+    map->refs += 1;
+    unlinkMap(map);
+    pushNewest(map);
+    while (!map->ready)
+      pthread_cond_wait(&cacheBuilt, &cacheLock);
+  }
+
+  pthread_mutex_unlock(&cacheLock);
+
+  if (map->y != y) {
+    releaseLandingMap(map);
+    return NULL;
+  }
+  return map;
+}
+
+
+void releaseLandingMap(LandingMap *map) {
+  if (map == NULL) return;
+
+  pthread_mutex_lock(&cacheLock);
+  map->refs -= 1;
+  if (map->refs == 0)
+    evict();
+  pthread_mutex_unlock(&cacheLock);
+}
+
+
+// Equivalent to quarterStepLands for steps that no wall can reach
+bool mapQuarterStepLands(LandingMap *map, MarioState *m) {
+  v3f qstep = {
+    m->pos.x + m->vel.x / 4.0f,
+    m->pos.y + m->vel.y / 4.0f,
+    m->pos.z + m->vel.z / 4.0f,
+  };
+
+  s16 x = (s16) qstep.x;
+  s16 y = (s16) qstep.y;
+  s16 z = (s16) qstep.z;
+  if (y != map->y) return quarterStepLands(m);
+
+  s32 c = x - map->x0;
+  s32 r = z - map->z0;
+  if (c < 0 || c >= map->width || r < 0 || r >= map->height) return false;
+  return (map->bits[(size_t) r * map->stride + c / 64] >> (c % 64)) & 1;
+}
+
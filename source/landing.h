@@ -0,0 +1,41 @@
+#ifndef LANDING_H
+#define LANDING_H
+
+
+#include "mario.h"
+#include "util.h"
+
+
+typedef struct LandingMap LandingMap;
+
+
+// Memory cap of the cache in MB, 0 to disable it
+extern s32 landingCacheMb;
+
+
+// Which integer (x, z) cells have a floor below y, for one cog yaw. findFloor
+// truncates positions to s16, so this decides landing exactly.
+struct LandingMap {
+  u16 yaw;
+  s16 y;
+  s32 x0;
+  s32 z0;
+  s32 width;
+  s32 height;
+  s32 stride;
+  u64 *bits;
+  u64 bytes;
+
+  s32 refs;
+  bool ready;
+  LandingMap *newer;
+  LandingMap *older;
+};
+
+
+LandingMap *acquireLandingMap(s16 y);
+void releaseLandingMap(LandingMap *map);
+bool mapQuarterStepLands(LandingMap *map, MarioState *m);
+
+
+#endif
@@ -0,0 +1,499 @@
+#include "level.h"
+
+#include "surface.h"
+#include "util.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define MAX_ARGS 8
+
+// A wall moves a point onto itself along x or z, whichever is closer to its
+// normal, so with Mario's 50 unit radius only points within 50 / 0.707 of it
+// in the xz plane can be pushed. Squares are marked if their center is within
+// that plus half their diagonal.
+#define WALL_REACH (50.0f / 0.7f + 46.0f)
+
+
+Level *level = NULL;
+
+static Level spotWalls;
+
+
+typedef struct {
+  char *filename;
+  char *text;
+  char *pos;
+  s32 lineNum;
+
+  v3h *vertices;
+  s32 numVertices;
+  s32 maxVertices;
+  s32 maxSurfaces;
+} LevelParser;
+
+
+static void skipSpaceAndComments(LevelParser *p) {
+  while (*p->pos != '\0') {
+    if (*p->pos == '\n') {
+      p->lineNum += 1;
+      p->pos++;
+    }
+    else if (isspace((unsigned char) *p->pos)) {
+      p->pos++;
+    }
+    else if (p->pos[0] == '/' && p->pos[1] == '/') {
+      while (*p->pos != '\0' && *p->pos != '\n') p->pos++;
+    }
+    else if (p->pos[0] == '/' && p->pos[1] == '*') {
+      p->pos += 2;
+      while (*p->pos != '\0' && !(p->pos[0] == '*' && p->pos[1] == '/')) {
+        if (*p->pos == '\n') p->lineNum += 1;
+        p->pos++;
+      }
+      if (*p->pos != '\0') p->pos += 2;
+    }
+    else {
+      break;
+    }
+  }
+}
+
+
+static bool isIdentChar(char c) {
+  return isalnum((unsigned char) c) || c == '_';
+}
+
+
+// Parses the arguments of a macro call. Symbolic arguments (e.g. surface
+// types) are read as 0.
+static bool parseArgs(LevelParser *p, s32 *args, s32 *numArgs) {
+  *numArgs = 0;
+  skipSpaceAndComments(p);
+  if (*p->pos != '(') return false;
+  p->pos++;
+
+  while (true) {
+    skipSpaceAndComments(p);
+    if (*p->pos == ')') {
+      p->pos++;
+      return true;
+    }
+
+    s32 value = 0;
+    if (isIdentChar(*p->pos) && !isdigit((unsigned char) *p->pos)) {
+      while (isIdentChar(*p->pos)) p->pos++;
+    }
+    else {
+      char *end;
+      value = (s32) strtol(p->pos, &end, 0);
+      if (end == p->pos) return false;
+      p->pos = end;
+    }
+
+    if (*numArgs < MAX_ARGS)
+      args[(*numArgs)++] = value;
+
+    skipSpaceAndComments(p);
+    if (*p->pos == ',') p->pos++;
+    else if (*p->pos != ')') return false;
+  }
+}
+
+
+static bool parseFail(LevelParser *p, char *message) {
+  fprintf(stderr, "%s:%d: %s\n", p->filename, p->lineNum, message);
+  return false;
+}
+
+
+// Degenerate triangles are dropped, like in the game
+static bool addTri(LevelParser *p, s32 *args, s16 type) {
+  for (s32 i = 0; i < 3; i++) {
+    if (args[i] < 0 || args[i] >= p->numVertices)
+      return parseFail(p, "Invalid vertex index");
+  }
+
+  if (level->numSurfaces == p->maxSurfaces) {
+    p->maxSurfaces = p->maxSurfaces > 0 ? 2 * p->maxSurfaces : 1024;
+    level->surfaces = (Surface *) realloc(level->surfaces, p->maxSurfaces * sizeof(Surface));
+  }
+
+  Surface *tri = &level->surfaces[level->numSurfaces];
+  memset(tri, 0, sizeof(Surface));
+  if (!initSurface(tri, &p->vertices[args[0]], &p->vertices[args[1]], &p->vertices[args[2]]))
+    return true;
+
+  tri->type = type;
+  level->numSurfaces += 1;
+  return true;
+}
+
+
+// Reads the COL_* macros of a collision.inc.c file from the decompilation.
+// Everything else (special objects, water boxes, C declarations) is skipped.
+static bool parseCollision(LevelParser *p) {
+  s16 type = 0;
+  s32 args[MAX_ARGS];
+  s32 numArgs;
+
+  while (true) {
+    skipSpaceAndComments(p);
+    if (*p->pos == '\0') return true;
+
+    if (!isIdentChar(*p->pos)) {
+      p->pos++;
+      continue;
+    }
+
+    char *start = p->pos;
+    while (isIdentChar(*p->pos)) p->pos++;
+    size_t length = p->pos - start;
+    if (length < 4 || strncmp(start, "COL_", 4) != 0) continue;
+
+    char name[32];
+    if (length >= sizeof(name)) continue;
+    memcpy(name, start, length);
+    name[length] = '\0';
+
+    if (!parseArgs(p, args, &numArgs))
+      return parseFail(p, "Invalid macro arguments");
+
+    if (strcmp(name, "COL_END") == 0) {
+      return true;
+    }
+    else if (strcmp(name, "COL_VERTEX_INIT") == 0) {
+      p->numVertices = 0;
+    }
+    else if (strcmp(name, "COL_VERTEX") == 0) {
+      if (numArgs != 3)
+        return parseFail(p, "Expected 3 coordinates");
+      if (p->numVertices == p->maxVertices) {
+        p->maxVertices = p->maxVertices > 0 ? 2 * p->maxVertices : 1024;
+        p->vertices = (v3h *) realloc(p->vertices, p->maxVertices * sizeof(v3h));
+      }
+      p->vertices[p->numVertices++] = (v3h) { (s16) args[0], (s16) args[1], (s16) args[2] };
+    }
+    else if (strcmp(name, "COL_TRI_INIT") == 0) {
+      if (numArgs != 2)
+        return parseFail(p, "Expected surface type and count");
+      type = (s16) args[0];
+    }
+    else if (strcmp(name, "COL_TRI") == 0 || strcmp(name, "COL_TRI_SPECIAL") == 0) {
+      if (numArgs < 3)
+        return parseFail(p, "Expected 3 vertex indices");
+      if (!addTri(p, args, type)) return false;
+    }
+  }
+}
+
+
+// Cells whose bounds, widened by 50 units, overlap the coordinate range, as in
+// the game's lower_cell_index and upper_cell_index
+static s32 lowerCellIndex(s32 coord) {
+  coord += LEVEL_BOUNDARY_MAX;
+  if (coord < 0) coord = 0;
+
+  s32 index = coord / CELL_SIZE;
+  if (coord % CELL_SIZE < 50) index -= 1;
+  if (index < 0) index = 0;
+  return index;
+}
+
+
+static s32 upperCellIndex(s32 coord) {
+  coord += LEVEL_BOUNDARY_MAX;
+  if (coord < 0) coord = 0;
+
+  s32 index = coord / CELL_SIZE;
+  if (coord % CELL_SIZE > CELL_SIZE - 50) index += 1;
+  if (index > NUM_CELLS - 1) index = NUM_CELLS - 1;
+  return index;
+}
+
+
+// Which list a surface goes in, from its normal like in the game
+s32 surfaceKind(Surface *tri) {
+  if (tri->normal.y > 0.01) return LEVEL_FLOORS;
+  if (tri->normal.y < -0.01) return LEVEL_CEILS;
+  return LEVEL_WALLS;
+}
+
+
+static s32 min3(s32 a, s32 b, s32 c) {
+  s32 m = a < b ? a : b;
+  return m < c ? m : c;
+}
+
+
+static s32 max3(s32 a, s32 b, s32 c) {
+  s32 m = a > b ? a : b;
+  return m > c ? m : c;
+}
+
+
+static void cellRange(Surface *tri, s32 *x0, s32 *z0, s32 *x1, s32 *z1) {
+  s32 minX = min3(tri->vertex1.x, tri->vertex2.x, tri->vertex3.x);
+  s32 maxX = max3(tri->vertex1.x, tri->vertex2.x, tri->vertex3.x);
+  s32 minZ = min3(tri->vertex1.z, tri->vertex2.z, tri->vertex3.z);
+  s32 maxZ = max3(tri->vertex1.z, tri->vertex2.z, tri->vertex3.z);
+
+  *x0 = lowerCellIndex(minX);
+  *x1 = upperCellIndex(maxX);
+  *z0 = lowerCellIndex(minZ);
+  *z1 = upperCellIndex(maxZ);
+}
+
+
+// Same order as the game's add_surface_to_cell: floors from highest to lowest
+// vertex1.y, ceilings from lowest to highest, and walls in load order
+static void addToCell(SurfaceNode *list, SurfaceNode *node, s32 kind) {
+  s32 sortDir = kind == LEVEL_FLOORS ? 1 : kind == LEVEL_CEILS ? -1 : 0;
+  s32 priority = node->head->vertex1.y * sortDir;
+
+  while (list->tail != NULL) {
+    if (priority > list->tail->head->vertex1.y * sortDir) break;
+    list = list->tail;
+  }
+
+  node->tail = list->tail;
+  list->tail = node;
+}
+
+
+// Distance in the xz plane from (x, z) to the segment from a to b
+static f32 segmentDistance(f32 x, f32 z, v3h *a, v3h *b) {
+  f32 dx = b->x - a->x;
+  f32 dz = b->z - a->z;
+  f32 lengthSq = dx*dx + dz*dz;
+
+  f32 t = 0.0f;
+  if (lengthSq > 0.0f) {
+    t = ((x - a->x) * dx + (z - a->z) * dz) / lengthSq;
+    if (t < 0.0f) t = 0.0f;
+    if (t > 1.0f) t = 1.0f;
+  }
+
+  f32 ex = a->x + t * dx - x;
+  f32 ez = a->z + t * dz - z;
+  return sqrtf(ex*ex + ez*ez);
+}
+
+
+static f32 edgeSide(f32 x, f32 z, v3h *a, v3h *b) {
+  return (b->x - a->x) * (z - a->z) - (b->z - a->z) * (x - a->x);
+}
+
+
+// Distance in the xz plane from (x, z) to the triangle seen from above
+static f32 triDistance(f32 x, f32 z, Surface *tri) {
+  f32 s1 = edgeSide(x, z, &tri->vertex1, &tri->vertex2);
+  f32 s2 = edgeSide(x, z, &tri->vertex2, &tri->vertex3);
+  f32 s3 = edgeSide(x, z, &tri->vertex3, &tri->vertex1);
+  if ((s1 >= 0 && s2 >= 0 && s3 >= 0) || (s1 <= 0 && s2 <= 0 && s3 <= 0))
+    return 0.0f;
+
+  f32 d1 = segmentDistance(x, z, &tri->vertex1, &tri->vertex2);
+  f32 d2 = segmentDistance(x, z, &tri->vertex2, &tri->vertex3);
+  f32 d3 = segmentDistance(x, z, &tri->vertex3, &tri->vertex1);
+  f32 d = d1 < d2 ? d1 : d2;
+  return d < d3 ? d : d3;
+}
+
+
+static s32 wallGridIndex(s32 coord) {
+  s32 index = (coord + LEVEL_BOUNDARY_MAX) >> WALL_GRID_SHIFT;
+  if (index < 0) index = 0;
+  if (index > WALL_GRID_SIZE - 1) index = WALL_GRID_SIZE - 1;
+  return index;
+}
+
+
+static void markNearWall(Level *l, Surface *wall) {
+  s32 reach = (s32) WALL_REACH + 1;
+  s32 x0 = wallGridIndex(min3(wall->vertex1.x, wall->vertex2.x, wall->vertex3.x) - reach);
+  s32 x1 = wallGridIndex(max3(wall->vertex1.x, wall->vertex2.x, wall->vertex3.x) + reach);
+  s32 z0 = wallGridIndex(min3(wall->vertex1.z, wall->vertex2.z, wall->vertex3.z) - reach);
+  s32 z1 = wallGridIndex(max3(wall->vertex1.z, wall->vertex2.z, wall->vertex3.z) + reach);
+
+  f32 half = (f32) (1 << (WALL_GRID_SHIFT - 1));
+  for (s32 gz = z0; gz <= z1; gz++) {
+    for (s32 gx = x0; gx <= x1; gx++) {
+      f32 x = (f32) ((gx << WALL_GRID_SHIFT) - LEVEL_BOUNDARY_MAX) + half;
+      f32 z = (f32) ((gz << WALL_GRID_SHIFT) - LEVEL_BOUNDARY_MAX) + half;
+      if (triDistance(x, z, wall) <= WALL_REACH)
+        l->nearWalls[gz][gx / 8] |= 1 << (gx % 8);
+    }
+  }
+}
+
+
+static void buildPartition(Level *l) {
+  s32 numNodes = 0;
+  for (s32 i = 0; i < l->numSurfaces; i++) {
+    s32 x0, z0, x1, z1;
+    cellRange(&l->surfaces[i], &x0, &z0, &x1, &z1);
+    numNodes += (x1 - x0 + 1) * (z1 - z0 + 1);
+  }
+
+  l->nodes = (SurfaceNode *) malloc(numNodes * sizeof(SurfaceNode));
+  l->numNodes = 0;
+
+  for (s32 i = 0; i < l->numSurfaces; i++) {
+    Surface *tri = &l->surfaces[i];
+    s32 kind = surfaceKind(tri);
+
+    s32 x0, z0, x1, z1;
+    cellRange(tri, &x0, &z0, &x1, &z1);
+
+    for (s32 cz = z0; cz <= z1; cz++) {
+      for (s32 cx = x0; cx <= x1; cx++) {
+        SurfaceNode *node = &l->nodes[l->numNodes++];
+        node->head = tri;
+        addToCell(&l->cells[cz][cx][kind], node, kind);
+      }
+    }
+
+    if (kind == LEVEL_WALLS)
+      markNearWall(l, tri);
+  }
+}
+
+
+// Loads the static collision of a level from a collision.inc.c file, replacing
+// any level loaded before. Returns false on failure.
+bool loadLevel(char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open '%s'\n", filename);
+    return false;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  char *text = (char *) malloc(size + 1);
+  size_t read = fread(text, 1, size, f);
+  fclose(f);
+  text[read] = '\0';
+
+  freeLevel();
+  level = (Level *) calloc(1, sizeof(Level));
+
+  LevelParser p;
+  memset(&p, 0, sizeof(LevelParser));
+  p.filename = filename;
+  p.text = text;
+  p.pos = text;
+  p.lineNum = 1;
+
+  bool ok = parseCollision(&p);
+  free(p.vertices);
+  free(text);
+
+  if (!ok) {
+    freeLevel();
+    return false;
+  }
+
+  buildPartition(level);
+  return true;
+}
+
+
+void freeLevel(void) {
+  if (level == NULL) return;
+  free(level->surfaces);
+  free(level->nodes);
+  free(level);
+  level = NULL;
+}
+
+
+// Cell containing a coordinate inside the level boundary
+s32 levelCell(s16 coord) {
+  return ((coord + LEVEL_BOUNDARY_MAX) / CELL_SIZE) & (NUM_CELLS - 1);
+}
+
+
+// List of the cell containing (x, z), which must be inside the level boundary
+SurfaceNode *levelSurfaces(s16 x, s16 z, s32 kind) {
+  return level->cells[levelCell(z)][levelCell(x)][kind].tail;
+}
+
+
+// The two walls beside the spot, as drawn in visual mode, which stand in for
+// the level's walls when none is loaded. Only their outlines from above are
+// known, so they're taken to reach 1000 units above and below the cog.
+static void buildSpotWalls(void) {
+  static const s16 ends[2][4] = {
+    { 2081, -861, 862, -2080 },
+    { 2081, 862, 2081, -861 },
+  };
+  s16 bottom = -2088 - 1000;
+  s16 top = -2088 + 1000;
+
+  spotWalls.surfaces = (Surface *) calloc(4, sizeof(Surface));
+
+  for (s32 i = 0; i < 2; i++) {
+    v3h a = { ends[i][0], bottom, ends[i][1] };
+    v3h b = { ends[i][2], bottom, ends[i][3] };
+    v3h c = { ends[i][2], top, ends[i][3] };
+    v3h d = { ends[i][0], top, ends[i][1] };
+
+    // Wound so that the normals face the spot
+    initSurface(&spotWalls.surfaces[spotWalls.numSurfaces++], &a, &c, &b);
+    initSurface(&spotWalls.surfaces[spotWalls.numSurfaces++], &a, &d, &c);
+  }
+
+  buildPartition(&spotWalls);
+}
+
+
+// Safe to call from any thread; only the first call builds the walls
+void initSpotWalls(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, buildSpotWalls);
+}
+
+
+// Whether a point at (x, z), which must be inside the level boundary, could be
+// pushed by a wall. Most points aren't near one, and this is cheaper than
+// checking the walls of their cell.
+bool nearWall(s16 x, s16 z) {
+  Level *l = level != NULL ? level : &spotWalls;
+  s32 gx = (x + LEVEL_BOUNDARY_MAX) >> WALL_GRID_SHIFT;
+  s32 gz = (z + LEVEL_BOUNDARY_MAX) >> WALL_GRID_SHIFT;
+  return (l->nearWalls[gz][gx / 8] >> (gx % 8)) & 1;
+}
+
+
+// Whether any point with x0 <= x <= x1 and z0 <= z <= z1 could be pushed by a
+// wall
+bool nearWallInRect(s32 x0, s32 z0, s32 x1, s32 z1) {
+  Level *l = level != NULL ? level : &spotWalls;
+  s32 gx0 = wallGridIndex(x0);
+  s32 gz0 = wallGridIndex(z0);
+  s32 gx1 = wallGridIndex(x1);
+  s32 gz1 = wallGridIndex(z1);
+
+  for (s32 gz = gz0; gz <= gz1; gz++) {
+    for (s32 gx = gx0; gx <= gx1; gx++) {
+      if ((l->nearWalls[gz][gx / 8] >> (gx % 8)) & 1) return true;
+    }
+  }
+  return false;
+}
+
+
+// Walls of the cell containing (x, z), from the level if one is loaded
+SurfaceNode *wallSurfaces(s16 x, s16 z) {
+  Level *l = level != NULL ? level : &spotWalls;
+  return l->cells[levelCell(z)][levelCell(x)][LEVEL_WALLS].tail;
+}
@@ -0,0 +1,54 @@
+#ifndef LEVEL_H
+#define LEVEL_H
+
+
+#include "surface.h"
+#include "util.h"
+
+
+// The game's static surface partition: the level is split into 16x16 cells
+// of 1024 units, and each cell has its own floor, ceiling and wall lists.
+#define LEVEL_BOUNDARY_MAX 0x2000
+#define CELL_SIZE 0x400
+#define NUM_CELLS 16
+
+// Squares of 64 units marked if a point in them could be pushed by a wall
+#define WALL_GRID_SHIFT 6
+#define WALL_GRID_SIZE (2 * LEVEL_BOUNDARY_MAX >> WALL_GRID_SHIFT)
+
+#define LEVEL_FLOORS 0
+#define LEVEL_CEILS 1
+#define LEVEL_WALLS 2
+
+
+typedef struct {
+  Surface *surfaces;
+  s32 numSurfaces;
+  SurfaceNode *nodes;
+  s32 numNodes;
+
+  // Heads of the lists, like allFloors
+  SurfaceNode cells[NUM_CELLS][NUM_CELLS][3];
+
+  // One bit per square, set if it's near a wall
+  u8 nearWalls[WALL_GRID_SIZE][WALL_GRID_SIZE / 8];
+} Level;
+
+
+// NULL unless a level was loaded. It's never modified afterward, so it's
+// shared by every thread.
+extern Level *level;
+
+
+bool loadLevel(char *filename);
+void freeLevel(void);
+s32 surfaceKind(Surface *tri);
+s32 levelCell(s16 coord);
+SurfaceNode *levelSurfaces(s16 x, s16 z, s32 kind);
+void initSpotWalls(void);
+bool nearWall(s16 x, s16 z);
+bool nearWallInRect(s32 x0, s32 z0, s32 x1, s32 z1);
+SurfaceNode *wallSurfaces(s16 x, s16 z);
+
+
+#endif
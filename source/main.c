@@ -1,8 +1,14 @@
+#include "checkpoint.h"
 #include "cog.h"
+#include "landing.h"
+#include "level.h"
 #include "mario.h"
+#include "objects.h"
 #include "ol.h"
 #include "state.h"
 #include "surface.h"
+#include "thread.h"
+#include "transposition.h"
 #include "util.h"
 
 #include <math.h>
@@ -28,6 +34,18 @@ void win_enable_ansi(void) {
 
 
 int runVisualizer(void);
+bool runUlpSearch(s32 radius, s32 samples, s32 maxFrames, s32 topCount,
+  CheckpointConfig *checkpoint, Shard *shard, char **error);
+void runMonteCarlo(s32 trials, s32 rollCount, s32 maxFrames,
+  CheckpointConfig *checkpoint, Shard *shard);
+void runSeedSweep(s32 maxFrames, s32 topCount, CheckpointConfig *checkpoint, Shard *shard);
+void runRollSearch(s32 horizon, s32 topCount, CheckpointConfig *checkpoint, Shard *shard);
+void runPlanner(f32 target, bool minimizeRolls, s32 horizon, u32 maxNodes);
+void runSeedInference(char *filename);
+void runRngPlan(s32 maxExtra, s32 maxDelay, s32 topCount);
+void runServer(char *socketPath, s32 maxFrames);
+void runMerge(char **filenames, s32 numFiles, s32 topCount);
+void runBfs(s32 horizon, s32 topCount, u64 memoryBytes, char *spillDir);
 
 
 static void error(char *fmt, ...) {
@@ -64,7 +82,7 @@ static void loadRng(OlBlock *b) {
   for (OlField *f = b->head; f != NULL; f = f->next)
     overrideRngLength += 1;
   
-  cogRngOverride = (s8 *) malloc(overrideRngLength);
+  cogRngOverride = (s8 *) malloc(overrideRngLength + 1);
 
   size_t i = 0;
   for (OlField *f = b->head; f != NULL; f = f->next) {
@@ -79,6 +97,57 @@ static void loadRng(OlBlock *b) {
 }
 
 
+// Reads a collision model given either as `cog` or as an array of the
+// model's values
+static s16 *loadModel(OlValue *v, s32 *length) {
+  if (v->type == ol_ident) {
+    if (strcmp(v->ident, "cog") != 0)
+      error("Unknown model: '%s'", v->ident);
+    *length = collisionModelLength(cogModel, 0x7FFFFFFF);
+    return cogModel;
+  }
+
+  *length = 0;
+  for (OlField *f = v->block->head; f != NULL; f = f->next)
+    *length += 1;
+
+  s16 *model = (s16 *) malloc(*length * sizeof(s16));
+
+  s32 i = 0;
+  for (OlField *f = v->block->head; f != NULL; f = f->next) {
+    if (f->key != NULL || !(f->value->type & (ol_dec | ol_hex)))
+      error("Invalid model value: %s", ol_valueStr(f->key != NULL ? f->key : f->value));
+    model[i++] = (s16) (f->value->type == ol_dec ? f->value->dec : f->value->hex);
+  }
+
+  return model;
+}
+
+
+static void loadObjects(OlBlock *b) {
+  s32 index = 1;
+  for (OlField *f = b->head; f != NULL; f = f->next, index++) {
+    OlBlock *o = f->value->block;
+
+    s32 length;
+    s16 *model = loadModel(ol_checkField(o, "model", ol_ident | ol_block), &length);
+
+    v3f pos = {
+      ol_checkFieldFloat(o, "x"),
+      ol_checkFieldFloat(o, "y"),
+      ol_checkFieldFloat(o, "z"),
+    };
+    s32 yaw = ol_checkFieldInt(o, "yaw");
+    s32 yawVel = ol_checkFieldInt(o, "speed");
+
+    if (!addOtherObject(model, length, pos, yaw, yawVel))
+      error("Failed to load object %d", index);
+    if (model != cogModel)
+      free(model);
+  }
+}
+
+
 static void loadState(char *filename) {
   OlBlock *b = ol_parseFile(filename);
 
@@ -90,6 +159,18 @@ static void loadState(char *filename) {
   loadCog(ol_checkField(b, "cog", ol_block)->block);
   loadRng(ol_checkFieldArray(b, "rng", ol_dec));
 
+  if (ol_findField(b, "rngstate", ol_dec | ol_hex) != NULL)
+    rngState = (u16) ol_checkFieldInt(b, "rngstate");
+
+  if (ol_findField(b, "extrarngcalls", ol_dec) != NULL) {
+    extraRngCalls = ol_checkFieldInt(b, "extrarngcalls");
+    if (extraRngCalls < 0)
+      error("Invalid extra RNG call count: %d", extraRngCalls);
+  }
+
+  if (ol_findField(b, "objects", ol_block) != NULL)
+    loadObjects(ol_checkFieldArray(b, "objects", ol_block));
+
   ol_free(b);
 }
 
@@ -97,6 +178,29 @@ static void loadState(char *filename) {
 static char *inputFilename = NULL;
 static char *outputFilename = NULL;
 static bool visual = false;
+static s32 ulpRadius = -1;
+static s32 ulpSamples = 0;
+static s32 maxFrames = 100000;
+static s32 topCount = 10;
+static s64 cogAtFrame = -1;
+static s32 mcTrials = 0;
+static s32 mcRolls = 0;
+static bool seedSweep = false;
+static s32 rollSearchHorizon = 0;
+static CheckpointConfig checkpoint = { NULL, 60, false };
+static Shard shard = { 0, 1 };
+static s32 bfsHorizon = -1;
+static s32 bfsMemory = 256;
+static char *spillDir = ".";
+static f32 reachTarget = 0.0f;
+static bool reachMinRolls = false;
+static s32 maxNodes = 1 << 22;
+static char *observationsFilename = NULL;
+static bool rngPlan = false;
+static s32 maxExtra = 8;
+static bool serve = false;
+static char *socketPath = NULL;
+static char *levelFilename = NULL;
 
 static FILE *outputFile = NULL;
 
@@ -141,7 +245,7 @@ static void recordState(void) {
   fprintf(outputFile, "%d,", (s16) cog.displayAngle.yaw);
   fprintf(outputFile, "%f,%f,", cog.yawVel, cog.yawVelTarget);
 
-  fprintf(outputFile, "%d", 2 * numCogRngCalls);
+  fprintf(outputFile, "%d", 2 * numCogRngCalls + extraRngCalls * frames);
 
   fprintf(outputFile, "\n");
 }
@@ -189,11 +293,91 @@ bool handleFrameResult(FrameResult result) {
 }
 
 
+static s32 intArg(int argc, char **argv, int *i, char *flag) {
+  if (*i >= argc)
+    error("Expected number after %s flag", flag);
+
+  char *end;
+  long value = strtol(argv[*i], &end, 0);
+  if (*end != '\0' || value < 0)
+    error("Invalid value for %s: %s", flag, argv[*i]);
+
+  *i += 1;
+  return (s32) value;
+}
+
+
+static void printCogAt(s64 frame) {
+  skipTtcCog(&cog, frame);
+
+  printf("Cog at frame %lld:\n", (long long) frame);
+  printf("  yaw = \x1b[1m%d\x1b[0m (0x%04X)\n",
+    (s16) cog.displayAngle.yaw, (u16) cog.displayAngle.yaw);
+  printf("  speed = %f\n", cog.yawVel);
+  printf("  speedTarget = %f\n", cog.yawVelTarget);
+  printf("  cog RNG updates = %d\n", numCogRngCalls);
+  printf("  rngState = 0x%04X\n", rngState);
+}
+
+
+// Parses i/N with 1 <= i <= N, stored 0-based
+static void shardArg(int argc, char **argv, int *i) {
+  if (*i >= argc)
+    error("Expected i/N after --shard flag");
+
+  char *end;
+  long index = strtol(argv[*i], &end, 10);
+  long count = 0;
+  if (*end == '/')
+    count = strtol(end + 1, &end, 10);
+  if (*end != '\0' || count < 1 || index < 1 || index > count)
+    error("Invalid value for --shard: %s", argv[*i]);
+
+  shard.index = (s32) index - 1;
+  shard.count = (s32) count;
+  *i += 1;
+}
+
+
+// For modes that can't save their progress. --resume and --shard both
+// require --checkpoint, so checking for it covers them too.
+static void noCheckpoint(char *mode) {
+  if (checkpoint.filename != NULL)
+    error("%s doesn't support --checkpoint, --resume or --shard", mode);
+}
+
+
+// cogsim merge files... [--top K]
+static void mergeCommand(int argc, char **argv) {
+  char **filenames = (char **) malloc(argc * sizeof(char *));
+  s32 numFiles = 0;
+
+  int i = 2;
+  while (i < argc) {
+    char *arg = argv[i++];
+    if (strcmp(arg, "--top") == 0)
+      topCount = intArg(argc, argv, &i, arg);
+    else
+      filenames[numFiles++] = arg;
+  }
+
+  if (numFiles == 0)
+    error("Expected result files to merge");
+  runMerge(filenames, numFiles, topCount);
+  free(filenames);
+}
+
+
 int main(int argc, char **argv) {
 #if defined(WIN32)
   win_enable_ansi();
 #endif
 
+  if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+    mergeCommand(argc, argv);
+    return 0;
+  }
+
   int i = 1;
   while (i < argc) {
     char *arg = argv[i++];
@@ -206,6 +390,105 @@ int main(int argc, char **argv) {
     else if (strcmp(arg, "-v") == 0) {
       visual = true;
     }
+    else if (strcmp(arg, "-j") == 0) {
+      numThreads = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--ulp") == 0) {
+      ulpRadius = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--ulp-samples") == 0) {
+      ulpSamples = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--max-frames") == 0) {
+      maxFrames = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--top") == 0) {
+      topCount = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--mc") == 0) {
+      mcTrials = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--mc-rolls") == 0) {
+      mcRolls = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--seed-sweep") == 0) {
+      seedSweep = true;
+    }
+    else if (strcmp(arg, "--best-rolls") == 0) {
+      rollSearchHorizon = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--bfs") == 0) {
+      bfsHorizon = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--bfs-memory") == 0) {
+      bfsMemory = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--spill-dir") == 0) {
+      if (i >= argc)
+        error("Expected directory after --spill-dir flag");
+      spillDir = argv[i++];
+    }
+    else if (strcmp(arg, "--landing-cache") == 0) {
+      landingCacheMb = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--level") == 0) {
+      if (i >= argc)
+        error("Expected filename after --level flag");
+      levelFilename = argv[i++];
+    }
+    else if (strcmp(arg, "--tt-size") == 0) {
+      ttSizeMb = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--reach") == 0) {
+      if (i >= argc)
+        error("Expected H speed after --reach flag");
+      reachTarget = strtof(argv[i++], NULL);
+    }
+    else if (strcmp(arg, "--min-rolls") == 0) {
+      reachMinRolls = true;
+    }
+    else if (strcmp(arg, "--max-nodes") == 0) {
+      maxNodes = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--infer-seed") == 0) {
+      if (i >= argc)
+        error("Expected observations filename after --infer-seed flag");
+      observationsFilename = argv[i++];
+    }
+    else if (strcmp(arg, "--rng-plan") == 0) {
+      rngPlan = true;
+    }
+    else if (strcmp(arg, "--max-extra") == 0) {
+      maxExtra = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--serve") == 0) {
+      serve = true;
+    }
+    else if (strcmp(arg, "--socket") == 0) {
+      if (i >= argc)
+        error("Expected socket path after --socket flag");
+      socketPath = argv[i++];
+      serve = true;
+    }
+    else if (strcmp(arg, "--checkpoint") == 0) {
+      if (i >= argc)
+        error("Expected filename after --checkpoint flag");
+      checkpoint.filename = argv[i++];
+    }
+    else if (strcmp(arg, "--checkpoint-interval") == 0) {
+      checkpoint.interval = intArg(argc, argv, &i, arg);
+    }
+    else if (strcmp(arg, "--resume") == 0) {
+      checkpoint.resume = true;
+    }
+    else if (strcmp(arg, "--shard") == 0) {
+      shardArg(argc, argv, &i);
+    }
+    else if (strcmp(arg, "--cog-at") == 0) {
+      if (i >= argc)
+        error("Expected frame number after --cog-at flag");
+      cogAtFrame = strtoll(argv[i++], NULL, 0);
+    }
     else {
       inputFilename = arg;
     }
@@ -213,11 +496,19 @@ int main(int argc, char **argv) {
 
   if (inputFilename == NULL)
     error("Expected input filename");
-  printf("Input file: \x1b[1m%s\x1b[0m\n", inputFilename);
-  if (outputFilename != NULL)
-    printf("Output file: \x1b[1m%s\x1b[0m\n", outputFilename);
-  if (visual)
-    printf("Running in visual mode\n");
+  if (checkpoint.resume && checkpoint.filename == NULL)
+    error("Expected --checkpoint file to resume from");
+  if (shard.count > 1 && checkpoint.filename == NULL)
+    error("Expected --checkpoint file for the shard's results");
+
+  // Responses go to stdout when serving over stdin
+  if (!serve || socketPath != NULL) {
+    printf("Input file: \x1b[1m%s\x1b[0m\n", inputFilename);
+    if (outputFilename != NULL)
+      printf("Output file: \x1b[1m%s\x1b[0m\n", outputFilename);
+    if (visual)
+      printf("Running in visual mode\n");
+  }
 
   if (outputFilename != NULL) {
     outputFile = fopen(outputFilename, "wb");
@@ -225,16 +516,56 @@ int main(int argc, char **argv) {
       error("Failed to open '%s' for writing", outputFilename);
   }
 
-  cog.pos = (v3f) { 1490, -2088, -873 };
-  cog.surfaceModel = &cogModel[0];
+  initState();
 
   loadState(inputFilename);
 
+  if (levelFilename != NULL && !loadLevel(levelFilename))
+    error("Failed to load level '%s'", levelFilename);
+
   recordInitState();
 
   if (visual) {
     runVisualizer();
   }
+  else if (serve) {
+    noCheckpoint("--serve");
+    runServer(socketPath, maxFrames);
+  }
+  else if (ulpRadius >= 0) {
+    char *message;
+    if (!runUlpSearch(ulpRadius, ulpSamples, maxFrames, topCount, &checkpoint, &shard, &message))
+      error("%s", message);
+  }
+  else if (cogAtFrame >= 0) {
+    noCheckpoint("--cog-at");
+    printCogAt(cogAtFrame);
+  }
+  else if (mcTrials > 0) {
+    runMonteCarlo(mcTrials, mcRolls, maxFrames, &checkpoint, &shard);
+  }
+  else if (seedSweep) {
+    runSeedSweep(maxFrames, topCount, &checkpoint, &shard);
+  }
+  else if (observationsFilename != NULL) {
+    noCheckpoint("--infer-seed");
+    runSeedInference(observationsFilename);
+  }
+  else if (rngPlan) {
+    noCheckpoint("--rng-plan");
+    runRngPlan(maxExtra, maxFrames, topCount);
+  }
+  else if (reachTarget > 0.0f) {
+    noCheckpoint("--reach");
+    runPlanner(reachTarget, reachMinRolls, maxFrames, (u32) maxNodes);
+  }
+  else if (bfsHorizon > 0) {
+    noCheckpoint("--bfs");
+    runBfs(bfsHorizon, topCount, (u64) bfsMemory << 20, spillDir);
+  }
+  else if (rollSearchHorizon > 0) {
+    runRollSearch(rollSearchHorizon, topCount, &checkpoint, &shard);
+  }
   else {
     while (handleFrameResult(frameAdvance())) {}
   }
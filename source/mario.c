@@ -1,14 +1,13 @@
 #include "mario.h"
 
+#include "level.h"
 #include "surface.h"
 #include "util.h"
 
+#include <math.h>
 #include <stdlib.h>
 
 
-MarioState mario;
-
-
 static Surface *findTriFromListBelow(
   SurfaceNode *triangles,
   s32 x,
@@ -49,6 +48,47 @@ static Surface *findTriFromListBelow(
 }
 
 
+// Same as the game's find_ceil_from_list
+static Surface *findTriFromListAbove(
+  SurfaceNode *triangles,
+  s32 x,
+  s32 y,
+  s32 z,
+  f32 *pheight)
+{
+  while (triangles != NULL) {
+    Surface *tri = triangles->head;
+    triangles = triangles->tail;
+
+    s32 x1 = tri->vertex1.x;
+    s32 z1 = tri->vertex1.z;
+    s32 x2 = tri->vertex2.x;
+    s32 z2 = tri->vertex2.z;
+    s32 x3 = tri->vertex3.x;
+    s32 z3 = tri->vertex3.z;
+
+    if ((z1 - z) * (x2 - x1) - (x1 - x) * (z2 - z1) > 0) continue;
+    if ((z2 - z) * (x3 - x2) - (x2 - x) * (z3 - z2) > 0) continue;
+    if ((z3 - z) * (x1 - x3) - (x3 - x) * (z1 - z3) > 0) continue;
+
+    f32 nx = tri->normal.x;
+    f32 ny = tri->normal.y;
+    f32 nz = tri->normal.z;
+    f32 oo = tri->originOffset;
+
+    if (ny == 0.0f) continue;
+
+    f32 height = -(x * nx + nz * z + oo) / ny;
+    if (y - (height - -78.0f) > 0.0f) continue;
+
+    *pheight = height;
+    return tri;
+  }
+
+  return NULL;
+}
+
+
 f32 findFloor(v3f pos, Surface **pfloor) {
   s16 x = (s16) pos.x;
   s16 y = (s16) pos.y;
@@ -61,11 +101,259 @@ f32 findFloor(v3f pos, Surface **pfloor) {
 
   f32 height = -11000.0f;
   *pfloor = findTriFromListBelow(allFloors.tail, x, y, z, &height);
+
+  // Like the game, the higher of the object and level floors wins
+  if (level != NULL) {
+    f32 staticHeight = -11000.0f;
+    Surface *staticFloor = findTriFromListBelow(
+      levelSurfaces(x, z, LEVEL_FLOORS), x, y, z, &staticHeight);
+
+    if (!(height > staticHeight)) {
+      height = staticHeight;
+      *pfloor = staticFloor;
+    }
+  }
   
   return height;
 }
 
 
+// Loaded objects only have floors (addOtherObject rejects any others), so
+// only the level has ceilings
+f32 findCeil(v3f pos, Surface **pceil) {
+  s16 x = (s16) pos.x;
+  s16 y = (s16) pos.y;
+  s16 z = (s16) pos.z;
+
+  *pceil = NULL;
+
+  if (x <= -0x2000 || x >= 0x2000) return 20000.0f;
+  if (z <= -0x2000 || z >= 0x2000) return 20000.0f;
+  if (level == NULL) return 20000.0f;
+
+  f32 height = 20000.0f;
+  *pceil = findTriFromListAbove(levelSurfaces(x, z, LEVEL_CEILS), x, y, z, &height);
+  return height;
+}
+
+
+// Points tested together by findFloorBatch and findCeilBatch
+#define BATCH_SIZE 64
+
+
+// Edge tests of findTriFromListBelow (dir = 1) or findTriFromListAbove
+// (dir = -1) for one triangle against a block of points, written without
+// branches so that the compiler can vectorize them. Only points that are still
+// open are marked, so that earlier triangles in the list take priority.
+// Returns whether any point was marked.
+static bool markInsideTri(Surface *tri, s32 dir, s32 n, s32 *xs, s32 *zs, s32 *open, s32 *inside) {
+  s32 x1 = tri->vertex1.x;
+  s32 z1 = tri->vertex1.z;
+  s32 x2 = tri->vertex2.x;
+  s32 z2 = tri->vertex2.z;
+  s32 x3 = tri->vertex3.x;
+  s32 z3 = tri->vertex3.z;
+
+  s32 any = 0;
+  for (s32 i = 0; i < n; i++) {
+    s32 x = xs[i];
+    s32 z = zs[i];
+
+    inside[i] = open[i] &
+      (dir * ((z1 - z) * (x2 - x1) - (x1 - x) * (z2 - z1)) >= 0) &
+      (dir * ((z2 - z) * (x3 - x2) - (x2 - x) * (z3 - z2)) >= 0) &
+      (dir * ((z3 - z) * (x1 - x3) - (x3 - x) * (z1 - z3)) >= 0);
+    any |= inside[i];
+  }
+
+  return any != 0;
+}
+
+
+// findTriFromListBelow or findTriFromListAbove for every open point of a
+// block, closing the points that find a surface
+static void findTrisInList(
+  SurfaceNode *triangles,
+  s32 kind,
+  s32 n,
+  s32 *xs,
+  s32 *ys,
+  s32 *zs,
+  s32 *open,
+  f32 *heights,
+  Surface **surfaces)
+{
+  s32 inside[BATCH_SIZE];
+  s32 dir = kind == LEVEL_FLOORS ? 1 : -1;
+
+  s32 remaining = 0;
+  for (s32 i = 0; i < n; i++)
+    remaining += open[i];
+
+  for (SurfaceNode *node = triangles; node != NULL && remaining > 0; node = node->tail) {
+    Surface *tri = node->head;
+
+    f32 nx = tri->normal.x;
+    f32 ny = tri->normal.y;
+    f32 nz = tri->normal.z;
+    f32 oo = tri->originOffset;
+
+    if (ny == 0.0f) continue;
+    if (!markInsideTri(tri, dir, n, xs, zs, open, inside)) continue;
+
+    for (s32 i = 0; i < n; i++) {
+      if (!inside[i]) continue;
+
+      s32 x = xs[i];
+      s32 y = ys[i];
+      s32 z = zs[i];
+
+      f32 height = -(x * nx + nz * z + oo) / ny;
+      if (kind == LEVEL_FLOORS) {
+        if (y - (height + -78.0f) < 0.0f) continue;
+      }
+      else {
+        if (y - (height - -78.0f) > 0.0f) continue;
+      }
+
+      heights[i] = height;
+      surfaces[i] = tri;
+      open[i] = 0;
+      remaining -= 1;
+    }
+  }
+}
+
+
+// Tests the points of a block against the level's lists of the given kind,
+// each cell's points together
+static void findInLevel(
+  s32 kind,
+  s32 n,
+  s32 *xs,
+  s32 *ys,
+  s32 *zs,
+  f32 *heights,
+  Surface **surfaces)
+{
+  s32 cells[BATCH_SIZE];
+  s32 pending[BATCH_SIZE];
+  s32 open[BATCH_SIZE];
+
+  s32 minX = 0x7FFF, maxX = -0x8000, minZ = 0x7FFF, maxZ = -0x8000;
+  for (s32 i = 0; i < n; i++) {
+    minX = xs[i] < minX ? xs[i] : minX;
+    maxX = xs[i] > maxX ? xs[i] : maxX;
+    minZ = zs[i] < minZ ? zs[i] : minZ;
+    maxZ = zs[i] > maxZ ? zs[i] : maxZ;
+    pending[i] = 1;
+  }
+
+  // Usually the whole block is in one cell
+  bool oneCell = n > 0 &&
+    levelCell((s16) minX) == levelCell((s16) maxX) &&
+    levelCell((s16) minZ) == levelCell((s16) maxZ);
+
+  for (s32 i = 0; i < n; i++)
+    cells[i] = oneCell ? 0 : levelCell(zs[i]) * NUM_CELLS + levelCell(xs[i]);
+
+  for (s32 i = 0; i < n; i++) {
+    if (!pending[i]) continue;
+
+    for (s32 j = i; j < n; j++) {
+      open[j] = pending[j] & (cells[j] == cells[i]);
+      pending[j] &= !open[j];
+    }
+
+    SurfaceNode *list = levelSurfaces(xs[i], zs[i], kind);
+    if (list != NULL)
+      findTrisInList(list, kind, n - i, xs + i, ys + i, zs + i, open + i,
+        heights + i, surfaces + i);
+  }
+}
+
+
+static void findBatch(s32 kind, v3f *points, s32 n, f32 *outHeights, Surface **outSurfaces) {
+  f32 noSurface = kind == LEVEL_FLOORS ? -11000.0f : 20000.0f;
+
+  for (s32 start = 0; start < n; start += BATCH_SIZE) {
+    s32 count = n - start < BATCH_SIZE ? n - start : BATCH_SIZE;
+
+    s32 xs[BATCH_SIZE];
+    s32 ys[BATCH_SIZE];
+    s32 zs[BATCH_SIZE];
+    s32 index[BATCH_SIZE];
+    s32 open[BATCH_SIZE];
+    f32 heights[BATCH_SIZE];
+    Surface *surfaces[BATCH_SIZE];
+    f32 staticHeights[BATCH_SIZE];
+    Surface *staticSurfaces[BATCH_SIZE];
+
+    // Out of bounds points are left out of the block
+    s32 m = 0;
+    for (s32 i = 0; i < count; i++) {
+      s16 x = (s16) points[start + i].x;
+      s16 y = (s16) points[start + i].y;
+      s16 z = (s16) points[start + i].z;
+
+      outHeights[start + i] = noSurface;
+      outSurfaces[start + i] = NULL;
+
+      if (x <= -0x2000 || x >= 0x2000) continue;
+      if (z <= -0x2000 || z >= 0x2000) continue;
+
+      xs[m] = x;
+      ys[m] = y;
+      zs[m] = z;
+      index[m] = start + i;
+      open[m] = 1;
+      heights[m] = noSurface;
+      surfaces[m] = NULL;
+      staticHeights[m] = noSurface;
+      staticSurfaces[m] = NULL;
+      m += 1;
+    }
+
+    if (kind == LEVEL_FLOORS)
+      findTrisInList(allFloors.tail, kind, m, xs, ys, zs, open, heights, surfaces);
+
+    if (level != NULL) {
+      findInLevel(kind, m, xs, ys, zs, staticHeights, staticSurfaces);
+
+      // Same choice between object and level surfaces as findFloor
+      for (s32 i = 0; i < m; i++) {
+        bool useStatic = kind == LEVEL_FLOORS ?
+          !(heights[i] > staticHeights[i]) :
+          !(heights[i] < staticHeights[i]);
+
+        if (useStatic) {
+          heights[i] = staticHeights[i];
+          surfaces[i] = staticSurfaces[i];
+        }
+      }
+    }
+
+    for (s32 i = 0; i < m; i++) {
+      outHeights[index[i]] = heights[i];
+      outSurfaces[index[i]] = surfaces[i];
+    }
+  }
+}
+
+
+// Same as calling findFloor on each point, but the edge tests of each triangle
+// are done for a block of points at once
+void findFloorBatch(v3f *points, s32 n, f32 *outHeights, Surface **outSurfaces) {
+  findBatch(LEVEL_FLOORS, points, n, outHeights, outSurfaces);
+}
+
+
+// Same as calling findCeil on each point
+void findCeilBatch(v3f *points, s32 n, f32 *outHeights, Surface **outSurfaces) {
+  findBatch(LEVEL_CEILS, points, n, outHeights, outSurfaces);
+}
+
+
 void updateAirWithoutTurn(MarioState *m) {
   m->hSpeed = incTowardAsymF(m->hSpeed, 0.0f, 0.35f, 0.35f);
 
@@ -93,21 +381,160 @@ void updateAirWithoutTurn(MarioState *m) {
 }
 
 
+// Mario is always at the cog's height, so finding one of its floors means he
+// lands on it. Level floors are only landed on from at or below their height.
+bool floorLands(Surface *floor, f32 height, f32 y) {
+  return floor != NULL && (floor->object != NULL || y <= height);
+}
+
+
 bool onFloor(MarioState *m) {
   Surface *floor;
-  findFloor(m->pos, &floor);
-  return floor != NULL;
+  f32 height = findFloor(m->pos, &floor);
+  return floorLands(floor, height, m->pos.y);
 }
 
 
-bool quarterStepLands(MarioState *m) {
+// Same as the game's find_wall_collisions_from_list. Every wall within radius
+// of where the point started pushes it out along the wall's normal.
+static void pushOutOfWalls(SurfaceNode *walls, v3f *pos, f32 offsetY, f32 radius) {
+  f32 x = pos->x;
+  f32 y = pos->y + offsetY;
+  f32 z = pos->z;
+
+  while (walls != NULL) {
+    Surface *wall = walls->head;
+    walls = walls->tail;
+
+    if (y < wall->lowerY || y > wall->upperY) continue;
+
+    f32 offset =
+      wall->normal.x * x + wall->normal.y * y + wall->normal.z * z + wall->originOffset;
+    if (offset < -radius || offset > radius) continue;
+
+    f32 y1 = wall->vertex1.y;
+    f32 y2 = wall->vertex2.y;
+    f32 y3 = wall->vertex3.y;
+
+    if (wall->v04 & SURFACE_FLAG_X_PROJECTION) {
+      f32 w1 = -wall->vertex1.z;
+      f32 w2 = -wall->vertex2.z;
+      f32 w3 = -wall->vertex3.z;
+
+      if (wall->normal.x > 0.0f) {
+        if ((y1 - y) * (w2 - w1) - (w1 - -z) * (y2 - y1) > 0.0f) continue;
+        if ((y2 - y) * (w3 - w2) - (w2 - -z) * (y3 - y2) > 0.0f) continue;
+        if ((y3 - y) * (w1 - w3) - (w3 - -z) * (y1 - y3) > 0.0f) continue;
+      }
+      else {
+        if ((y1 - y) * (w2 - w1) - (w1 - -z) * (y2 - y1) < 0.0f) continue;
+        if ((y2 - y) * (w3 - w2) - (w2 - -z) * (y3 - y2) < 0.0f) continue;
+        if ((y3 - y) * (w1 - w3) - (w3 - -z) * (y1 - y3) < 0.0f) continue;
+      }
+    }
+    else {
+      f32 w1 = wall->vertex1.x;
+      f32 w2 = wall->vertex2.x;
+      f32 w3 = wall->vertex3.x;
+
+      if (wall->normal.z > 0.0f) {
+        if ((y1 - y) * (w2 - w1) - (w1 - x) * (y2 - y1) > 0.0f) continue;
+        if ((y2 - y) * (w3 - w2) - (w2 - x) * (y3 - y2) > 0.0f) continue;
+        if ((y3 - y) * (w1 - w3) - (w3 - x) * (y1 - y3) > 0.0f) continue;
+      }
+      else {
+        if ((y1 - y) * (w2 - w1) - (w1 - x) * (y2 - y1) < 0.0f) continue;
+        if ((y2 - y) * (w3 - w2) - (w2 - x) * (y3 - y2) < 0.0f) continue;
+        if ((y3 - y) * (w1 - w3) - (w3 - x) * (y1 - y3) < 0.0f) continue;
+      }
+    }
+
+    pos->x += wall->normal.x * (radius - offset);
+    pos->z += wall->normal.z * (radius - offset);
+  }
+}
+
+
+// Like the game's resolve_and_return_wall_collisions
+static void resolveWallCollisions(v3f *pos, f32 offsetY, f32 radius) {
+  s16 x = (s16) pos->x;
+  s16 z = (s16) pos->z;
+
+  if (x <= -0x2000 || x >= 0x2000) return;
+  if (z <= -0x2000 || z >= 0x2000) return;
+
+  pushOutOfWalls(wallSurfaces(x, z), pos, offsetY, radius);
+}
+
+
+// Where the quarter step would end up if nothing was in the way
+v3f intendedQuarterStep(MarioState *m) {
   v3f qstep = {
     m->pos.x + m->vel.x / 4.0f,
     m->pos.y + m->vel.y / 4.0f,
     m->pos.z + m->vel.z / 4.0f,
   };
+  return qstep;
+}
+
+
+// Where the quarter step ends up after being pushed out of the walls, as in
+// perform_air_quarter_step
+v3f quarterStep(MarioState *m) {
+  v3f qstep = intendedQuarterStep(m);
+
+  // A step that isn't near a wall isn't moved by either check
+  s16 x = (s16) qstep.x;
+  s16 z = (s16) qstep.z;
+  if (x <= -0x2000 || x >= 0x2000 || z <= -0x2000 || z >= 0x2000) return qstep;
+  if (!nearWall(x, z)) return qstep;
+
+  resolveWallCollisions(&qstep, 150.0f, 50.0f);
+  resolveWallCollisions(&qstep, 30.0f, 50.0f);
+  return qstep;
+}
+
+
+// Whether the quarter step of any input could be pushed by a wall. An input
+// changes Mario's speed by at most 3.85 and adds at most 10 of side speed, so
+// his step stays within 3.5 units of where it would be without one.
+bool inputStepsNearWall(MarioState *m) {
+  f32 reach = 3.5f;
+  f32 x = m->pos.x + m->hSpeed * sins(m->facingYaw) / 4.0f;
+  f32 z = m->pos.z + m->hSpeed * coss(m->facingYaw) / 4.0f;
+
+  // The extra unit on each side covers rounding
+  return nearWallInRect(
+    (s32) (x - reach) - 1, (s32) (z - reach) - 1, (s32) (x + reach) + 1, (s32) (z + reach) + 1);
+}
+
+
+bool quarterStepLands(MarioState *m) {
+  v3f qstep = quarterStep(m);
 
   Surface *floor;
-  findFloor(qstep, &floor);
-  return floor != NULL;
+  f32 height = findFloor(qstep, &floor);
+  return floorLands(floor, height, qstep.y);
+}
+
+
+// When Mario lands with less than 160 units between the floor and the ceiling,
+// the game cancels the quarter step and he stays where he was. The ceiling is
+// looked for from 80 units above the floor, like vec3f_find_ceil.
+bool ceilCancelsStep(f32 ceilHeight, f32 floorHeight) {
+  return !(ceilHeight - floorHeight > 160.0f);
+}
+
+
+bool quarterStepUnderCeil(MarioState *m) {
+  v3f qstep = quarterStep(m);
+
+  Surface *floor;
+  f32 floorHeight = findFloor(qstep, &floor);
+
+  Surface *ceil;
+  v3f ceilPos = { qstep.x, floorHeight + 80.0f, qstep.z };
+  f32 ceilHeight = findCeil(ceilPos, &ceil);
+
+  return ceilCancelsStep(ceilHeight, floorHeight);
 }
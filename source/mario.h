@@ -20,9 +20,18 @@ struct MarioState {
 
 
 f32 findFloor(v3f pos, Surface **pfloor);
+f32 findCeil(v3f pos, Surface **pceil);
+void findFloorBatch(v3f *points, s32 n, f32 *outHeights, Surface **outSurfaces);
+void findCeilBatch(v3f *points, s32 n, f32 *outHeights, Surface **outSurfaces);
 void updateAirWithoutTurn(MarioState *m);
+bool floorLands(Surface *floor, f32 height, f32 y);
 bool onFloor(MarioState *m);
+v3f intendedQuarterStep(MarioState *m);
+v3f quarterStep(MarioState *m);
+bool inputStepsNearWall(MarioState *m);
 bool quarterStepLands(MarioState *m);
+bool ceilCancelsStep(f32 ceilHeight, f32 floorHeight);
+bool quarterStepUnderCeil(MarioState *m);
 
 
 #endif
\ No newline at end of file
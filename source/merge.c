@@ -0,0 +1,78 @@
+#include "checkpoint.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+bool mergeUlpResults(Checkpoint *c, s32 topCount);
+void mergeMonteCarloResults(Checkpoint *c, s32 topCount);
+void mergeRollSearches(char **filenames, s32 numFiles, s32 topCount);
+
+
+// Combines the result files of the shards of a sweep and reports the results
+// as if the sweep had been run at once. Units missing from every file (e.g.
+// an unfinished shard) are left out.
+void runMerge(char **filenames, s32 numFiles, s32 topCount) {
+  // Roll searches checkpoint as text instead
+  if (!isCheckpointFile(filenames[0])) {
+    mergeRollSearches(filenames, numFiles, topCount);
+    return;
+  }
+
+  Checkpoint *first = readCheckpointFile(filenames[0]);
+  if (first == NULL) exit(1);
+  Checkpoint *merged = newCheckpoint(first->mode, first->key, first->count, first->params, NULL);
+  first->filename = NULL;
+  closeCheckpoint(first);
+
+  for (s32 i = 0; i < numFiles; i++) {
+    Checkpoint *c = readCheckpointFile(filenames[i]);
+    if (c == NULL) exit(1);
+
+    if (c->mode != merged->mode || c->count != merged->count || c->key != merged->key ||
+      memcmp(c->params, merged->params, sizeof(c->params)) != 0)
+    {
+      fprintf(stderr, "'%s' and '%s' are results of different runs\n",
+        filenames[0], filenames[i]);
+      exit(1);
+    }
+
+    // Each file only holds its shard's units
+    for (s32 j = 0; j < c->numUnits; j++) {
+      s32 unit = shardUnit(&c->shard, j);
+      if (isUnitDone(c, unit) && !isUnitDone(merged, unit))
+        setUnitResult(merged, unit, unitResult(c, unit));
+    }
+
+    c->filename = NULL;
+    closeCheckpoint(c);
+  }
+
+  s32 numDone = 0;
+  for (s32 i = 0; i < merged->count; i++)
+    numDone += isUnitDone(merged, i);
+  printf("Merged %d files, \x1b[%sm%d/%d\x1b[0m units done\n",
+    numFiles, numDone == merged->count ? "92" : "91", numDone, merged->count);
+
+  switch (merged->mode) {
+  case CHECKPOINT_ULP:
+    if (!mergeUlpResults(merged, topCount)) {
+      fprintf(stderr, "Out of memory for %d variants\n", merged->count);
+      exit(1);
+    }
+    break;
+
+  case CHECKPOINT_SEEDS:
+  case CHECKPOINT_MC:
+    mergeMonteCarloResults(merged, topCount);
+    break;
+
+  default:
+    fprintf(stderr, "'%s' has unknown mode %d\n", filenames[0], merged->mode);
+    exit(1);
+  }
+
+  closeCheckpoint(merged);
+}
@@ -0,0 +1,210 @@
+#include "checkpoint.h"
+#include "state.h"
+#include "stats.h"
+#include "thread.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct {
+  SimState start;
+  s32 rollCount;
+  s32 maxFrames;
+  SurvivalStats stats;
+  SimResult *trialResults;
+  SimResult *seedResults;
+  Shard *shard;
+  Checkpoint *checkpoint;
+} MonteCarlo;
+
+
+// Each trial gets its own PRNG stream derived from its index, so results
+// don't depend on the number of threads or the order trials run in
+static void runTrial(s32 i, void *arg) {
+  MonteCarlo *mc = (MonteCarlo *) arg;
+  s32 index = shardUnit(mc->shard, i);
+  u64 prng = 0x6D6F6E746543ull ^ ((u64) index << 20);
+
+  if (isUnitDone(mc->checkpoint, index)) {
+    mc->trialResults[i] = *unitResult(mc->checkpoint, index);
+    return;
+  }
+
+  restoreState(&mc->start);
+  // Also used once the rolls run out, and by extra RNG calls
+  rngState = (u16) splitMix64(&prng);
+
+  s8 *rolls = NULL;
+  if (mc->rollCount > 0) {
+    rolls = (s8 *) malloc(mc->rollCount + 1);
+    for (s32 k = 0; k < mc->rollCount; k++)
+      rolls[k] = (s8) (splitMix64(&prng) % 13) - 6;
+    rolls[mc->rollCount] = 127;
+    cogRngOverride = rolls;
+  }
+
+  SimResult r = runUntilFailure(mc->maxFrames);
+  mc->trialResults[i] = r;
+  finishUnit(mc->checkpoint, index, &r);
+
+  free(rolls);
+}
+
+
+static void runSeed(s32 i, void *arg) {
+  MonteCarlo *mc = (MonteCarlo *) arg;
+  s32 seed = shardUnit(mc->shard, i);
+
+  if (isUnitDone(mc->checkpoint, seed)) {
+    mc->seedResults[seed] = *unitResult(mc->checkpoint, seed);
+    return;
+  }
+
+  restoreState(&mc->start);
+  rngState = (u16) seed;
+
+  SimResult r = runUntilFailure(mc->maxFrames);
+  mc->seedResults[seed] = r;
+  finishUnit(mc->checkpoint, seed, &r);
+}
+
+
+static void initMonteCarlo(MonteCarlo *mc, s32 rollCount, s32 maxFrames,
+  CheckpointConfig *checkpoint, Shard *shard, s32 mode, s32 count)
+{
+  memset(mc, 0, sizeof(MonteCarlo));
+  saveState(&mc->start);
+  mc->start.cogRngOverride = NULL;
+  mc->rollCount = rollCount;
+  mc->maxFrames = maxFrames;
+  mc->shard = shard;
+
+  u64 key = hashStartState(&mc->start);
+  key = mixHash(key, (u64) rollCount);
+  key = mixHash(key, (u64) maxFrames);
+
+  s32 params[CHECKPOINT_PARAMS] = { rollCount, maxFrames };
+  mc->checkpoint = openCheckpoint(checkpoint, mode, key, count, params, shard);
+}
+
+
+static void printShard(Shard *shard) {
+  if (shard->count > 1)
+    printf(" (shard %d/%d)", shard->index + 1, shard->count);
+  printf("\n");
+}
+
+
+// Runs the start state under random RNG states (or, if rollCount > 0, random
+// sequences of rollCount cog rolls) and prints the outcome distribution. The
+// rng values from the input file are ignored.
+void runMonteCarlo(s32 trials, s32 rollCount, s32 maxFrames,
+  CheckpointConfig *checkpoint, Shard *shard)
+{
+  MonteCarlo mc;
+  initMonteCarlo(&mc, rollCount, maxFrames, checkpoint, shard, CHECKPOINT_MC, trials);
+  s32 count = shardSize(shard, trials);
+
+  if (rollCount > 0)
+    printf("Running %d trials with %d random cog rolls each", count, rollCount);
+  else
+    printf("Running %d trials with random RNG states", count);
+  printShard(shard);
+
+  mc.trialResults = (SimResult *) malloc((count > 0 ? count : 1) * sizeof(SimResult));
+  if (mc.trialResults == NULL) {
+    fprintf(stderr, "Out of memory for %d trials\n", count);
+    exit(1);
+  }
+
+  parallelFor(count, runTrial, &mc);
+  closeCheckpoint(mc.checkpoint);
+
+  // Recorded in trial order so that the sums don't depend on which thread
+  // finished first
+  for (s32 i = 0; i < count; i++)
+    recordRun(&mc.stats, &mc.trialResults[i]);
+  printSurvivalStats(&mc.stats);
+  free(mc.trialResults);
+}
+
+
+static SimResult *sortedSeedResults;
+
+static int compareSeeds(const void *p1, const void *p2) {
+  SimResult *r1 = &sortedSeedResults[*(const s32 *) p1];
+  SimResult *r2 = &sortedSeedResults[*(const s32 *) p2];
+
+  if (r1->frames != r2->frames)
+    return r1->frames > r2->frames ? -1 : 1;
+  if (r1->hSpeed != r2->hSpeed)
+    return r1->hSpeed > r2->hSpeed ? -1 : 1;
+  return *(const s32 *) p1 - *(const s32 *) p2;
+}
+
+
+// Sorts the given seeds by their results and prints the best ones
+static void printBestSeeds(SimResult *results, s32 *seeds, s32 count, s32 topCount) {
+  sortedSeedResults = results;
+  qsort(seeds, count, sizeof(s32), compareSeeds);
+
+  printf("\nBest RNG states:\n");
+  for (s32 i = 0; i < topCount && i < count; i++) {
+    SimResult *r = &results[seeds[i]];
+    printf("%3d. rngState = 0x%04X: \x1b[1m%d\x1b[0m frames, %d cog RNG updates, "
+      "final H speed %f\n", i + 1, seeds[i], r->frames, r->numCogRngCalls, r->hSpeed);
+  }
+}
+
+
+// Exhaustive version of runMonteCarlo over every starting RNG state
+void runSeedSweep(s32 maxFrames, s32 topCount, CheckpointConfig *checkpoint, Shard *shard) {
+  MonteCarlo mc;
+  initMonteCarlo(&mc, 0, maxFrames, checkpoint, shard, CHECKPOINT_SEEDS, 0x10000);
+  mc.seedResults = (SimResult *) malloc(0x10000 * sizeof(SimResult));
+  s32 count = shardSize(shard, 0x10000);
+
+  if (shard->count > 1)
+    printf("Simulating %d of 65536 RNG states", count);
+  else
+    printf("Simulating all 65536 RNG states");
+  printShard(shard);
+  parallelFor(count, runSeed, &mc);
+  closeCheckpoint(mc.checkpoint);
+
+  for (s32 i = 0; i < count; i++)
+    recordRun(&mc.stats, &mc.seedResults[shardUnit(shard, i)]);
+  printSurvivalStats(&mc.stats);
+
+  s32 *seeds = (s32 *) malloc(count * sizeof(s32));
+  for (s32 i = 0; i < count; i++)
+    seeds[i] = shardUnit(shard, i);
+  printBestSeeds(mc.seedResults, seeds, count, topCount);
+
+  free(seeds);
+  free(mc.seedResults);
+}
+
+
+// Reports merged shard results of runMonteCarlo or runSeedSweep
+void mergeMonteCarloResults(Checkpoint *c, s32 topCount) {
+  SurvivalStats stats;
+  memset(&stats, 0, sizeof(SurvivalStats));
+
+  s32 *seeds = (s32 *) malloc(c->count * sizeof(s32));
+  s32 count = 0;
+  for (s32 i = 0; i < c->count; i++) {
+    if (!isUnitDone(c, i)) continue;
+    recordRun(&stats, unitResult(c, i));
+    seeds[count++] = i;
+  }
+
+  printSurvivalStats(&stats);
+  if (c->mode == CHECKPOINT_SEEDS)
+    printBestSeeds(c->results, seeds, count, topCount);
+
+  free(seeds);
+}
@@ -0,0 +1,65 @@
+#include "objects.h"
+
+#include "surface.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+ObjectSpec *otherObjects = NULL;
+s32 numOtherObjects = 0;
+
+// Each thread loads its own copies, since loading writes to the object and
+// the surface caches are per thread
+static THREAD_LOCAL Object *objects;
+static THREAD_LOCAL s32 numObjects;
+
+
+// Adds an object loaded after the cog every frame. The model is copied.
+// Returns false if it's malformed or has triangles other than floors.
+bool addOtherObject(s16 *model, s32 modelLength, v3f pos, s32 yaw, s32 yawVel) {
+  s32 length = collisionModelLength(model, modelLength);
+  if (length < 0) {
+    fprintf(stderr, "Invalid collision model\n");
+    return false;
+  }
+  if (!modelOnlyHasFloors(model, pos)) {
+    fprintf(stderr, "Collision model has walls or ceilings, which objects don't support\n");
+    return false;
+  }
+
+  ObjectSpec spec;
+  spec.model = (s16 *) malloc(length * sizeof(s16));
+  memcpy(spec.model, model, length * sizeof(s16));
+  spec.pos = pos;
+  spec.yaw = yaw;
+  spec.yawVel = yawVel;
+
+  otherObjects = (ObjectSpec *) realloc(
+    otherObjects, (numOtherObjects + 1) * sizeof(ObjectSpec));
+  otherObjects[numOtherObjects++] = spec;
+  return true;
+}
+
+
+// Loads the other objects' collision as it is after the given number of
+// frames, after whatever was loaded since the last clear
+void loadOtherObjects(s32 frame) {
+  if (numObjects < numOtherObjects) {
+    objects = (Object *) realloc(objects, numOtherObjects * sizeof(Object));
+    memset(&objects[numObjects], 0, (numOtherObjects - numObjects) * sizeof(Object));
+    numObjects = numOtherObjects;
+  }
+
+  for (s32 i = 0; i < numOtherObjects; i++) {
+    ObjectSpec *spec = &otherObjects[i];
+    Object *o = &objects[i];
+
+    o->pos = spec->pos;
+    o->displayAngle.yaw = spec->yaw + frame * spec->yawVel;
+    o->surfaceModel = spec->model;
+    loadObjectCollisionModel(o);
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef OBJECTS_H
+#define OBJECTS_H
+
+
+#include "util.h"
+
+
+// A collision object besides the cog, e.g. the Pedro spot's other cog. It
+// turns at a constant speed, so its yaw only depends on the frame. Objects
+// whose speed changes, like a cog in the random setting, aren't supported.
+typedef struct {
+  s16 *model;
+  v3f pos;
+  s32 yaw;
+  s32 yawVel;
+} ObjectSpec;
+
+
+// Shared by every thread and never modified while simulating
+extern ObjectSpec *otherObjects;
+extern s32 numOtherObjects;
+
+
+bool addOtherObject(s16 *model, s32 modelLength, v3f pos, s32 yaw, s32 yawVel);
+void loadOtherObjects(s32 frame);
+
+
+#endif
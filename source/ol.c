@@ -287,7 +287,8 @@ static Token *parseNumber(ParseCxt *p) {
     c = nextChar(p);
   }
 
-  if (digits->len == 0 || digits->cstr[0] < '0' || digits->cstr[0] > '9')
+  if (digits->len == 0 ||
+    (t->val->type != ol_hex && (digits->cstr[0] < '0' || digits->cstr[0] > '9')))
     parseError(&t->loc, "Expected number, found '%s'", digits->cstr);
 
   switch (t->val->type) {
@@ -579,7 +580,7 @@ char *ol_valueStr(OlValue *v) {
 }
 
 
-OlValue *ol_checkField(OlBlock *b, char *ident, OlValueType types) {
+OlValue *ol_findField(OlBlock *b, char *ident, OlValueType types) {
   OlValue *result = NULL;
 
   for (OlField *f = b->head; f != NULL; f = f->next) {
@@ -595,6 +596,12 @@ OlValue *ol_checkField(OlBlock *b, char *ident, OlValueType types) {
     }
   }
 
+  return result;
+}
+
+
+OlValue *ol_checkField(OlBlock *b, char *ident, OlValueType types) {
+  OlValue *result = ol_findField(b, ident, types);
   if (result == NULL)
     error("Missing field: '%s'", ident);
   return result;
@@ -627,7 +634,7 @@ float ol_checkFieldFloat(OlBlock *b, char *ident) {
 
   switch (v->type) {
   case ol_dec:
-    return (float) v->dec;
+    return (float) (int64_t) v->dec;
 
   case ol_hex:
     u.i = (uint32_t) v->hex;
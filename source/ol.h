@@ -47,6 +47,7 @@ OlBlock *ol_parseFile(char *filename);
 void ol_free(OlBlock *b);
 char *ol_valueStr(OlValue *v);
 
+OlValue *ol_findField(OlBlock *b, char *ident, OlValueType types);
 OlValue *ol_checkField(OlBlock *b, char *ident, OlValueType types);
 int ol_checkFieldInt(OlBlock *b, char *ident);
 float ol_checkFieldFloat(OlBlock *b, char *ident);
@@ -0,0 +1,338 @@
+#include "cog.h"
+#include "objects.h"
+#include "pool.h"
+#include "search.h"
+#include "state.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Everything that differs between search states. Mario's position and facing
+// yaw never change and every roll is chosen, so the rest of the state comes
+// from the root. The cog's target speed is 200 times the last roll.
+typedef struct {
+  f32 hSpeed;
+  f32 yawVel;
+  s32 frame;
+  u32 parent;
+  s16 cogYaw;
+  u16 rolls;
+  s8 roll;
+} PlanNode;
+
+
+typedef struct {
+  s32 f;
+  s32 g;
+  u32 node;
+} HeapEntry;
+
+
+typedef struct {
+  SimState root;
+  f32 target;
+  s32 horizon;
+  bool minimizeRolls;
+
+  // Most frames that can pass between two rolls, or 0 if unbounded
+  s32 maxFramesPerRoll;
+
+  // Allocated as the search grows, since most searches end far below maxNodes
+  SlabPool nodes;
+  u32 numNodes;
+  u32 maxNodes;
+
+  // Open addressing, maps a state to the node that reached it most cheaply
+  u32 *table;
+  u32 tableMask;
+
+  HeapEntry *heap;
+  u32 heapSize;
+} Planner;
+
+
+static PlanNode *nodeAt(Planner *p, u32 index) {
+  return (PlanNode *) poolGet(&p->nodes, index);
+}
+
+
+static void encodeNode(RollNode *src, u32 parent, s8 roll, u16 rolls, PlanNode *dst) {
+  dst->hSpeed = src->hSpeed;
+  dst->yawVel = src->state.cog.yawVel;
+  dst->frame = src->frame;
+  dst->parent = parent;
+  dst->cogYaw = (s16) src->state.cog.displayAngle.yaw;
+  dst->roll = roll;
+  dst->rolls = rolls;
+}
+
+
+static void decodeNode(Planner *p, PlanNode *src, RollNode *dst) {
+  dst->state = p->root;
+  dst->state.mario.hSpeed = src->hSpeed;
+  dst->state.cog.yawVel = src->yawVel;
+  if (src->rolls > 0)
+    dst->state.cog.yawVelTarget = 200.0f * src->roll;
+  dst->state.cog.displayAngle.yaw = src->cogYaw;
+  dst->state.numCogRngCalls = src->rolls;
+  // Node frames count from the input state, like the state's own
+  dst->state.frame = src->frame;
+  dst->frame = src->frame;
+  dst->hSpeed = src->hSpeed;
+  dst->done = false;
+  dst->result = fr_success;
+  dst->lastRollUnused = false;
+}
+
+
+// When minimizing frames, a state reached on a later frame is never better
+// than the same state reached earlier. Otherwise the frame matters: with
+// fewer rolls but less of the horizon left, or with the other objects
+// somewhere else.
+static bool frameInState(Planner *p) {
+  return p->minimizeRolls || numOtherObjects > 0;
+}
+
+
+// The root's target speed comes from the input rather than its roll, so it
+// never matches another node
+static u32 hashPlanNode(Planner *p, PlanNode *n) {
+  u32 h = 2166136261u;
+  u32 words[4];
+  memcpy(&words[0], &n->hSpeed, 4);
+  memcpy(&words[1], &n->yawVel, 4);
+  words[2] = (u8) n->roll | (n->rolls == 0) << 8;
+  words[3] = (u16) n->cogYaw;
+  if (frameInState(p))
+    words[3] ^= (u32) n->frame << 16;
+
+  for (s32 i = 0; i < 4; i++)
+    h = (h ^ words[i]) * 16777619u;
+  return h ^ (h >> 15);
+}
+
+
+static bool sameState(Planner *p, PlanNode *a, PlanNode *b) {
+  return a->hSpeed == b->hSpeed && a->yawVel == b->yawVel &&
+    a->roll == b->roll && a->cogYaw == b->cogYaw &&
+    (a->rolls == 0) == (b->rolls == 0) &&
+    (!frameInState(p) || a->frame == b->frame);
+}
+
+
+static s32 costOf(Planner *p, PlanNode *n) {
+  return p->minimizeRolls ? n->rolls : n->frame;
+}
+
+
+// A node is just before a roll, and the cog rolls again as soon as it reaches
+// the new target, so a roll is followed by at most one ramp. Targets are 200
+// times a roll, except for the input's, which the cog may be at when the
+// first roll comes.
+static s32 maxFramesPerRoll(Object *cog) {
+  f64 maxSpeed = 1200.0;
+  if (fabs(cog->yawVel) > maxSpeed) maxSpeed = fabs(cog->yawVel);
+  if (fabs(cog->yawVelTarget) > maxSpeed) maxSpeed = fabs(cog->yawVelTarget);
+
+  f64 frames = ceil((maxSpeed + 1200.0) / 50.0) + 1.0;
+  return frames < 1e9 ? (s32) frames : 0;
+}
+
+
+static s32 heuristic(Planner *p, f32 hSpeed) {
+  s32 frames = minFramesToReach(hSpeed, p->target);
+  if (p->minimizeRolls)
+    return p->maxFramesPerRoll > 0 ? frames / p->maxFramesPerRoll : 0;
+  return frames;
+}
+
+
+static void heapPush(Planner *p, HeapEntry e) {
+  u32 i = p->heapSize++;
+  while (i > 0) {
+    u32 parent = (i - 1) / 2;
+    HeapEntry *q = &p->heap[parent];
+    if (q->f < e.f || (q->f == e.f && q->g >= e.g)) break;
+    p->heap[i] = *q;
+    i = parent;
+  }
+  p->heap[i] = e;
+}
+
+
+static HeapEntry heapPop(Planner *p) {
+  HeapEntry top = p->heap[0];
+  HeapEntry last = p->heap[--p->heapSize];
+
+  u32 i = 0;
+  while (true) {
+    u32 c = 2 * i + 1;
+    if (c >= p->heapSize) break;
+    if (c + 1 < p->heapSize) {
+      HeapEntry *a = &p->heap[c];
+      HeapEntry *b = &p->heap[c + 1];
+      if (b->f < a->f || (b->f == a->f && b->g > a->g)) c += 1;
+    }
+    HeapEntry *q = &p->heap[c];
+    if (last.f < q->f || (last.f == q->f && last.g >= q->g)) break;
+    p->heap[i] = *q;
+    i = c;
+  }
+  p->heap[i] = last;
+  return top;
+}
+
+
+// Adds the node unless its state was already reached at least as cheaply.
+// Returns false if out of memory.
+static bool addNode(Planner *p, PlanNode *n) {
+  u32 slot = hashPlanNode(p, n) & p->tableMask;
+  while (p->table[slot] != 0) {
+    PlanNode *other = nodeAt(p, p->table[slot] - 1);
+    if (sameState(p, other, n)) {
+      if (costOf(p, other) <= costOf(p, n)) return true;
+      break;
+    }
+    slot = (slot + 1) & p->tableMask;
+  }
+
+  if (p->numNodes == p->maxNodes) return false;
+  u32 index = poolAlloc(&p->nodes);
+  if (index == POOL_NONE) return false;
+
+  p->numNodes += 1;
+  *nodeAt(p, index) = *n;
+  p->table[slot] = index + 1;
+
+  HeapEntry e;
+  e.g = costOf(p, n);
+  e.f = e.g + heuristic(p, n->hSpeed);
+  e.node = index;
+  heapPush(p, e);
+  return true;
+}
+
+
+static void printPlan(Planner *p, u32 goal) {
+  PlanNode *n = nodeAt(p, goal);
+  s32 numRolls = n->rolls;
+  s8 *rolls = (s8 *) malloc(numRolls + 1);
+
+  for (u32 i = goal; i != 0; i = nodeAt(p, i)->parent)
+    rolls[nodeAt(p, i)->rolls - 1] = nodeAt(p, i)->roll;
+
+  printf("Reached H speed \x1b[1m%f\x1b[0m after %d frames and %d cog rolls\n",
+    n->hSpeed, n->frame, numRolls);
+  writeRolls(stdout, rolls, numRolls, "");
+  free(rolls);
+}
+
+
+// A* over cog roll choices for the cheapest way to reach the target H speed,
+// where cost is either frames or number of rolls. The heuristic assumes the
+// maximum possible speed gain on every frame, so it never overestimates and
+// the first goal popped is optimal.
+void runPlanner(f32 target, bool minimizeRolls, s32 horizon, u32 maxNodes) {
+  if (ttcSpeedSetting != 2) {
+    printf("Planning only applies to the random speed setting (2)\n");
+    return;
+  }
+
+  Planner p;
+  memset(&p, 0, sizeof(Planner));
+  p.target = target;
+  p.horizon = horizon;
+  p.minimizeRolls = minimizeRolls;
+  p.maxNodes = maxNodes;
+
+  u32 tableSize = 1;
+  while (tableSize < 2 * maxNodes)
+    tableSize *= 2;
+  p.tableMask = tableSize - 1;
+
+  initSlabPool(&p.nodes, sizeof(PlanNode));
+  p.heap = (HeapEntry *) malloc(maxNodes * sizeof(HeapEntry));
+  p.table = (u32 *) calloc(tableSize, sizeof(u32));
+  if (p.heap == NULL || p.table == NULL) {
+    printf("Not enough memory for %u nodes\n", maxNodes);
+    return;
+  }
+
+  RollNode root;
+  searchRoot(&root, horizon, target);
+  p.root = root.state;
+  p.maxFramesPerRoll = maxFramesPerRoll(&root.state.cog);
+
+  printf("Searching for the fewest %s to reach H speed %f (%u nodes max, %u bytes each)\n",
+    minimizeRolls ? "cog rolls" : "frames", target, maxNodes, (u32) sizeof(PlanNode));
+
+  PlanNode start;
+  encodeNode(&root, 0, 0, 0, &start);
+
+  bool found = false;
+  bool outOfMemory = false;
+
+  if (root.done) {
+    if (root.hSpeed >= target) {
+      u32 index = poolAlloc(&p.nodes);
+      if (index == POOL_NONE) {
+        outOfMemory = true;
+      }
+      else {
+        p.numNodes += 1;
+        *nodeAt(&p, index) = start;
+        printPlan(&p, index);
+        found = true;
+      }
+    }
+  }
+  else {
+    addNode(&p, &start);
+  }
+
+  while (!found && p.heapSize > 0) {
+    HeapEntry e = heapPop(&p);
+    PlanNode node = *nodeAt(&p, e.node);
+
+    // Goals are only added to the open list once done, so popping one means
+    // nothing cheaper remains
+    if (node.hSpeed >= target) {
+      printPlan(&p, e.node);
+      found = true;
+      break;
+    }
+
+    RollNode parent;
+    decodeNode(&p, &node, &parent);
+
+    for (s32 i = 0; i < NUM_ROLLS; i++) {
+      RollNode child;
+      expandRoll(&parent, MIN_ROLL + i, horizon, target, &child);
+      if (child.done && child.hSpeed < target) continue;
+
+      PlanNode encoded;
+      encodeNode(&child, e.node, (s8) (MIN_ROLL + i), (u16) (node.rolls + 1), &encoded);
+      if (!addNode(&p, &encoded)) {
+        outOfMemory = true;
+        break;
+      }
+    }
+
+    if (outOfMemory) break;
+  }
+
+  if (!found) {
+    if (outOfMemory)
+      printf("Gave up after %u nodes without reaching the target\n", p.numNodes);
+    else
+      printf("Target is unreachable within %d frames\n", horizon);
+  }
+
+  freeSlabPool(&p.nodes);
+  free(p.heap);
+  free(p.table);
+}
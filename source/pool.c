@@ -0,0 +1,82 @@
+#include "pool.h"
+
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// Slabs of 64K elements keep the slab table small while not wasting much
+// memory on the last slab
+#define SLAB_SHIFT 16
+
+
+void initSlabPool(SlabPool *p, u32 elemSize) {
+  memset(p, 0, sizeof(SlabPool));
+
+  // Freed elements hold the index of the next free one
+  p->elemSize = elemSize < sizeof(u32) ? sizeof(u32) : elemSize;
+  p->slabShift = SLAB_SHIFT;
+  p->freeList = POOL_NONE;
+}
+
+
+void freeSlabPool(SlabPool *p) {
+  for (u32 i = 0; i < p->numSlabs; i++)
+    free(p->slabs[i]);
+  free(p->slabs);
+  initSlabPool(p, p->elemSize);
+}
+
+
+void *poolGet(SlabPool *p, u32 index) {
+  u32 mask = (1u << p->slabShift) - 1;
+  return p->slabs[index >> p->slabShift] + (size_t) (index & mask) * p->elemSize;
+}
+
+
+// Returns POOL_NONE if out of memory
+u32 poolAlloc(SlabPool *p) {
+  if (p->freeList != POOL_NONE) {
+    u32 index = p->freeList;
+    memcpy(&p->freeList, poolGet(p, index), sizeof(u32));
+    p->numFree -= 1;
+    return index;
+  }
+
+  if (p->numElems == POOL_NONE) return POOL_NONE;
+
+  if ((p->numElems >> p->slabShift) == p->numSlabs) {
+    if (p->numSlabs == p->maxSlabs) {
+      u32 maxSlabs = p->maxSlabs > 0 ? 2 * p->maxSlabs : 16;
+      u8 **slabs = (u8 **) realloc(p->slabs, maxSlabs * sizeof(u8 *));
+      if (slabs == NULL) return POOL_NONE;
+      p->slabs = slabs;
+      p->maxSlabs = maxSlabs;
+    }
+
+    u8 *slab = (u8 *) malloc((size_t) p->elemSize << p->slabShift);
+    if (slab == NULL) return POOL_NONE;
+    p->slabs[p->numSlabs++] = slab;
+  }
+
+  return p->numElems++;
+}
+
+
+void poolFree(SlabPool *p, u32 index) {
+  memcpy(poolGet(p, index), &p->freeList, sizeof(u32));
+  p->freeList = index;
+  p->numFree += 1;
+}
+
+
+// Number of elements currently allocated
+u32 poolCount(SlabPool *p) {
+  return p->numElems - p->numFree;
+}
+
+
+u64 poolBytes(SlabPool *p) {
+  return ((u64) p->numSlabs * p->elemSize << p->slabShift) + p->maxSlabs * sizeof(u8 *);
+}
@@ -0,0 +1,35 @@
+#ifndef POOL_H
+#define POOL_H
+
+
+#include "util.h"
+
+
+#define POOL_NONE 0xFFFFFFFFu
+
+
+// Fixed-size elements allocated from slabs that never move, so that indices
+// and pointers stay valid as the pool grows. Freed elements are reused before
+// new ones are taken. Not thread safe.
+typedef struct {
+  u32 elemSize;
+  u32 slabShift;
+  u8 **slabs;
+  u32 numSlabs;
+  u32 maxSlabs;
+  u32 numElems;
+  u32 numFree;
+  u32 freeList;
+} SlabPool;
+
+
+void initSlabPool(SlabPool *p, u32 elemSize);
+void freeSlabPool(SlabPool *p);
+u32 poolAlloc(SlabPool *p);
+void poolFree(SlabPool *p, u32 index);
+void *poolGet(SlabPool *p, u32 index);
+u32 poolCount(SlabPool *p);
+u64 poolBytes(SlabPool *p);
+
+
+#endif
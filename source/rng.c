@@ -0,0 +1,148 @@
+#include "rng.h"
+
+#include "cog.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+
+static u16 cycleStates[RNG_CYCLE_LENGTH];
+static s32 cycleIndices[0x10000];
+
+// The cog roll made starting from each state on the cycle
+static s8 cycleRolls[RNG_CYCLE_LENGTH];
+
+// Every RNG state sorted by the sequence of cog rolls it produces, with the
+// rolls packed 4 bits each, first roll in the high bits
+static u32 rollKeys[0x10000];
+static u16 rollStates[0x10000];
+
+
+static int compareU64(const void *p1, const void *p2) {
+  u64 a = *(const u64 *) p1;
+  u64 b = *(const u64 *) p2;
+  return a < b ? -1 : a > b;
+}
+
+
+static void buildRngTables(void) {
+  u16 saved = rngState;
+
+  for (s32 i = 0; i < 0x10000; i++)
+    cycleIndices[i] = -1;
+
+  rngState = 0;
+  for (s32 i = 0; i < RNG_CYCLE_LENGTH; i++) {
+    cycleStates[i] = rngState;
+    cycleIndices[rngState] = i;
+    randomU16();
+  }
+
+  for (s32 i = 0; i < RNG_CYCLE_LENGTH; i++) {
+    rngState = cycleStates[i];
+    cycleRolls[i] = (s8) randomCogRoll();
+  }
+
+  u64 *entries = (u64 *) malloc(0x10000 * sizeof(u64));
+  for (s32 i = 0; i < 0x10000; i++) {
+    rngState = (u16) i;
+
+    u32 key = 0;
+    for (s32 k = 0; k < ROLL_INDEX_DEPTH; k++)
+      key = (key << 4) | (u32) (randomCogRoll() + 6);
+
+    entries[i] = ((u64) key << 16) | (u64) i;
+  }
+
+  qsort(entries, 0x10000, sizeof(u64), compareU64);
+  for (s32 i = 0; i < 0x10000; i++) {
+    rollKeys[i] = (u32) (entries[i] >> 16);
+    rollStates[i] = (u16) entries[i];
+  }
+  free(entries);
+
+  rngState = saved;
+}
+
+
+// Safe to call from any thread; only the first call builds the tables
+void initRngTables(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, buildRngTables);
+}
+
+
+// Position of the state on the RNG cycle, or -1 if the state isn't on it
+s32 rngCycleIndex(u16 state) {
+  return cycleIndices[state];
+}
+
+
+u16 rngCycleState(s32 index) {
+  index %= RNG_CYCLE_LENGTH;
+  if (index < 0) index += RNG_CYCLE_LENGTH;
+  return cycleStates[index];
+}
+
+
+// The cog roll made from the state at the given index, which consumes the
+// next two states
+s32 rngCycleRoll(s32 index) {
+  index %= RNG_CYCLE_LENGTH;
+  if (index < 0) index += RNG_CYCLE_LENGTH;
+  return cycleRolls[index];
+}
+
+
+// Equivalent to calling randomU16 the given number of times
+void advanceRng(s64 calls) {
+  if (calls < RNG_CYCLE_LENGTH / 64) {
+    while (calls-- > 0)
+      randomU16();
+    return;
+  }
+
+  initRngTables();
+  while (calls > 0 && cycleIndices[rngState] < 0) {
+    randomU16();
+    calls -= 1;
+  }
+  rngState = rngCycleState((s32) ((cycleIndices[rngState] + calls) % RNG_CYCLE_LENGTH));
+}
+
+
+static s32 lowerBound(u32 key) {
+  s32 lo = 0;
+  s32 hi = 0x10000;
+  while (lo < hi) {
+    s32 mid = (lo + hi) / 2;
+    if (rollKeys[mid] < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+
+// Finds every RNG state whose next cog rolls start with the given ones. Only
+// the first ROLL_INDEX_DEPTH rolls are used.
+s32 findStatesByRolls(s8 *rolls, s32 count, u16 **states) {
+  if (count > ROLL_INDEX_DEPTH)
+    count = ROLL_INDEX_DEPTH;
+
+  u32 prefix = 0;
+  for (s32 i = 0; i < count; i++)
+    prefix = (prefix << 4) | (u32) (rolls[i] + 6);
+
+  s32 shift = 4 * (ROLL_INDEX_DEPTH - count);
+  u32 lo = prefix << shift;
+  u32 hi = (prefix + 1) << shift;
+
+  s32 begin = lowerBound(lo);
+  s32 end = count == 0 ? 0x10000 : lowerBound(hi);
+
+  *states = &rollStates[begin];
+  return end - begin;
+}
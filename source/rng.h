@@ -0,0 +1,24 @@
+#ifndef RNG_H
+#define RNG_H
+
+
+#include "util.h"
+
+
+// Every state reaches the cycle containing 0 after at most a few calls
+#define RNG_CYCLE_LENGTH 65114
+
+// Number of cog rolls each state is indexed by
+#define ROLL_INDEX_DEPTH 8
+
+
+void initRngTables(void);
+s32 rngCycleIndex(u16 state);
+u16 rngCycleState(s32 index);
+s32 rngCycleRoll(s32 index);
+void advanceRng(s64 calls);
+
+s32 findStatesByRolls(s8 *rolls, s32 count, u16 **states);
+
+
+#endif
@@ -0,0 +1,128 @@
+#include "cog.h"
+#include "rng.h"
+#include "state.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+typedef struct {
+  s32 extra;
+  s32 frame;
+  s32 earlierRolls;
+  u16 rngState;
+} RngSchedule;
+
+
+// Whether the cog rolls the wanted sequence, starting with a roll from the RNG
+// state at the given cycle index. The cog's speed is yawVel when it rolls.
+static bool rollsMatch(s32 index, f32 yawVel, s32 extra, s8 *rolls, s32 count) {
+  for (s32 k = 0; k < count; k++) {
+    if (rngCycleRoll(index) != rolls[k]) return false;
+    index = (index + 2) % RNG_CYCLE_LENGTH;
+    if (k == count - 1) break;
+
+    f32 target = 200.0f * rolls[k];
+    do {
+      index = (index + extra) % RNG_CYCLE_LENGTH;
+    } while (!incTowardSymFP(&yawVel, target, 50.0f));
+  }
+  return true;
+}
+
+
+// Finds the first frames within maxDelay at which the cog starts rolling the
+// wanted sequence when extra other RNG calls happen each frame. The cog is
+// only tracked by its speed and the RNG by its cycle index, so each frame is
+// a few additions.
+static s32 findSchedules(s32 start, s32 extra, s32 maxDelay, s8 *rolls, s32 count,
+  RngSchedule *out, s32 maxOut)
+{
+  s32 index = start;
+  f32 yawVel = cog.yawVel;
+  f32 target = cog.yawVelTarget;
+  s32 earlierRolls = 0;
+  s32 found = 0;
+
+  for (s32 frame = 1; frame <= maxDelay && found < maxOut; frame++) {
+    index = (index + extra) % RNG_CYCLE_LENGTH;
+    if (!incTowardSymFP(&yawVel, target, 50.0f)) continue;
+
+    if (rollsMatch(index, yawVel, extra, rolls, count)) {
+      RngSchedule *sch = &out[found++];
+      sch->extra = extra;
+      sch->frame = frame;
+      sch->earlierRolls = earlierRolls;
+      sch->rngState = rngCycleState(index);
+    }
+
+    target = 200.0f * rngCycleRoll(index);
+    index = (index + 2) % RNG_CYCLE_LENGTH;
+    earlierRolls += 1;
+  }
+
+  return found;
+}
+
+
+static int compareSchedules(const void *p1, const void *p2) {
+  const RngSchedule *a = (const RngSchedule *) p1;
+  const RngSchedule *b = (const RngSchedule *) p2;
+  if (a->frame != b->frame)
+    return a->frame < b->frame ? -1 : 1;
+  return a->extra - b->extra;
+}
+
+
+// Searches for the number of other RNG calls per frame (0 to maxExtra) and
+// the frame within maxDelay at which the cog, starting from the input state,
+// rolls the sequence given by the input file's rng values
+void runRngPlan(s32 maxExtra, s32 maxDelay, s32 topCount) {
+  if (ttcSpeedSetting != 2) {
+    printf("RNG planning only applies to the random speed setting (2)\n");
+    return;
+  }
+  if (overrideRngLength == 0) {
+    printf("No rng values to plan for\n");
+    return;
+  }
+  if (topCount < 1) topCount = 1;
+
+  initRngTables();
+
+  // The game's RNG starts at 0, so only states on its cycle occur
+  s32 start = rngCycleIndex(rngState);
+  if (start < 0) {
+    printf("rngState 0x%04X isn't on the RNG cycle\n", rngState);
+    return;
+  }
+
+  s8 *rolls = cogRngOverride;
+  s32 count = overrideRngLength;
+
+  RngSchedule *schedules = (RngSchedule *) malloc((maxExtra + 1) * topCount * sizeof(RngSchedule));
+  s32 numSchedules = 0;
+
+  for (s32 extra = 0; extra <= maxExtra; extra++) {
+    numSchedules += findSchedules(start, extra, maxDelay, rolls, count,
+      &schedules[numSchedules], topCount);
+  }
+
+  qsort(schedules, numSchedules, sizeof(RngSchedule), compareSchedules);
+
+  printf("Searched 0 to %d extra RNG calls per frame over %d frames for %d rolls\n",
+    maxExtra, maxDelay, count);
+  if (numSchedules == 0)
+    printf("No schedule produces the rolls\n");
+
+  if (numSchedules > topCount) numSchedules = topCount;
+  for (s32 i = 0; i < numSchedules; i++) {
+    RngSchedule *sch = &schedules[i];
+    printf("%3d. \x1b[1m%d\x1b[0m extra calls per frame: rolls start on frame %d "
+      "after %d other rolls (rngState = 0x%04X)\n",
+      i + 1, sch->extra, sch->frame, sch->earlierRolls, sch->rngState);
+  }
+
+  free(schedules);
+}
@@ -0,0 +1,583 @@
+#include "checkpoint.h"
+#include "cog.h"
+#include "ol.h"
+#include "search.h"
+#include "state.h"
+#include "thread.h"
+#include "transposition.h"
+#include "util.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+// The tree is split into at least this many tasks per thread, so that
+// threads that finish early can take more work. The split doesn't change the
+// results, but a resumed search and the shards of a search must split the
+// same way, so sharded runs use a number per shard instead.
+#define TASKS_PER_THREAD 4
+#define TASKS_PER_SHARD 16
+#define MAX_TASKS 65536
+#define MAX_TASK_DEPTH 6
+
+
+// numRolls includes a final roll that had no effect, which isn't printed
+typedef struct {
+  RollOutcome outcome;
+  s32 numRolls;
+  s8 *rolls;
+  bool lastRollUnused;
+} RollSequence;
+
+
+typedef struct {
+  RollNode node;
+  s8 rolls[MAX_TASK_DEPTH];
+} RollTask;
+
+
+typedef struct {
+  s32 horizon;
+  s32 topCount;
+
+  RollTask *tasks;
+  s32 numTasks;
+  s32 taskDepth;
+  bool *completed;
+
+  pthread_mutex_t lock;
+  RollSequence *best;
+  s32 numBest;
+  u32 threshold;
+
+  CheckpointConfig *checkpoint;
+  Shard *shard;
+  u64 key;
+  time_t lastCheckpoint;
+
+  // Shared by every task, see searchNode
+  TranspositionTable *table;
+
+  u64 nodes;
+  u64 pruned;
+  u64 transpositions;
+  u64 tablePruned;
+
+  s32 nextTask;
+} RollSearch;
+
+
+// Counts are kept per task and added up when it's done, so that threads
+// don't contend for them
+typedef struct {
+  RollSearch *s;
+  s32 task;
+  s8 *rolls;
+
+  u64 nodes;
+  u64 pruned;
+  u64 transpositions;
+  u64 tablePruned;
+  TtStats tableStats;
+} RollWorker;
+
+
+// H speed a node must be able to beat to be worth exploring. This stays at
+// -infinity until topCount sequences have been found.
+static f32 loadThreshold(RollSearch *s) {
+  return bitsFloat(__atomic_load_n(&s->threshold, __ATOMIC_RELAXED));
+}
+
+
+// The sequence listed for an outcome is the lexicographically smallest one
+// that reaches it
+static bool isBetter(RollSequence *seq, RollSequence *than) {
+  if (!sameOutcome(&seq->outcome, &than->outcome))
+    return isBetterOutcome(&seq->outcome, &than->outcome);
+
+  for (s32 i = 0; i < seq->numRolls && i < than->numRolls; i++) {
+    if (seq->rolls[i] != than->rolls[i])
+      return seq->rolls[i] < than->rolls[i];
+  }
+  return seq->numRolls < than->numRolls;
+}
+
+
+// Each outcome is kept once. The same sequence can also be offered again, by
+// every shard if it ends before the tasks split, or by a resumed search.
+static void insertSequence(RollSearch *s, RollSequence *candidate) {
+  for (s32 i = 0; i < s->numBest; i++) {
+    if (!sameOutcome(&s->best[i].outcome, &candidate->outcome)) continue;
+    if (!isBetter(candidate, &s->best[i])) return;
+
+    free(s->best[i].rolls);
+    memmove(&s->best[i], &s->best[i + 1], (s->numBest - i - 1) * sizeof(RollSequence));
+    s->numBest -= 1;
+    break;
+  }
+
+  s32 i = s->numBest;
+  while (i > 0 && isBetter(candidate, &s->best[i - 1]))
+    i -= 1;
+
+  if (i < s->topCount) {
+    if (s->numBest == s->topCount)
+      free(s->best[--s->numBest].rolls);
+
+    memmove(&s->best[i + 1], &s->best[i], (s->numBest - i) * sizeof(RollSequence));
+    s->numBest += 1;
+
+    RollSequence *seq = &s->best[i];
+    *seq = *candidate;
+    seq->rolls = (s8 *) malloc(candidate->numRolls + 1);
+    memcpy(seq->rolls, candidate->rolls, candidate->numRolls);
+
+    if (s->numBest == s->topCount) {
+      __atomic_store_n(&s->threshold,
+        floatBits(s->best[s->numBest - 1].outcome.hSpeed), __ATOMIC_RELAXED);
+    }
+  }
+}
+
+
+static void offerSequence(RollSearch *s, RollNode *node, s8 *rolls, s32 numRolls) {
+  if (node->hSpeed < loadThreshold(s))
+    return;
+
+  RollSequence candidate;
+  nodeOutcome(node, &candidate.outcome);
+  candidate.numRolls = numRolls;
+  candidate.rolls = rolls;
+  candidate.lastRollUnused = node->lastRollUnused;
+
+  pthread_mutex_lock(&s->lock);
+  insertSequence(s, &candidate);
+  pthread_mutex_unlock(&s->lock);
+}
+
+
+// Mario's position and facing yaw never change, and the RNG isn't used since
+// every roll is chosen, so two nodes with the same frame, H speed and cog
+// state have identical subtrees
+static void nodeKey(RollNode *node, u32 *key) {
+  key[0] = (u32) node->frame;
+  key[1] = floatBits(node->hSpeed);
+  key[2] = (u16) node->state.cog.displayAngle.yaw;
+  key[3] = floatBits(node->state.cog.yawVel);
+  key[4] = floatBits(node->state.cog.yawVelTarget);
+}
+
+
+// Table entries hold the lowest task that has reached the state and an upper
+// bound on the H speed its subtree can reach
+static u64 tableEntry(s32 task, f32 bound) {
+  return (u64) (u32) task << 32 | floatBits(bound);
+}
+
+
+static s32 entryTask(u64 entry) {
+  return (s32) (entry >> 32);
+}
+
+
+static f32 entryBound(u64 entry) {
+  return bitsFloat((u32) entry);
+}
+
+
+// Returns an upper bound on the final H speed of any sequence through node.
+//
+// Tasks are numbered in the order of their rolls, and each explores its
+// children in roll order, so a state already claimed by an earlier task, or
+// earlier by the same task, was reached through a lexicographically smaller
+// prefix. Such a state is skipped: every sequence through it has the same
+// outcome as a smaller one through the other prefix. The smallest sequence of
+// each outcome is never skipped, so the results don't depend on the order
+// tasks run in, or on entries lost from the table. A state claimed by a later
+// task is explored again, and only pruned if its bound can't reach the
+// threshold.
+static f32 searchNode(RollWorker *w, RollNode *node, s32 depth) {
+  RollSearch *s = w->s;
+  w->nodes += 1;
+
+  if (node->done) {
+    offerSequence(s, node, w->rolls, depth);
+    return node->hSpeed;
+  }
+
+  // Equal bounds are still explored since they can win a tie
+  f32 bound = maxHSpeedAfter(node->hSpeed, s->horizon - node->frame);
+  if (bound < loadThreshold(s)) {
+    w->pruned += 1;
+    return bound;
+  }
+
+  u32 key[TT_KEY_WORDS];
+  nodeKey(node, key);
+
+  u64 stored;
+  if (ttProbe(s->table, key, &stored, &w->tableStats)) {
+    if (entryBound(stored) < bound)
+      bound = entryBound(stored);
+    if (entryTask(stored) <= w->task) {
+      w->transpositions += 1;
+      return bound;
+    }
+    if (bound < loadThreshold(s)) {
+      w->tablePruned += 1;
+      return bound;
+    }
+  }
+
+  // Bigger subtrees are kept over smaller ones
+  s32 remaining = s->horizon - node->frame;
+  u16 priority = (u16) (remaining < 0xFFFF ? remaining : 0xFFFF);
+
+  // Claimed before exploring, so that later tasks can skip it meanwhile
+  ttStore(s->table, key, tableEntry(w->task, bound), priority, &w->tableStats);
+
+  f32 best = -INFINITY;
+  for (s32 i = 0; i < NUM_ROLLS; i++) {
+    RollNode child;
+    w->rolls[depth] = (s8) (MIN_ROLL + i);
+    expandRoll(node, MIN_ROLL + i, s->horizon, INFINITY, &child);
+    f32 childBound = searchNode(w, &child, depth + 1);
+    if (childBound > best) best = childBound;
+  }
+
+  ttStore(s->table, key, tableEntry(w->task, best), priority, &w->tableStats);
+  return best;
+}
+
+
+static bool writeSearchState(FILE *f, void *arg) {
+  RollSearch *s = (RollSearch *) arg;
+
+  fprintf(f, "horizon = %d\n", s->horizon);
+  fprintf(f, "key = 0x%016llX\n", (unsigned long long) s->key);
+  fprintf(f, "tasks = %d\n", s->numTasks);
+  fprintf(f, "depth = %d\n\n", s->taskDepth);
+
+  fprintf(f, "completed = {");
+  for (s32 i = 0; i < s->numTasks; i++) {
+    if (s->completed[i])
+      fprintf(f, " %d", i);
+  }
+  fprintf(f, " }\n\n");
+
+  fprintf(f, "best = {\n");
+  for (s32 i = 0; i < s->numBest; i++) {
+    RollSequence *seq = &s->best[i];
+    fprintf(f, "  {\n");
+    fprintf(f, "    hSpeed = 0x%08X\n", floatBits(seq->outcome.hSpeed));
+    fprintf(f, "    frames = %d\n", seq->outcome.frames);
+    fprintf(f, "    result = %d\n", (s32) seq->outcome.result);
+    fprintf(f, "    cogYaw = %d\n", seq->outcome.cogYaw);
+    fprintf(f, "    cogSpeed = 0x%08X\n", floatBits(seq->outcome.cogSpeed));
+    fprintf(f, "    lastRollUnused = %d\n", seq->lastRollUnused);
+    fprintf(f, "    ");
+    writeRolls(f, seq->rolls, seq->numRolls, "    ");
+    fprintf(f, "  }\n");
+  }
+  fprintf(f, "}\n");
+
+  return !ferror(f);
+}
+
+
+static void writeCheckpoint(RollSearch *s) {
+  writeFileAtomic(s->checkpoint->filename, writeSearchState, s);
+}
+
+
+// Adds the completed tasks and best sequences from a checkpoint, and returns
+// the number of tasks that weren't already completed. If s has no tasks yet,
+// they're taken from the file.
+static s32 readSearchFile(RollSearch *s, char *filename) {
+  OlBlock *b = ol_parseFile(filename);
+
+  s32 horizon = ol_checkFieldInt(b, "horizon");
+  u64 key = ol_checkField(b, "key", ol_hex)->hex;
+  s32 numTasks = ol_checkFieldInt(b, "tasks");
+  OlValue *depthValue = ol_findField(b, "depth", ol_dec);
+  s32 depth = depthValue != NULL ? (s32) depthValue->dec : 2;
+
+  if (s->completed == NULL) {
+    s->horizon = horizon;
+    s->key = key;
+    s->numTasks = numTasks;
+    s->taskDepth = depth;
+    s->completed = (bool *) calloc(numTasks > 0 ? numTasks : 1, sizeof(bool));
+  }
+  else if (horizon != s->horizon || key != s->key || numTasks != s->numTasks
+    || depth != s->taskDepth)
+  {
+    fprintf(stderr, "'%s' is a checkpoint of a different search\n", filename);
+    exit(1);
+  }
+
+  s32 numCompleted = 0;
+  OlBlock *completed = ol_checkFieldArray(b, "completed", ol_dec);
+  for (OlField *e = completed->head; e != NULL; e = e->next) {
+    s32 index = (s32) e->value->dec;
+    if (index >= 0 && index < s->numTasks && !s->completed[index]) {
+      s->completed[index] = true;
+      numCompleted += 1;
+    }
+  }
+
+  OlBlock *best = ol_checkFieldArray(b, "best", ol_block);
+  for (OlField *e = best->head; e != NULL; e = e->next) {
+    OlBlock *entry = e->value->block;
+    OlBlock *rolls = ol_checkFieldArray(entry, "rng", ol_dec);
+
+    RollSequence seq;
+    seq.outcome.hSpeed = ol_checkFieldFloat(entry, "hspeed");
+    seq.outcome.frames = ol_checkFieldInt(entry, "frames");
+    seq.outcome.result = (FrameResult) ol_checkFieldInt(entry, "result");
+    seq.outcome.cogYaw = (u16) ol_checkFieldInt(entry, "cogyaw");
+    seq.outcome.cogSpeed = ol_checkFieldFloat(entry, "cogspeed");
+    seq.lastRollUnused = ol_checkFieldInt(entry, "lastrollunused") != 0;
+    seq.numRolls = 0;
+    for (OlField *r = rolls->head; r != NULL; r = r->next)
+      seq.numRolls += 1;
+
+    seq.rolls = (s8 *) malloc(seq.numRolls + 1);
+    s32 i = 0;
+    for (OlField *r = rolls->head; r != NULL; r = r->next)
+      seq.rolls[i++] = (s8) r->value->dec;
+
+    insertSequence(s, &seq);
+    free(seq.rolls);
+  }
+
+  ol_free(b);
+  return numCompleted;
+}
+
+
+// Restores the completed tasks and best sequences of an earlier run. The
+// tasks are the same since they only depend on the start state.
+static void resumeSearch(RollSearch *s) {
+  FILE *f = fopen(s->checkpoint->filename, "rb");
+  if (f == NULL) {
+    printf("No checkpoint at '%s', starting from the beginning\n", s->checkpoint->filename);
+    return;
+  }
+  fclose(f);
+
+  s32 numCompleted = readSearchFile(s, s->checkpoint->filename);
+  printf("Resuming with %d of %d tasks done\n", numCompleted, s->numTasks);
+}
+
+
+// Tasks are taken in order instead of by i, so that the tasks running at once
+// are neighbours, and later tasks mostly find the states they share with
+// earlier ones already claimed
+static void searchTask(s32 i, void *arg) {
+  RollSearch *s = (RollSearch *) arg;
+  (void) i;
+  s32 index = shardUnit(s->shard, __atomic_fetch_add(&s->nextTask, 1, __ATOMIC_RELAXED));
+  RollTask *task = &s->tasks[index];
+  if (s->completed[index]) return;
+
+  RollWorker w;
+  memset(&w, 0, sizeof(RollWorker));
+  w.s = s;
+  w.task = index;
+  w.rolls = (s8 *) malloc(s->horizon + MAX_TASK_DEPTH);
+  memcpy(w.rolls, task->rolls, s->taskDepth);
+
+  searchNode(&w, &task->node, s->taskDepth);
+
+  free(w.rolls);
+
+  pthread_mutex_lock(&s->lock);
+  s->nodes += w.nodes;
+  s->pruned += w.pruned;
+  s->transpositions += w.transpositions;
+  s->tablePruned += w.tablePruned;
+  ttAddStats(s->table, &w.tableStats);
+  s->completed[index] = true;
+  time_t now = time(NULL);
+  if (s->checkpoint->filename != NULL && now - s->lastCheckpoint >= s->checkpoint->interval) {
+    writeCheckpoint(s);
+    s->lastCheckpoint = now;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+
+// Splits the top of the tree into independent tasks, one roll at a time, until
+// there are at least minTasks or the depth limit is reached. If depth isn't
+// negative, it's split to exactly that depth instead. Sequences that end
+// before the split are offered directly.
+static void collectTasks(RollSearch *s, RollNode *root, s32 minTasks, s32 depth) {
+  s->tasks = (RollTask *) malloc(sizeof(RollTask));
+  s->numTasks = 0;
+  s->taskDepth = 0;
+  if (root->done) {
+    offerSequence(s, root, NULL, 0);
+    return;
+  }
+  s->tasks[0].node = *root;
+  s->numTasks = 1;
+
+  while (depth >= 0 ? s->taskDepth < depth
+    : s->numTasks < minTasks && s->taskDepth < MAX_TASK_DEPTH)
+  {
+    RollTask *next = (RollTask *) malloc((s->numTasks * NUM_ROLLS + 1) * sizeof(RollTask));
+    s32 numNext = 0;
+
+    for (s32 i = 0; i < s->numTasks; i++) {
+      RollTask *task = &s->tasks[i];
+      for (s32 j = 0; j < NUM_ROLLS; j++) {
+        RollTask *child = &next[numNext];
+        expandRoll(&task->node, MIN_ROLL + j, s->horizon, INFINITY, &child->node);
+        memcpy(child->rolls, task->rolls, s->taskDepth);
+        child->rolls[s->taskDepth] = (s8) (MIN_ROLL + j);
+
+        if (child->node.done)
+          offerSequence(s, &child->node, child->rolls, s->taskDepth + 1);
+        else
+          numNext += 1;
+      }
+    }
+
+    free(s->tasks);
+    s->tasks = next;
+    s->numTasks = numNext;
+    s->taskDepth += 1;
+  }
+}
+
+
+// Depth of the tasks in an earlier run's checkpoint, or -1 if there's none.
+// Checkpoints from before the depth was recorded split at 2 rolls.
+static s32 checkpointTaskDepth(char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) return -1;
+  fclose(f);
+
+  OlBlock *b = ol_parseFile(filename);
+  OlValue *v = ol_findField(b, "depth", ol_dec);
+  s32 depth = v != NULL ? (s32) v->dec : 2;
+  ol_free(b);
+
+  if (depth < 0 || depth > MAX_TASK_DEPTH) {
+    fprintf(stderr, "'%s' has an invalid task depth\n", filename);
+    exit(1);
+  }
+  return depth;
+}
+
+
+static void printSequence(s32 rank, RollSequence *seq) {
+  RollOutcome *o = &seq->outcome;
+  printf("%3d. Final H speed \x1b[1m%f\x1b[0m after %d frames (%s)\n",
+    rank, o->hSpeed, o->frames,
+    o->result == fr_success ? "reached horizon" : frameResultName(o->result));
+  printf("     ");
+  writeRolls(stdout, seq->rolls, seq->numRolls - seq->lastRollUnused, "     ");
+}
+
+
+// Depth-first branch and bound over the cog roll chosen at each roll, keeping
+// the topCount sequences with the highest H speed after horizon frames (or
+// when Mario fails, if earlier)
+void runRollSearch(s32 horizon, s32 topCount, CheckpointConfig *checkpoint, Shard *shard) {
+  if (ttcSpeedSetting != 2) {
+    printf("Roll search only applies to the random speed setting (2)\n");
+    return;
+  }
+  if (topCount < 1) topCount = 1;
+
+  RollSearch s;
+  memset(&s, 0, sizeof(RollSearch));
+  s.horizon = horizon;
+  s.topCount = topCount;
+  s.best = (RollSequence *) malloc(topCount * sizeof(RollSequence));
+  s.threshold = floatBits(-INFINITY);
+  s.checkpoint = checkpoint;
+  s.shard = shard;
+  s.lastCheckpoint = time(NULL);
+  s.table = createTranspositionTable((u64) ttSizeMb << 20);
+  pthread_mutex_init(&s.lock, NULL);
+
+  s32 threads = numThreads > 0 ? numThreads : defaultNumThreads();
+  s32 minTasks = shard->count > 1 ? TASKS_PER_SHARD * shard->count : TASKS_PER_THREAD * threads;
+  if (minTasks > MAX_TASKS) minTasks = MAX_TASKS;
+
+  // A resumed search must split the same way as the run it continues
+  s32 depth = -1;
+  if (checkpoint->filename != NULL && checkpoint->resume)
+    depth = checkpointTaskDepth(checkpoint->filename);
+
+  RollNode root;
+  searchRoot(&root, horizon, INFINITY);
+  collectTasks(&s, &root, minTasks, depth);
+  s.completed = (bool *) calloc(s.numTasks > 0 ? s.numTasks : 1, sizeof(bool));
+
+  s.key = mixHash(hashStartState(&root.state), (u64) horizon);
+  if (checkpoint->filename != NULL && checkpoint->resume)
+    resumeSearch(&s);
+
+  s32 count = shardSize(shard, s.numTasks);
+  if (shard->count > 1)
+    printf("Searching roll sequences over %d frames (%d of %d tasks at depth %d, shard %d/%d)\n",
+      horizon, count, s.numTasks, s.taskDepth, shard->index + 1, shard->count);
+  else
+    printf("Searching roll sequences over %d frames (%d tasks at depth %d)\n",
+      horizon, s.numTasks, s.taskDepth);
+  parallelFor(count, searchTask, &s);
+
+  if (checkpoint->filename != NULL)
+    writeCheckpoint(&s);
+
+  printf("Visited %llu nodes, pruned %llu, %llu transpositions, %llu pruned by the table\n",
+    (unsigned long long) s.nodes,
+    (unsigned long long) s.pruned,
+    (unsigned long long) s.transpositions,
+    (unsigned long long) s.tablePruned);
+  printTtStats(s.table);
+  for (s32 i = 0; i < s.numBest; i++) {
+    printSequence(i + 1, &s.best[i]);
+    free(s.best[i].rolls);
+  }
+
+  free(s.best);
+  free(s.tasks);
+  free(s.completed);
+  freeTranspositionTable(s.table);
+  pthread_mutex_destroy(&s.lock);
+}
+
+
+// Combines the checkpoints of the shards of a roll search
+void mergeRollSearches(char **filenames, s32 numFiles, s32 topCount) {
+  if (topCount < 1) topCount = 1;
+
+  RollSearch s;
+  memset(&s, 0, sizeof(RollSearch));
+  s.topCount = topCount;
+  s.best = (RollSequence *) malloc(topCount * sizeof(RollSequence));
+  s.threshold = floatBits(-INFINITY);
+
+  s32 numCompleted = 0;
+  for (s32 i = 0; i < numFiles; i++)
+    numCompleted += readSearchFile(&s, filenames[i]);
+
+  printf("Roll sequences over %d frames, %d of %d tasks completed\n",
+    s.horizon, numCompleted, s.numTasks);
+  for (s32 i = 0; i < s.numBest; i++) {
+    printSequence(i + 1, &s.best[i]);
+    free(s.best[i].rolls);
+  }
+
+  free(s.best);
+  free(s.completed);
+}
@@ -0,0 +1,158 @@
+#include "search.h"
+
+#include "cog.h"
+#include "state.h"
+#include "util.h"
+
+#include <stdio.h>
+
+
+static THREAD_LOCAL s8 chosenRoll[2];
+
+
+static void advanceToRoll(RollNode *node, s32 horizon, f32 stopHSpeed) {
+  while (node->frame < horizon && node->hSpeed < stopHSpeed && !cogNeedsRoll(&cog)) {
+    FrameResult result = frameAdvance();
+    if (result != fr_success) {
+      node->done = true;
+      node->result = result;
+      break;
+    }
+
+    node->frame += 1;
+    node->hSpeed = mario.hSpeed;
+  }
+
+  if (node->frame >= horizon || node->hSpeed >= stopHSpeed) {
+    node->done = true;
+    node->result = fr_success;
+  }
+
+  saveState(&node->state);
+}
+
+
+// Starts from the current state, ignoring any rng values from the input.
+// Nodes are done once they reach the horizon or stopHSpeed.
+void searchRoot(RollNode *root, s32 horizon, f32 stopHSpeed) {
+  cogRngOverride = NULL;
+
+  root->frame = 0;
+  root->hSpeed = mario.hSpeed;
+  root->done = false;
+  root->result = fr_success;
+  root->lastRollUnused = false;
+
+  advanceToRoll(root, horizon, stopHSpeed);
+}
+
+
+// Applies the roll and simulates up to the next frame that needs one. The
+// node's hSpeed is that of the last successful frame.
+void expandRoll(
+  RollNode *parent, s32 roll, s32 horizon, f32 stopHSpeed, RollNode *child)
+{
+  restoreState(&parent->state);
+  chosenRoll[0] = (s8) roll;
+  chosenRoll[1] = 127;
+  cogRngOverride = &chosenRoll[0];
+
+  child->frame = parent->frame;
+  child->hSpeed = parent->hSpeed;
+  child->done = false;
+  child->result = fr_success;
+  child->lastRollUnused = false;
+
+  FrameResult result = frameAdvance();
+  if (result != fr_success) {
+    child->done = true;
+    child->result = result;
+    child->lastRollUnused = true;
+    saveState(&child->state);
+    return;
+  }
+
+  child->frame += 1;
+  child->hSpeed = mario.hSpeed;
+  advanceToRoll(child, horizon, stopHSpeed);
+  if (child->done && child->frame == parent->frame + 1 && child->result == fr_success)
+    child->lastRollUnused = true;
+}
+
+
+// The cog's speed target is left out, since a roll on the last frame sets it
+// without changing anything else
+void nodeOutcome(RollNode *node, RollOutcome *outcome) {
+  outcome->hSpeed = node->hSpeed;
+  outcome->frames = node->frame;
+  outcome->result = node->result;
+  outcome->cogYaw = (u16) node->state.cog.displayAngle.yaw;
+  outcome->cogSpeed = node->state.cog.yawVel;
+}
+
+
+// Highest H speed first, then the longest survivor. Ties are ordered by the
+// cog state, so that the order doesn't depend on the search.
+bool isBetterOutcome(RollOutcome *a, RollOutcome *b) {
+  if (a->hSpeed != b->hSpeed)
+    return a->hSpeed > b->hSpeed;
+  if (a->frames != b->frames)
+    return a->frames > b->frames;
+  if (a->result != b->result)
+    return a->result < b->result;
+  if (a->cogYaw != b->cogYaw)
+    return a->cogYaw < b->cogYaw;
+  return a->cogSpeed < b->cogSpeed;
+}
+
+
+bool sameOutcome(RollOutcome *a, RollOutcome *b) {
+  return a->hSpeed == b->hSpeed && a->frames == b->frames && a->result == b->result
+    && a->cogYaw == b->cogYaw && a->cogSpeed == b->cogSpeed;
+}
+
+
+// Per frame, air drag takes 0.35 and full forward input adds at most 1.5,
+// and anything above 32 is then reduced by 1
+static f64 maxHSpeedStep(f64 h) {
+  if (h + 1.15 <= 32.0)
+    return h + 1.15;
+  return h + 0.15 > 32.0 ? h + 0.15 : 32.0;
+}
+
+
+// Upper bound on the H speed reachable in the given number of frames, with a
+// little slack for f32 rounding
+f32 maxHSpeedAfter(f32 hSpeed, s32 frames) {
+  f64 h = hSpeed;
+  for (s32 i = 0; i < frames; i++)
+    h = maxHSpeedStep(h) + 0.0001;
+  return (f32) h;
+}
+
+
+// Lower bound on the number of frames needed to reach target, for the same
+// reason
+s32 minFramesToReach(f32 hSpeed, f32 target) {
+  f64 h = hSpeed;
+  s32 frames = 0;
+  while (h < target) {
+    h = maxHSpeedStep(h) + 0.0001;
+    frames += 1;
+  }
+  return frames;
+}
+
+
+// Same layout as the rng field of the input file
+void writeRolls(FILE *f, s8 *rolls, s32 count, char *indent) {
+  fprintf(f, "rng = {");
+  for (s32 i = 0; i < count; i++) {
+    if (i % 30 == 0)
+      fprintf(f, "\n%s  ", indent);
+    else
+      fprintf(f, " ");
+    fprintf(f, "%d", rolls[i]);
+  }
+  fprintf(f, "\n%s}\n", indent);
+}
@@ -0,0 +1,56 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+
+#include "state.h"
+#include "util.h"
+
+#include <stdio.h>
+
+
+#define NUM_ROLLS 13
+#define MIN_ROLL (-6)
+
+
+typedef struct RollNode RollNode;
+
+
+// A point in a search over cog roll sequences. Unless done, the state is just
+// before a frame on which the cog will roll, so successors are obtained by
+// choosing that roll.
+struct RollNode {
+  SimState state;
+  s32 frame;
+  f32 hSpeed;
+  bool done;
+  FrameResult result;
+  // The node ended on the frame of its last roll. The cog only turns by the
+  // new target from the next frame on, so that roll had no effect.
+  bool lastRollUnused;
+};
+
+
+// How a roll sequence ends: the final H speed and frame, and the cog state
+// that later rolls would start from. Sequences that pass through the same
+// state end in the same outcome, so searches list each outcome once.
+typedef struct {
+  f32 hSpeed;
+  s32 frames;
+  FrameResult result;
+  u16 cogYaw;
+  f32 cogSpeed;
+} RollOutcome;
+
+
+void searchRoot(RollNode *root, s32 horizon, f32 stopHSpeed);
+void expandRoll(
+  RollNode *parent, s32 roll, s32 horizon, f32 stopHSpeed, RollNode *child);
+void nodeOutcome(RollNode *node, RollOutcome *outcome);
+bool isBetterOutcome(RollOutcome *a, RollOutcome *b);
+bool sameOutcome(RollOutcome *a, RollOutcome *b);
+f32 maxHSpeedAfter(f32 hSpeed, s32 frames);
+s32 minFramesToReach(f32 hSpeed, f32 target);
+void writeRolls(FILE *f, s8 *rolls, s32 count, char *indent);
+
+
+#endif
@@ -0,0 +1,213 @@
+#include "cog.h"
+#include "ol.h"
+#include "rng.h"
+#include "state.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+#define MAX_PRINTED_STATES 64
+
+
+// Cog yaw and/or speed after each frame, starting with frame 1
+typedef struct {
+  s32 numFrames;
+  bool *hasYaw;
+  s16 *yaw;
+  bool *hasSpeed;
+  f32 *speed;
+} Observations;
+
+
+static f32 valueFloat(OlValue *v) {
+  switch (v->type) {
+  case ol_dec: return (f32) (s64) v->dec;
+  case ol_fp:  return (f32) v->fp;
+  default:     return 0.0f;
+  }
+}
+
+
+static s32 arrayLength(OlBlock *a) {
+  s32 n = 0;
+  for (OlField *f = a->head; f != NULL; f = f->next)
+    n += 1;
+  return n;
+}
+
+
+static void loadObservations(char *filename, Observations *obs) {
+  OlBlock *b = ol_parseFile(filename);
+
+  OlBlock *yaws = NULL;
+  OlBlock *speeds = NULL;
+  if (ol_findField(b, "yaws", ol_block) != NULL)
+    yaws = ol_checkFieldArray(b, "yaws", ol_dec | ol_hex);
+  if (ol_findField(b, "speeds", ol_block) != NULL)
+    speeds = ol_checkFieldArray(b, "speeds", ol_dec | ol_fp);
+
+  obs->numFrames = 0;
+  if (yaws != NULL && arrayLength(yaws) > obs->numFrames)
+    obs->numFrames = arrayLength(yaws);
+  if (speeds != NULL && arrayLength(speeds) > obs->numFrames)
+    obs->numFrames = arrayLength(speeds);
+
+  obs->hasYaw = (bool *) calloc(obs->numFrames + 1, sizeof(bool));
+  obs->yaw = (s16 *) calloc(obs->numFrames + 1, sizeof(s16));
+  obs->hasSpeed = (bool *) calloc(obs->numFrames + 1, sizeof(bool));
+  obs->speed = (f32 *) calloc(obs->numFrames + 1, sizeof(f32));
+
+  s32 i = 0;
+  for (OlField *f = yaws != NULL ? yaws->head : NULL; f != NULL; f = f->next) {
+    obs->hasYaw[i] = true;
+    obs->yaw[i++] = (s16) f->value->dec;
+  }
+
+  i = 0;
+  for (OlField *f = speeds != NULL ? speeds->head : NULL; f != NULL; f = f->next) {
+    obs->hasSpeed[i] = true;
+    obs->speed[i++] = valueFloat(f->value);
+  }
+
+  ol_free(b);
+}
+
+
+static bool matchesFrame(Observations *obs, s32 frame, Object *o) {
+  if (obs->hasYaw[frame] && obs->yaw[frame] != (s16) o->displayAngle.yaw)
+    return false;
+  if (obs->hasSpeed[frame] && obs->speed[frame] != o->yawVel)
+    return false;
+  return true;
+}
+
+
+static bool matchesAll(Observations *obs, Object start, u16 seed) {
+  Object o = start;
+  cogRngOverride = NULL;
+  rngState = seed;
+
+  for (s32 frame = 0; frame < obs->numFrames; frame++) {
+    updateTtcCog(&o);
+    if (!matchesFrame(obs, frame, &o)) return false;
+  }
+  return true;
+}
+
+
+typedef struct {
+  Observations *obs;
+  Object start;
+  u8 *checked;
+  s32 numCandidates;
+  u16 *matches;
+  s32 numMatches;
+} SeedSearch;
+
+
+// Walks the roll sequences consistent with the observations, only following
+// rolls for which some RNG state produces that prefix. Once the observations
+// or the indexed rolls run out, the states with the prefix are checked by
+// simulating the cog.
+static void searchRolls(SeedSearch *s, Object o, s32 frame, s8 *rolls, s32 count) {
+  Observations *obs = s->obs;
+
+  while (frame < obs->numFrames && !cogNeedsRoll(&o)) {
+    updateTtcCog(&o);
+    if (!matchesFrame(obs, frame, &o)) return;
+    frame += 1;
+  }
+
+  u16 *states;
+  if (frame >= obs->numFrames || count == ROLL_INDEX_DEPTH) {
+    s32 n = findStatesByRolls(rolls, count, &states);
+    for (s32 i = 0; i < n; i++) {
+      u16 seed = states[i];
+      if (s->checked[seed >> 3] & (1 << (seed & 7))) continue;
+      s->checked[seed >> 3] |= 1 << (seed & 7);
+
+      s->numCandidates += 1;
+      if (matchesAll(obs, s->start, seed))
+        s->matches[s->numMatches++] = seed;
+    }
+    return;
+  }
+
+  s8 chosen[2] = { 0, 127 };
+  for (s32 roll = -6; roll <= 6; roll++) {
+    rolls[count] = (s8) roll;
+    if (findStatesByRolls(rolls, count + 1, &states) == 0) continue;
+
+    Object p = o;
+    chosen[0] = (s8) roll;
+    cogRngOverride = &chosen[0];
+    updateTtcCog(&p);
+
+    if (matchesFrame(obs, frame, &p))
+      searchRolls(s, p, frame + 1, rolls, count + 1);
+  }
+}
+
+
+// Finds every RNG state that makes the cog from the input file produce the
+// observed yaws and/or speeds. A yaw ramp only shows the direction of each
+// roll until the cog turns, so several roll sequences usually fit the
+// observations; the roll index prunes these to ones some RNG state produces.
+void runSeedInference(char *filename) {
+  if (ttcSpeedSetting != 2) {
+    printf("Seed inference only applies to the random speed setting (2)\n");
+    return;
+  }
+
+  clock_t startTime = clock();
+
+  Observations obs;
+  loadObservations(filename, &obs);
+  initRngTables();
+
+  SeedSearch s;
+  s.obs = &obs;
+  s.start = cog;
+  s.checked = (u8 *) calloc(0x10000 / 8, 1);
+  s.numCandidates = 0;
+  s.matches = (u16 *) malloc(0x10000 * sizeof(u16));
+  s.numMatches = 0;
+
+  // The roll index assumes the cog's rolls use consecutive RNG calls
+  if (extraRngCalls == 0) {
+    s8 rolls[ROLL_INDEX_DEPTH];
+    searchRolls(&s, cog, 0, &rolls[0], 0);
+  }
+  else {
+    for (s32 seed = 0; seed < 0x10000; seed++) {
+      s.numCandidates += 1;
+      if (matchesAll(&obs, s.start, (u16) seed))
+        s.matches[s.numMatches++] = (u16) seed;
+    }
+  }
+
+  f64 ms = 1000.0 * (clock() - startTime) / CLOCKS_PER_SEC;
+  printf("Observed %d frames, checked %d candidate states\n",
+    obs.numFrames, s.numCandidates);
+  printf("Found \x1b[1m%d\x1b[0m consistent RNG states in %.1f ms\n", s.numMatches, ms);
+
+  for (s32 i = 0; i < s.numMatches && i < MAX_PRINTED_STATES; i++) {
+    s32 index = rngCycleIndex(s.matches[i]);
+    if (index >= 0)
+      printf("  rngState = 0x%04X (cycle index %d)\n", s.matches[i], index);
+    else
+      printf("  rngState = 0x%04X (not on cycle)\n", s.matches[i]);
+  }
+  if (s.numMatches > MAX_PRINTED_STATES)
+    printf("  ...\n");
+
+  free(s.checked);
+  free(s.matches);
+  free(obs.hasYaw);
+  free(obs.yaw);
+  free(obs.hasSpeed);
+  free(obs.speed);
+}
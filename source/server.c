@@ -0,0 +1,674 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "cog.h"
+#include "json.h"
+#include "rng.h"
+#include "state.h"
+#include "thread.h"
+#include "trajectory.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WIN32)
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+
+#define TRAJECTORY_CACHE_SIZE 8
+
+// Limits on what one request can ask for, so that a bad request gets an
+// error instead of exhausting the server's memory or time
+#define MAX_REQUEST_FRAMES 10000000
+#define MAX_SWEEP_POINTS (1 << 20)
+
+// A socket client that sends nothing, or doesn't read its responses, for
+// this long is dropped so that it can't hold up the clients behind it
+#define CLIENT_TIMEOUT_SECONDS 30
+
+
+// A cog trajectory kept between requests, keyed by everything that
+// determines the cog's motion
+typedef struct {
+  Object cog;
+  u16 rngState;
+  s32 numRolls;
+  s8 *rolls;
+  CogTrajectory *trajectory;
+  u64 lastUsed;
+} CachedTrajectory;
+
+
+typedef struct {
+  SimState base;
+  s32 maxFrames;
+  CachedTrajectory cache[TRAJECTORY_CACHE_SIZE];
+  u64 useCounter;
+} Server;
+
+
+typedef struct {
+  SimState start;
+  s8 *rolls;
+  s32 numRolls;
+  s32 maxFrames;
+} Request;
+
+
+typedef struct {
+  SimState start;
+  s32 field;
+  f32 base;
+  f64 from;
+  f64 to;
+  s32 ulps;
+  s32 count;
+  s32 maxFrames;
+  f32 *values;
+  SimResult *results;
+} Sweep;
+
+
+// Parses a whole "0x..." string of at most 32 bits
+static bool jsonHex(JsonValue *v, u32 *out) {
+  if (v->type != json_string || strncmp(v->string, "0x", 2) != 0) return false;
+  char *end;
+  unsigned long long x = strtoull(v->string + 2, &end, 16);
+  if (end == v->string + 2 || *end != '\0' || x > 0xFFFFFFFFull) return false;
+  *out = (u32) x;
+  return true;
+}
+
+
+// Numbers, or hex strings giving the exact IEEE-754 bits as in input files
+static bool jsonFloat(JsonValue *v, f32 *out) {
+  if (v->type == json_number) {
+    *out = (f32) v->number;
+    return true;
+  }
+  u32 bits;
+  if (jsonHex(v, &bits)) {
+    *out = bitsFloat(bits);
+    return true;
+  }
+  return false;
+}
+
+
+static bool jsonInt(JsonValue *v, s32 *out) {
+  if (v->type == json_number) {
+    if (!(v->number >= -2147483648.0 && v->number <= 2147483647.0)) return false;
+    if ((s32) v->number != v->number) return false;
+    *out = (s32) v->number;
+    return true;
+  }
+  u32 bits;
+  if (jsonHex(v, &bits)) {
+    *out = (s32) bits;
+    return true;
+  }
+  return false;
+}
+
+
+static char *readFloat(JsonValue *object, char *key, f32 *dst) {
+  JsonValue *v = json_get(object, key);
+  if (v != NULL && !jsonFloat(v, dst)) return key;
+  return NULL;
+}
+
+
+static char *readInt(JsonValue *object, char *key, s32 *dst) {
+  JsonValue *v = json_get(object, key);
+  if (v != NULL && !jsonInt(v, dst)) return key;
+  return NULL;
+}
+
+
+// Like readInt, but a value outside [min, max] is also invalid
+static char *readIntIn(JsonValue *object, char *key, s32 *dst, s32 min, s32 max) {
+  JsonValue *v = json_get(object, key);
+  if (v == NULL) return NULL;
+
+  s32 value;
+  if (!jsonInt(v, &value) || value < min || value > max) return key;
+  *dst = value;
+  return NULL;
+}
+
+
+static s32 countRolls(s8 *rolls) {
+  s32 n = 0;
+  while (rolls != NULL && rolls[n] != 127)
+    n += 1;
+  return n;
+}
+
+
+// Applies the request's overrides to the state from the input file. Returns
+// the name of the first invalid field, or NULL.
+static char *setupRequest(Server *server, JsonValue *json, Request *r) {
+  r->start = server->base;
+  r->start.numCogRngCalls = 0;
+  r->start.cogTrajectory = NULL;
+  r->start.trajectoryFrame = 0;
+  r->rolls = NULL;
+  r->maxFrames = server->maxFrames;
+
+  char *bad = readIntIn(json, "maxFrames", &r->maxFrames, 0, MAX_REQUEST_FRAMES);
+  if (bad != NULL) return bad;
+
+  JsonValue *m = json_get(json, "mario");
+  if (m != NULL) {
+    s32 yaw = r->start.mario.facingYaw;
+    if ((bad = readFloat(m, "x", &r->start.mario.pos.x)) != NULL) return bad;
+    if ((bad = readFloat(m, "z", &r->start.mario.pos.z)) != NULL) return bad;
+    if ((bad = readFloat(m, "hSpeed", &r->start.mario.hSpeed)) != NULL) return bad;
+    if ((bad = readInt(m, "yaw", &yaw)) != NULL) return bad;
+    r->start.mario.facingYaw = (s16) yaw;
+  }
+
+  JsonValue *c = json_get(json, "cog");
+  if (c != NULL) {
+    s32 yaw = r->start.cog.displayAngle.yaw;
+    if ((bad = readInt(c, "yaw", &yaw)) != NULL) return bad;
+    if ((bad = readFloat(c, "speed", &r->start.cog.yawVel)) != NULL) return bad;
+    if ((bad = readFloat(c, "speedTarget", &r->start.cog.yawVelTarget)) != NULL) return bad;
+    r->start.cog.displayAngle.yaw = yaw;
+  }
+
+  s32 seed = r->start.rngState;
+  if ((bad = readIntIn(json, "rngState", &seed, 0, 0xFFFF)) != NULL) return bad;
+  r->start.rngState = (u16) seed;
+
+  JsonValue *rng = json_get(json, "rng");
+  if (rng != NULL) {
+    if (rng->type != json_array) return "rng";
+
+    s32 n = 0;
+    for (JsonValue *e = rng->head; e != NULL; e = e->next)
+      n += 1;
+
+    r->rolls = (s8 *) malloc(n + 1);
+    n = 0;
+    for (JsonValue *e = rng->head; e != NULL; e = e->next) {
+      if (e->type != json_number || e->number < -6 || e->number > 6) return "rng";
+      if ((s8) e->number != e->number) return "rng";
+      r->rolls[n++] = (s8) e->number;
+    }
+    r->rolls[n] = 127;
+    r->start.cogRngOverride = r->rolls;
+  }
+
+  r->numRolls = countRolls(r->start.cogRngOverride);
+  return NULL;
+}
+
+
+static bool sameCogStart(CachedTrajectory *c, Request *r) {
+  Object *o = &r->start.cog;
+  return c->trajectory != NULL &&
+    c->cog.displayAngle.yaw == o->displayAngle.yaw &&
+    c->cog.yawVel == o->yawVel &&
+    c->cog.yawVelTarget == o->yawVelTarget &&
+    c->rngState == r->start.rngState &&
+    c->numRolls == r->numRolls &&
+    (r->numRolls == 0 || memcmp(c->rolls, r->start.cogRngOverride, r->numRolls) == 0);
+}
+
+
+// Looks up a cached trajectory covering at least numFrames frames for the
+// request's cog, building one if build is set
+static CogTrajectory *findTrajectory(Server *server, Request *r, s32 numFrames, bool build) {
+  if (numFrames > MAX_SHARED_TRAJECTORY)
+    numFrames = MAX_SHARED_TRAJECTORY;
+
+  CachedTrajectory *slot = &server->cache[0];
+  for (s32 i = 0; i < TRAJECTORY_CACHE_SIZE; i++) {
+    CachedTrajectory *c = &server->cache[i];
+    if (sameCogStart(c, r) && c->trajectory->numFrames >= numFrames) {
+      c->lastUsed = ++server->useCounter;
+      return c->trajectory;
+    }
+    if (c->lastUsed < slot->lastUsed)
+      slot = c;
+  }
+
+  if (!build) return NULL;
+
+  if (slot->trajectory != NULL) {
+    freeCogTrajectory(slot->trajectory);
+    free(slot->rolls);
+  }
+
+  // The trajectory keeps pointing into its own copy of the rolls
+  slot->cog = r->start.cog;
+  slot->rngState = r->start.rngState;
+  slot->numRolls = r->numRolls;
+  slot->rolls = (s8 *) malloc(r->numRolls + 1);
+  memcpy(slot->rolls, r->start.cogRngOverride, r->numRolls);
+  slot->rolls[r->numRolls] = 127;
+  slot->lastUsed = ++server->useCounter;
+
+  SimState start = r->start;
+  start.cogRngOverride = slot->rolls;
+  slot->trajectory = buildCogTrajectory(&start, numFrames, true);
+  return slot->trajectory;
+}
+
+
+static void writeResult(FILE *out, SimResult *r) {
+  fprintf(out, "\"result\":");
+  json_writeString(out, frameResultName(r->result));
+  fprintf(out, ",\"frames\":%d,\"cogRngCalls\":%d,\"hSpeed\":%.9g",
+    r->frames, r->numCogRngCalls, r->hSpeed);
+}
+
+
+static void handleSimulate(Server *server, Request *r, FILE *out) {
+  r->start.cogTrajectory = findTrajectory(server, r, r->maxFrames, false);
+
+  restoreState(&r->start);
+  SimResult result = runUntilFailure(r->maxFrames);
+  writeResult(out, &result);
+}
+
+
+static char *handleTrace(JsonValue *json, Request *r, FILE *out) {
+  s32 from = 0;
+  s32 to = r->maxFrames;
+  char *bad;
+  if ((bad = readIntIn(json, "from", &from, 0, MAX_REQUEST_FRAMES)) != NULL) return bad;
+  if ((bad = readIntIn(json, "to", &to, 0, MAX_REQUEST_FRAMES)) != NULL) return bad;
+
+  restoreState(&r->start);
+  FrameResult result = fr_success;
+
+  fprintf(out, "\"trace\":[");
+  bool first = true;
+  for (s32 frame = 0; frame < to; frame++) {
+    result = frameAdvance();
+    if (result != fr_success) break;
+    if (frame < from) continue;
+
+    fprintf(out, "%s{\"frame\":%d,\"rng\":", first ? "" : ",", frame + 1);
+    if (cogRngCall != 127)
+      fprintf(out, "%d", cogRngCall);
+    else
+      fprintf(out, "null");
+    fprintf(out, ",\"intendedYaw\":%d,\"hSpeed\":%.9g,\"x\":%.9g,\"z\":%.9g",
+      mario.intendedYaw, mario.hSpeed, mario.pos.x, mario.pos.z);
+    fprintf(out, ",\"cogYaw\":%d,\"cogSpeed\":%.9g,\"cogSpeedTarget\":%.9g}",
+      (s16) cog.displayAngle.yaw, cog.yawVel, cog.yawVelTarget);
+    first = false;
+  }
+  fprintf(out, "],\"result\":");
+  json_writeString(out, frameResultName(result));
+  return NULL;
+}
+
+
+static void runSweepPoint(s32 index, void *arg) {
+  Sweep *s = (Sweep *) arg;
+
+  f32 value;
+  if (s->ulps >= 0)
+    value = offsetUlps(s->base, index - s->ulps);
+  else if (s->count == 1)
+    value = (f32) s->from;
+  else
+    value = (f32) (s->from + (s->to - s->from) * index / (s->count - 1));
+  s->values[index] = value;
+
+  restoreState(&s->start);
+  switch (s->field) {
+  case 0: mario.pos.x = value; break;
+  case 1: mario.pos.z = value; break;
+  case 2: mario.hSpeed = value; break;
+  }
+
+  s->results[index] = runUntilFailure(s->maxFrames);
+}
+
+
+// Varies one of Mario's x, z or hSpeed either linearly over [from, to] or
+// by up to ulps ULPs around its current value
+static char *handleSweep(Server *server, JsonValue *json, Request *r, FILE *out) {
+  Sweep s;
+  s.start = r->start;
+  s.maxFrames = r->maxFrames;
+  s.from = 0.0;
+  s.to = 0.0;
+  s.ulps = -1;
+  s.count = 0;
+
+  JsonValue *field = json_get(json, "field");
+  if (field == NULL || field->type != json_string) return "field";
+  if (strcmp(field->string, "x") == 0) {
+    s.field = 0;
+    s.base = s.start.mario.pos.x;
+  }
+  else if (strcmp(field->string, "z") == 0) {
+    s.field = 1;
+    s.base = s.start.mario.pos.z;
+  }
+  else if (strcmp(field->string, "hSpeed") == 0) {
+    s.field = 2;
+    s.base = s.start.mario.hSpeed;
+  }
+  else {
+    return "field";
+  }
+
+  char *bad;
+  if ((bad = readIntIn(json, "ulps", &s.ulps, 0, (MAX_SWEEP_POINTS - 1) / 2)) != NULL)
+    return bad;
+  if (s.ulps >= 0) {
+    s.count = 2 * s.ulps + 1;
+  }
+  else {
+    f32 from = 0.0f;
+    f32 to = 0.0f;
+    if (json_get(json, "from") == NULL || (bad = readFloat(json, "from", &from)) != NULL)
+      return "from";
+    if ((bad = readFloat(json, "to", &to)) != NULL) return bad;
+    if ((bad = readIntIn(json, "count", &s.count, 1, MAX_SWEEP_POINTS)) != NULL) return bad;
+    if (json_get(json, "to") == NULL) to = from;
+    s.from = from;
+    s.to = to;
+  }
+  if (s.count < 1) return "count";
+
+  s.start.cogTrajectory = findTrajectory(server, r, r->maxFrames, true);
+  s.values = (f32 *) malloc(s.count * sizeof(f32));
+  s.results = (SimResult *) malloc(s.count * sizeof(SimResult));
+
+  parallelFor(s.count, runSweepPoint, &s);
+
+  fprintf(out, "\"values\":[");
+  for (s32 i = 0; i < s.count; i++)
+    fprintf(out, "%s\"0x%08X\"", i > 0 ? "," : "", floatBits(s.values[i]));
+  fprintf(out, "],\"frames\":[");
+  for (s32 i = 0; i < s.count; i++)
+    fprintf(out, "%s%d", i > 0 ? "," : "", s.results[i].frames);
+  fprintf(out, "],\"hSpeed\":[");
+  for (s32 i = 0; i < s.count; i++)
+    fprintf(out, "%s%.9g", i > 0 ? "," : "", s.results[i].hSpeed);
+  fprintf(out, "],\"results\":[");
+  for (s32 i = 0; i < s.count; i++)
+    fprintf(out, "%s%d", i > 0 ? "," : "", (s32) s.results[i].result);
+  fprintf(out, "]");
+
+  free(s.values);
+  free(s.results);
+  return NULL;
+}
+
+
+typedef struct {
+  SimState start;
+  s32 maxFrames;
+  SimResult *results;
+} SeedSweep;
+
+
+static void runSweepSeed(s32 seed, void *arg) {
+  SeedSweep *s = (SeedSweep *) arg;
+  restoreState(&s->start);
+  rngState = (u16) seed;
+  s->results[seed] = runUntilFailure(s->maxFrames);
+}
+
+
+typedef struct {
+  s32 frames;
+  f32 hSpeed;
+  s32 seed;
+} RankedSeed;
+
+
+// Longest survivors first, then the fastest, then the lowest state
+static int compareRankedSeeds(const void *p1, const void *p2) {
+  const RankedSeed *a = (const RankedSeed *) p1;
+  const RankedSeed *b = (const RankedSeed *) p2;
+
+  if (a->frames != b->frames)
+    return a->frames > b->frames ? -1 : 1;
+  if (a->hSpeed != b->hSpeed)
+    return a->hSpeed > b->hSpeed ? -1 : 1;
+  return a->seed - b->seed;
+}
+
+
+static char *handleSeedSweep(JsonValue *json, Request *r, FILE *out) {
+  s32 top = 10;
+  char *bad = readInt(json, "top", &top);
+  if (bad != NULL) return bad;
+  if (top < 0) top = 0;
+  if (top > 0x10000) top = 0x10000;
+
+  SeedSweep s;
+  s.start = r->start;
+  s.start.cogRngOverride = NULL;
+  s.maxFrames = r->maxFrames;
+  s.results = (SimResult *) malloc(0x10000 * sizeof(SimResult));
+
+  parallelFor(0x10000, runSweepSeed, &s);
+
+  s32 counts[NUM_FRAME_RESULTS] = { 0 };
+  for (s32 i = 0; i < 0x10000; i++)
+    counts[s.results[i].result] += 1;
+
+  fprintf(out, "\"counts\":[");
+  for (s32 i = 0; i < NUM_FRAME_RESULTS; i++)
+    fprintf(out, "%s%d", i > 0 ? "," : "", counts[i]);
+  fprintf(out, "],\"best\":[");
+
+  RankedSeed *ranked = (RankedSeed *) malloc(0x10000 * sizeof(RankedSeed));
+  for (s32 i = 0; i < 0x10000; i++) {
+    ranked[i].frames = s.results[i].frames;
+    ranked[i].hSpeed = s.results[i].hSpeed;
+    ranked[i].seed = i;
+  }
+  qsort(ranked, 0x10000, sizeof(RankedSeed), compareRankedSeeds);
+
+  for (s32 k = 0; k < top; k++) {
+    s32 seed = ranked[k].seed;
+    fprintf(out, "%s{\"rngState\":%d,", k > 0 ? "," : "", seed);
+    writeResult(out, &s.results[seed]);
+    fprintf(out, "}");
+  }
+  fprintf(out, "]");
+
+  free(ranked);
+  free(s.results);
+  return NULL;
+}
+
+
+static void handleLine(Server *server, char *line, FILE *out) {
+  char *parseError;
+  JsonValue *json = json_parse(line, &parseError);
+
+  fprintf(out, "{");
+  JsonValue *id = json_get(json, "id");
+  if (id != NULL && id->type == json_number)
+    fprintf(out, "\"id\":%.17g,", id->number);
+  else if (id != NULL && id->type == json_string) {
+    fprintf(out, "\"id\":");
+    json_writeString(out, id->string);
+    fprintf(out, ",");
+  }
+
+  char *error = NULL;
+  JsonValue *cmd = json_get(json, "cmd");
+  Request r;
+  r.rolls = NULL;
+
+  if (json == NULL) {
+    error = parseError;
+  }
+  else if (cmd == NULL || cmd->type != json_string) {
+    error = "Expected a cmd";
+  }
+  else if ((error = setupRequest(server, json, &r)) != NULL) {
+    fprintf(out, "\"error\":\"Invalid field\",\"field\":");
+    json_writeString(out, error);
+    error = NULL;
+  }
+  else {
+    char *bad = NULL;
+    if (strcmp(cmd->string, "simulate") == 0)
+      handleSimulate(server, &r, out);
+    else if (strcmp(cmd->string, "trace") == 0)
+      bad = handleTrace(json, &r, out);
+    else if (strcmp(cmd->string, "sweep") == 0)
+      bad = handleSweep(server, json, &r, out);
+    else if (strcmp(cmd->string, "seedSweep") == 0)
+      bad = handleSeedSweep(json, &r, out);
+    else
+      error = "Unknown cmd";
+
+    if (bad != NULL) {
+      fprintf(out, "\"error\":\"Invalid field\",\"field\":");
+      json_writeString(out, bad);
+    }
+  }
+
+  if (error != NULL) {
+    fprintf(out, "\"error\":");
+    json_writeString(out, error);
+  }
+  fprintf(out, "}\n");
+  fflush(out);
+
+  free(r.rolls);
+  json_free(json);
+}
+
+
+// Reads a line of any length, without the newline. Returns false at the end
+// of the input, or if reading fails partway through a line.
+static bool readLine(FILE *in, char **buffer, size_t *cap) {
+  size_t len = 0;
+  while (true) {
+    if (len + 2 > *cap) {
+      *cap = *cap > 0 ? 2 * *cap : 4096;
+      *buffer = (char *) realloc(*buffer, *cap);
+    }
+    if (fgets(*buffer + len, (int) (*cap - len), in) == NULL)
+      return len > 0 && !ferror(in);
+
+    len += strlen(*buffer + len);
+    if (len > 0 && (*buffer)[len - 1] == '\n') {
+      (*buffer)[len - 1] = '\0';
+      return true;
+    }
+  }
+}
+
+
+static void serveStream(Server *server, FILE *in, FILE *out) {
+  char *line = NULL;
+  size_t cap = 0;
+
+  while (readLine(in, &line, &cap)) {
+    char *s = line;
+    while (*s == ' ' || *s == '\t' || *s == '\r')
+      s += 1;
+    if (*s != '\0')
+      handleLine(server, s, out);
+
+    // The client has gone away
+    if (ferror(out)) break;
+  }
+
+  free(line);
+}
+
+
+#if !defined(WIN32)
+
+static void serveSocket(Server *server, char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path is too long: %s\n", path);
+    return;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+    fprintf(stderr, "Failed to listen on '%s'\n", path);
+    return;
+  }
+
+  printf("Listening on \x1b[1m%s\x1b[0m\n", path);
+  fflush(stdout);
+
+  // Writing to a client that has disconnected fails instead of killing the
+  // server
+  signal(SIGPIPE, SIG_IGN);
+
+  struct timeval timeout;
+  timeout.tv_sec = CLIENT_TIMEOUT_SECONDS;
+  timeout.tv_usec = 0;
+
+  // Clients are served one at a time; each request is parallelized instead
+  while (true) {
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) continue;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    FILE *in = fdopen(client, "rb");
+    FILE *out = fdopen(dup(client), "wb");
+    if (in != NULL && out != NULL)
+      serveStream(server, in, out);
+
+    if (in != NULL) fclose(in);
+    if (out != NULL) fclose(out);
+  }
+}
+
+#endif
+
+
+// Answers newline-delimited JSON requests from stdin, or from clients of a
+// Unix domain socket if socketPath is given, until the input ends. Requests
+// start from the input file's state, and cog trajectories and the RNG tables
+// stay loaded between them.
+void runServer(char *socketPath, s32 maxFrames) {
+  Server *server = (Server *) calloc(1, sizeof(Server));
+  saveState(&server->base);
+  server->maxFrames = maxFrames;
+  initRngTables();
+
+  if (socketPath == NULL) {
+    serveStream(server, stdin, stdout);
+  }
+  else {
+#if defined(WIN32)
+    fprintf(stderr, "Socket mode isn't supported on Windows\n");
+#else
+    serveSocket(server, socketPath);
+#endif
+  }
+
+  for (s32 i = 0; i < TRAJECTORY_CACHE_SIZE; i++) {
+    if (server->cache[i].trajectory != NULL) {
+      freeCogTrajectory(server->cache[i].trajectory);
+      free(server->cache[i].rolls);
+    }
+  }
+  free(server);
+}
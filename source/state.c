@@ -1,46 +1,194 @@
 #include "state.h"
 
 #include "cog.h"
+#include "landing.h"
+#include "level.h"
 #include "mario.h"
+#include "objects.h"
 #include "surface.h"
+#include "trajectory.h"
 #include "util.h"
 
 #include <math.h>
 #include <stdio.h>
 
 
-Object cog;
-MarioState mario;
+THREAD_LOCAL Object cog;
+THREAD_LOCAL MarioState mario;
 int overrideRngLength;
+THREAD_LOCAL CogTrajectory *cogTrajectory;
+THREAD_LOCAL s32 trajectoryFrame;
+THREAD_LOCAL s32 currentFrame;
 
 
-static bool checkInput(MarioState *m, f32 mag, f32 yaw) {
+// Sets the parts of the calling thread's state that never change between
+// runs, and builds the shared tables they need if no thread has yet
+void initState(void) {
+  cog.pos = (v3f) { 1490, -2088, -873 };
+  cog.surfaceModel = &cogModel[0];
+  mario.pos.y = cog.pos.y;
+  initSpotWalls();
+}
+
+
+// Whether the quarter steps of this frame's inputs can reach a wall. They
+// usually can't, and then the walls aren't checked for each input.
+static THREAD_LOCAL bool stepsNearWall;
+
+
+// Sets m's input and velocity for the input
+static void setInput(MarioState *m, f32 mag, f32 yaw) {
   f32 startHSpeed = m->hSpeed;
 
   m->intendedMag = mag;
   m->intendedYaw = yaw;
   updateAirWithoutTurn(m);
 
-  bool works = quarterStepLands(m);
-
   m->hSpeed = startHSpeed;
-  return works;
+}
+
+
+// Sets m's input and velocity for the input, and returns the quarter step
+static v3f inputQuarterStep(MarioState *m, f32 mag, f32 yaw) {
+  setInput(m, mag, yaw);
+  return stepsNearWall ? quarterStep(m) : intendedQuarterStep(m);
+}
+
+
+static bool checkInput(MarioState *m, LandingMap *map, f32 mag, f32 yaw) {
+  setInput(m, mag, yaw);
+  return mapQuarterStepLands(map, m);
+}
+
+
+// Yaw of the ith input in a block starting at dyaw, alternating between +dyaw
+// and -dyaw like computeOptimalInput
+static s32 blockInputYaw(MarioState *m, u32 dyaw, s32 i) {
+  u16 d = (u16) (dyaw + 0x10 * (i / 2));
+  return i % 2 == 0 ? m->facingYaw + d : m->facingYaw - d;
+}
+
+
+// Without a landing map, the quarter steps of a block of inputs are tested
+// against the floors together. Blocks start small so that frames where an early
+// input lands don't pay for a whole block.
+//
+// With a level loaded, the first input whose step is also cancelled by the
+// ceiling is chosen, or the first input that lands if there is none, so that
+// frameAdvance can report that it's not under the ceiling.
+static bool scanInputsBatched(MarioState *m) {
+  v3f qsteps[64];
+  f32 heights[64];
+  Surface *floors[64];
+  s32 blockSize = 4;
+
+  bool landed = false;
+  s32 firstLandingYaw = 0;
+
+  for (u32 dyaw = 0; dyaw <= 0x8000; ) {
+    s32 n = 0;
+    for (s32 i = 0; i < blockSize && dyaw + 0x10 * i <= 0x8000; i++) {
+      qsteps[n] = inputQuarterStep(m, 32.0f, blockInputYaw(m, dyaw, n));
+      n += 1;
+      qsteps[n] = inputQuarterStep(m, 32.0f, blockInputYaw(m, dyaw, n));
+      n += 1;
+    }
+
+    findFloorBatch(qsteps, n, heights, floors);
+
+    if (level == NULL) {
+      for (s32 i = 0; i < n; i++) {
+        if (floorLands(floors[i], heights[i], qsteps[i].y)) {
+          // Leave m as checkInput would have
+          inputQuarterStep(m, 32.0f, blockInputYaw(m, dyaw, i));
+          return true;
+        }
+      }
+    }
+    else {
+      s32 candidates[64];
+      v3f ceilPoints[64];
+      f32 ceilHeights[64];
+      Surface *ceils[64];
+
+      s32 numCandidates = 0;
+      for (s32 i = 0; i < n; i++) {
+        if (floorLands(floors[i], heights[i], qsteps[i].y)) {
+          candidates[numCandidates] = i;
+          ceilPoints[numCandidates] = (v3f) { qsteps[i].x, heights[i] + 80.0f, qsteps[i].z };
+          numCandidates += 1;
+        }
+      }
+
+      findCeilBatch(ceilPoints, numCandidates, ceilHeights, ceils);
+
+      for (s32 j = 0; j < numCandidates; j++) {
+        if (ceilCancelsStep(ceilHeights[j], heights[candidates[j]])) {
+          inputQuarterStep(m, 32.0f, blockInputYaw(m, dyaw, candidates[j]));
+          return true;
+        }
+      }
+
+      if (numCandidates > 0 && !landed) {
+        landed = true;
+        firstLandingYaw = blockInputYaw(m, dyaw, candidates[0]);
+      }
+    }
+
+    dyaw += 0x10 * (n / 2);
+    if (blockSize < 32) blockSize *= 2;
+  }
+
+  if (landed) {
+    inputQuarterStep(m, 32.0f, firstLandingYaw);
+    return true;
+  }
+
+  inputQuarterStep(m, 32.0f, m->facingYaw - 0x8000);
+  return false;
 }
 
 
 static bool computeOptimalInput(MarioState *m) {
+  // Landing maps don't account for walls, so frames where one is in reach go
+  // through the batched scan
+  stepsNearWall = inputStepsNearWall(m);
+
+  LandingMap *map = NULL;
+  if (!stepsNearWall)
+    map = acquireLandingMap((s16) (m->pos.y + m->vel.y / 4.0f));
+  if (map == NULL)
+    return scanInputsBatched(m);
+
+  bool found = false;
+
   for (u16 dyaw = 0; dyaw <= 0x8000; dyaw += 0x10) {
-    if (checkInput(m, 32.0f, m->facingYaw + dyaw)) return true;
-    if (checkInput(m, 32.0f, m->facingYaw - dyaw)) return true;
+    if (checkInput(m, map, 32.0f, m->facingYaw + dyaw) ||
+      checkInput(m, map, 32.0f, m->facingYaw - dyaw))
+    {
+      found = true;
+      break;
+    }
   }
-  return false;
+
+  releaseLandingMap(map);
+  return found;
 }
 
 
 FrameResult frameAdvance(void) {
-  clearSurfaces();
-  updateTtcCog(&cog);
-  loadObjectCollisionModel(&cog);
+  if (cogTrajectory != NULL) {
+    followCogTrajectory(cogTrajectory, trajectoryFrame++);
+  }
+  else {
+    clearSurfaces();
+    updateTtcCog(&cog);
+    loadObjectCollisionModel(&cog);
+  }
+
+  currentFrame += 1;
+  if (numOtherObjects > 0)
+    loadOtherObjects(currentFrame);
 
   if (onFloor(&mario))
     return fr_landed_on_cog;
@@ -57,18 +205,118 @@ FrameResult frameAdvance(void) {
     return fr_failed_to_land;
   }
 
-  v3f qstep = {
-    mario.pos.x + mario.vel.x / 4.0f,
-    mario.pos.y + mario.vel.y / 4.0f,
-    mario.pos.z + mario.vel.z / 4.0f,
-  };
-  f32 dx = qstep.x - 1215;
-  f32 dz = qstep.z - -1215;
-  if (sqrtf(dx*dx + dz*dz) > 264)
-    return fr_not_under_ceil;
+  // Without the level's ceilings, the area where the step is known to be
+  // cancelled is approximated by a circle
+  if (level != NULL) {
+    if (!quarterStepUnderCeil(&mario))
+      return fr_not_under_ceil;
+  }
+  else {
+    v3f qstep = quarterStep(&mario);
+    f32 dx = qstep.x - 1215;
+    f32 dz = qstep.z - -1215;
+    if (sqrtf(dx*dx + dz*dz) > 264)
+      return fr_not_under_ceil;
+  }
 
   if (mario.hSpeed <= startHSpeed)
     return fr_slowed_down;
 
   return fr_success;
 }
+
+
+char *frameResultName(FrameResult result) {
+  switch (result) {
+  case fr_success:        return "Survived until frame limit";
+  case fr_landed_on_cog:  return "Cog slid under Mario";
+  case fr_failed_to_land: return "No input lands";
+  case fr_slowed_down:    return "Impossible to land without losing speed";
+  case fr_not_under_ceil: return "Not under ceiling";
+  }
+  return "?";
+}
+
+
+void saveState(SimState *s) {
+  s->mario = mario;
+  s->cog = cog;
+  s->rngState = rngState;
+  s->cogRngOverride = cogRngOverride;
+  s->numCogRngCalls = numCogRngCalls;
+  s->cogTrajectory = cogTrajectory;
+  s->trajectoryFrame = trajectoryFrame;
+  s->frame = currentFrame;
+}
+
+
+void restoreState(SimState *s) {
+  mario = s->mario;
+  cog = s->cog;
+  rngState = s->rngState;
+  cogRngOverride = s->cogRngOverride;
+  numCogRngCalls = s->numCogRngCalls;
+  cogTrajectory = s->cogTrajectory;
+  trajectoryFrame = s->trajectoryFrame;
+  currentFrame = s->frame;
+}
+
+
+// The state must be simulating the cog rather than following a trajectory,
+// since the RNG state and remaining rolls aren't kept up to date while
+// following one
+void packState(SimState *s, PackedState *p) {
+  p->marioX = s->mario.pos.x;
+  p->marioZ = s->mario.pos.z;
+  p->hSpeed = s->mario.hSpeed;
+  p->cogYawVel = s->cog.yawVel;
+  p->cogYawVelTarget = s->cog.yawVelTarget;
+  p->facingYaw = s->mario.facingYaw;
+  p->cogYaw = (s16) s->cog.displayAngle.yaw;
+  p->rngState = s->rngState;
+  p->numCogRngCalls = (u16) s->numCogRngCalls;
+}
+
+
+// Rebuilds a state packed from a run that began at start. Mario's inputs and
+// velocity and the cog's transform are recomputed every frame, so they don't
+// need to be stored. The frame is left as start's, since searches keep track
+// of it themselves.
+void unpackState(PackedState *p, SimState *start, SimState *s) {
+  *s = *start;
+
+  s->mario.pos.x = p->marioX;
+  s->mario.pos.z = p->marioZ;
+  s->mario.hSpeed = p->hSpeed;
+  s->mario.facingYaw = p->facingYaw;
+  s->cog.yawVel = p->cogYawVel;
+  s->cog.yawVelTarget = p->cogYawVelTarget;
+  s->cog.displayAngle.yaw = p->cogYaw;
+  s->rngState = p->rngState;
+  s->cogTrajectory = NULL;
+  s->trajectoryFrame = 0;
+
+  // Overridden rolls are used up first, one per roll
+  s->numCogRngCalls = p->numCogRngCalls;
+  for (s32 i = start->numCogRngCalls; i < p->numCogRngCalls; i++) {
+    if (s->cogRngOverride == NULL || *s->cogRngOverride == 127) break;
+    s->cogRngOverride++;
+  }
+}
+
+
+SimResult runUntilFailure(s32 maxFrames) {
+  SimResult r;
+  r.result = fr_success;
+  r.frames = 0;
+
+  while (r.frames < maxFrames) {
+    r.result = frameAdvance();
+    if (r.result != fr_success) break;
+    r.frames += 1;
+  }
+
+  r.numCogRngCalls = numCogRngCalls;
+  r.hSpeed = mario.hSpeed;
+  return r;
+}
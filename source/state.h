@@ -8,9 +8,15 @@
 #include <stdio.h>
 
 
-extern Object cog;
-extern MarioState mario;
+typedef struct CogTrajectory CogTrajectory;
+
+
+extern THREAD_LOCAL Object cog;
+extern THREAD_LOCAL MarioState mario;
 extern int overrideRngLength;
+extern THREAD_LOCAL CogTrajectory *cogTrajectory;
+extern THREAD_LOCAL s32 trajectoryFrame;
+extern THREAD_LOCAL s32 currentFrame;
 
 
 typedef enum {
@@ -21,8 +27,66 @@ typedef enum {
   fr_not_under_ceil,
 } FrameResult;
 
+#define NUM_FRAME_RESULTS 5
+
+
+typedef struct SimState SimState;
+typedef struct SimResult SimResult;
+typedef struct PackedState PackedState;
+
+
+// Everything frameAdvance reads or writes, so that a run can be restarted or
+// handed to another thread
+struct SimState {
+  MarioState mario;
+  Object cog;
+  u16 rngState;
+  s8 *cogRngOverride;
+  s32 numCogRngCalls;
+
+  // If non-NULL, the cog follows this precomputed trajectory instead of being
+  // simulated
+  CogTrajectory *cogTrajectory;
+  s32 trajectoryFrame;
 
+  // Frames since the input state, which the other objects' yaws depend on
+  s32 frame;
+};
+
+
+// The parts of a SimState that change from frame to frame, for searches that
+// store many states. The rest comes from the run's start state when unpacking.
+// The cog's roll count must fit in 16 bits.
+struct PackedState {
+  f32 marioX;
+  f32 marioZ;
+  f32 hSpeed;
+  f32 cogYawVel;
+  f32 cogYawVelTarget;
+  s16 facingYaw;
+  s16 cogYaw;
+  u16 rngState;
+  u16 numCogRngCalls;
+};
+
+
+struct SimResult {
+  FrameResult result;
+  s32 frames;
+  s32 numCogRngCalls;
+  f32 hSpeed;
+};
+
+
+void initState(void);
 FrameResult frameAdvance(void);
+char *frameResultName(FrameResult result);
+
+void saveState(SimState *s);
+void restoreState(SimState *s);
+void packState(SimState *s, PackedState *p);
+void unpackState(PackedState *p, SimState *start, SimState *s);
+SimResult runUntilFailure(s32 maxFrames);
 
 
 #endif
\ No newline at end of file
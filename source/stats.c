@@ -0,0 +1,114 @@
+#include "stats.h"
+
+#include "state.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdio.h>
+
+
+static s32 frameBucket(s32 frames) {
+  s32 b = 0;
+  while (frames > 0 && b < FRAME_BUCKETS - 1) {
+    frames >>= 1;
+    b += 1;
+  }
+  return b;
+}
+
+
+void recordRun(SurvivalStats *s, SimResult *r) {
+  s32 h = (s32) floorf(r->hSpeed);
+  if (h < 0) h = 0;
+  if (h >= HSPEED_BUCKETS) h = HSPEED_BUCKETS - 1;
+
+  s->numRuns += 1;
+  s->results[r->result] += 1;
+  s->frames[frameBucket(r->frames)] += 1;
+  s->hSpeeds[h] += 1;
+
+  s->sumFrames += r->frames;
+  s->sumFramesSq += (f64) r->frames * r->frames;
+  s->sumHSpeed += r->hSpeed;
+  s->sumHSpeedSq += (f64) r->hSpeed * r->hSpeed;
+}
+
+
+// Normal approximation, 95%
+static void printMean(char *name, f64 sum, f64 sumSq, u64 n) {
+  f64 mean = sum / n;
+  f64 var = n > 1 ? (sumSq - sum * mean) / (n - 1) : 0;
+  if (var < 0) var = 0;
+  f64 margin = 1.96 * sqrt(var / n);
+
+  printf("%s: \x1b[1m%f\x1b[0m +/- %f (sd %f)\n", name, mean, margin, sqrt(var));
+}
+
+
+// Wilson score interval, 95%
+static void printProportion(char *name, u64 k, u64 n) {
+  f64 z = 1.96;
+  f64 p = (f64) k / n;
+  f64 denom = 1 + z*z/n;
+  f64 center = (p + z*z/(2*n)) / denom;
+  f64 margin = z * sqrt(p*(1 - p)/n + z*z/(4.0*n*n)) / denom;
+
+  printf("  %-40s %10llu  %6.2f%%  [%6.2f%%, %6.2f%%]\n", name,
+    (unsigned long long) k, 100*p, 100*(center - margin), 100*(center + margin));
+}
+
+
+static void printBar(u64 count, u64 max) {
+  s32 width = max > 0 ? (s32) (40 * count / max) : 0;
+  for (s32 i = 0; i < width; i++)
+    putchar('#');
+  putchar('\n');
+}
+
+
+void printSurvivalStats(SurvivalStats *s) {
+  u64 n = s->numRuns;
+  if (n == 0) {
+    printf("No runs\n");
+    return;
+  }
+
+  printf("Runs: \x1b[1m%llu\x1b[0m\n", (unsigned long long) n);
+  printMean("Frames survived", s->sumFrames, s->sumFramesSq, n);
+  printMean("Final H speed", s->sumHSpeed, s->sumHSpeedSq, n);
+
+  printf("\nEnd reason:\n");
+  for (s32 i = 0; i < NUM_FRAME_RESULTS; i++)
+    printProportion(frameResultName((FrameResult) i), s->results[i], n);
+
+  u64 max = 0;
+  s32 last = 0;
+  for (s32 i = 0; i < FRAME_BUCKETS; i++) {
+    if (s->frames[i] > max) max = s->frames[i];
+    if (s->frames[i] != 0) last = i;
+  }
+
+  printf("\nFrames survived:\n");
+  for (s32 i = 0; i <= last; i++) {
+    s32 lo = i == 0 ? 0 : 1 << (i - 1);
+    s32 hi = i == 0 ? 0 : (1 << i) - 1;
+    printf("  %7d-%-7d %10llu  ", lo, hi, (unsigned long long) s->frames[i]);
+    printBar(s->frames[i], max);
+  }
+
+  max = 0;
+  s32 first = -1;
+  for (s32 i = 0; i < HSPEED_BUCKETS; i++) {
+    if (s->hSpeeds[i] > max) max = s->hSpeeds[i];
+    if (s->hSpeeds[i] != 0) {
+      if (first < 0) first = i;
+      last = i;
+    }
+  }
+
+  printf("\nFinal H speed:\n");
+  for (s32 i = first; i <= last; i++) {
+    printf("  %3d-%-3d %10llu  ", i, i + 1, (unsigned long long) s->hSpeeds[i]);
+    printBar(s->hSpeeds[i], max);
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef STATS_H
+#define STATS_H
+
+
+#include "state.h"
+#include "util.h"
+
+
+#define FRAME_BUCKETS 32
+#define HSPEED_BUCKETS 256
+
+
+typedef struct SurvivalStats SurvivalStats;
+
+
+// Distribution of run outcomes. Runs are recorded in a fixed order after
+// they're simulated, so the floating point sums don't depend on the number
+// of threads.
+struct SurvivalStats {
+  u64 numRuns;
+  u64 results[NUM_FRAME_RESULTS];
+
+  // Bucket i holds runs lasting [2^(i-1), 2^i) frames, bucket 0 holds 0
+  u64 frames[FRAME_BUCKETS];
+
+  // Final H speed rounded down to an integer, clamped to the range
+  u64 hSpeeds[HSPEED_BUCKETS];
+
+  f64 sumFrames;
+  f64 sumFramesSq;
+  f64 sumHSpeed;
+  f64 sumHSpeedSq;
+};
+
+
+void recordRun(SurvivalStats *s, SimResult *r);
+void printSurvivalStats(SurvivalStats *s);
+
+
+#endif
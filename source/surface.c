@@ -1,37 +1,86 @@
 #include "surface.h"
 
+#include "level.h"
 #include "util.h"
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 
-SurfaceNode allFloors;
+THREAD_LOCAL SurfaceNode allFloors;
 
 
-static Surface surfacePool[100];
-static s32 surfacesAllocated;
+// Each object's surfaces are kept between frames in its own cache, with its
+// own list sorted like allFloors. clearSurfaces leaves the caches intact, so
+// if an object is loaded again with the same transform its surfaces are
+// reused, or updated in place if the list order stays the same.
+typedef struct {
+  Object *object;
+  s16 *model;
+  v3f pos;
+  v3h angle;
 
-static SurfaceNode surfaceNodePool[100];
-static s32 surfaceNodesAllocated;
+  // Bumped whenever the list is rebuilt
+  u32 version;
+
+  Surface *surfaces;
+  s32 numSurfaces;
+  SurfaceNode *nodes;
+  s32 numNodes;
+  s32 maxSurfaces;
+  SurfaceNode list;
+
+  // Index of each triangle's surface, or -1 if it's degenerate
+  s32 *surfaceOf;
+  s32 numTris;
+  s32 maxTris;
+
+  s16 *vertexData;
+  s32 maxVertices;
+} ModelCache;
+
+static THREAD_LOCAL ModelCache **modelCaches;
+static THREAD_LOCAL s32 numModelCaches;
+
+// Holds the surfaces passed to loadSurfaces
+static THREAD_LOCAL ModelCache copiedSurfaces;
+
+
+// allFloors is the merge of the lists of the models loaded since the last
+// clear, in load order. The merged list after each load is kept so that it
+// can be reused on the next frame if the same models are loaded in the same
+// order and none of their lists were rebuilt.
+typedef struct {
+  ModelCache *cache;
+  u32 version;
+  SurfaceNode *list;
+  s32 count;
+  SurfaceNode *nodes;
+  s32 maxNodes;
+} MergeStep;
+
+static THREAD_LOCAL MergeStep *mergeSteps;
+static THREAD_LOCAL s32 numMergeSteps;
+static THREAD_LOCAL s32 validMergeSteps;
+static THREAD_LOCAL s32 maxMergeSteps;
 
 
 void clearSurfaces(void) {
   allFloors.tail = NULL;
-  surfacesAllocated = 0;
-  surfaceNodesAllocated = 0;
+  numMergeSteps = 0;
 }
 
 
-static SurfaceNode *allocSurfaceNode(void) {
-  SurfaceNode *node = &surfaceNodePool[surfaceNodesAllocated++];
+static SurfaceNode *allocSurfaceNode(ModelCache *c) {
+  SurfaceNode *node = &c->nodes[c->numNodes++];
   node->tail = NULL;
   return node;
 }
 
 
-static Surface *allocSurface(void) {
-  Surface *tri = &surfacePool[surfacesAllocated++];
+static Surface *allocSurface(ModelCache *c) {
+  Surface *tri = &c->surfaces[c->numSurfaces++];
   tri->type = 0;
   tri->v02 = 0;
   tri->v04 = 0;
@@ -41,13 +90,13 @@ static Surface *allocSurface(void) {
 }
 
 
-static void addSurface(Surface *tri) {
-  SurfaceNode *newNode = allocSurfaceNode();
+static void addSurface(ModelCache *c, Surface *tri) {
+  SurfaceNode *newNode = allocSurfaceNode(c);
 
   s16 triPriority = tri->vertex1.y;
   newNode->head = tri;
   
-  SurfaceNode *list = &allFloors;
+  SurfaceNode *list = &c->list;
 
   while (list->tail != NULL) {
     s16 priority = list->tail->head->vertex1.y;
@@ -60,22 +109,20 @@ static void addSurface(Surface *tri) {
 }
 
 
-static Surface *readSurfaceData(s16 *vertexData, s16 **data) {
-  s16 offset1 = 3 * *(*data + 0);
-  s16 offset2 = 3 * *(*data + 1);
-  s16 offset3 = 3 * *(*data + 2);
-
-  s32 x1 = *(vertexData + offset1 + 0);
-  s32 y1 = *(vertexData + offset1 + 1);
-  s32 z1 = *(vertexData + offset1 + 2);
+// Fills in a triangle's normal, origin offset, y range and flags like the
+// game's read_surface_data. Returns false if the triangle is degenerate.
+bool initSurface(Surface *tri, v3h *v1, v3h *v2, v3h *v3) {
+  s32 x1 = v1->x;
+  s32 y1 = v1->y;
+  s32 z1 = v1->z;
   
-  s32 x2 = *(vertexData + offset2 + 0);
-  s32 y2 = *(vertexData + offset2 + 1);
-  s32 z2 = *(vertexData + offset2 + 2);
+  s32 x2 = v2->x;
+  s32 y2 = v2->y;
+  s32 z2 = v2->z;
   
-  s32 x3 = *(vertexData + offset3 + 0);
-  s32 y3 = *(vertexData + offset3 + 1);
-  s32 z3 = *(vertexData + offset3 + 2);
+  s32 x3 = v3->x;
+  s32 y3 = v3->y;
+  s32 z3 = v3->z;
   
   f32 nx = (y2 - y1) * (z3 - z2) - (z2 - z1) * (y3 - y2);
   f32 ny = (z2 - z1) * (x3 - x2) - (x2 - x1) * (z3 - z2);
@@ -90,14 +137,12 @@ static Surface *readSurfaceData(s16 *vertexData, s16 **data) {
   if (y2 > maxY) maxY = y2;
   if (y3 > maxY) maxY = y3;
 
-  if (mag < 0.0001) return NULL;
+  if (mag < 0.0001) return false;
   mag = (f32) (1.0 / mag);
   nx *= mag;
   ny *= mag;
   nz *= mag;
 
-  Surface *tri = allocSurface();
-  
   tri->vertex1.x = x1;
   tri->vertex1.y = y1;
   tri->vertex1.z = z1;
@@ -118,8 +163,26 @@ static Surface *readSurfaceData(s16 *vertexData, s16 **data) {
 
   tri->lowerY = minY - 5;
   tri->upperY = maxY + 5;
+
+  tri->v04 = 0;
+  if (nx < -0.707 || nx > 0.707)
+    tri->v04 |= SURFACE_FLAG_X_PROJECTION;
   
-  return tri;
+  return true;
+}
+
+
+// Returns false if the triangle is degenerate
+static bool readSurfaceData(s16 *vertexData, s16 **data, Surface *tri) {
+  s16 offset1 = 3 * *(*data + 0);
+  s16 offset2 = 3 * *(*data + 1);
+  s16 offset3 = 3 * *(*data + 2);
+
+  v3h v1 = { vertexData[offset1 + 0], vertexData[offset1 + 1], vertexData[offset1 + 2] };
+  v3h v2 = { vertexData[offset2 + 0], vertexData[offset2 + 1], vertexData[offset2 + 2] };
+  v3h v3 = { vertexData[offset3 + 0], vertexData[offset3 + 1], vertexData[offset3 + 2] };
+
+  return initSurface(tri, &v1, &v2, &v3);
 }
 
 
@@ -158,17 +221,29 @@ static void readObjectCollisionVertices(Object *o, s16 **data, s16 *vertexData)
 }
 
 
-static void loadObjColModelFromVertexData(Object *o, s16 **data, s16 *vertexData) {
+static void loadObjColModelFromVertexData(ModelCache *c, Object *o, s16 **data) {
   s16 surfaceType = *(*data)++;
   s32 numTris = *(*data)++;
   
   for (s32 i = 0; i < numTris; i++) {
-    Surface *tri = readSurfaceData(vertexData, data);
-
-    if (tri != NULL) {
-      tri->object = o;
-      tri->type = surfaceType;
-      addSurface(tri);
+    Surface tri;
+    bool valid = readSurfaceData(c->vertexData, data, &tri);
+
+    c->surfaceOf[c->numTris++] = valid ? c->numSurfaces : -1;
+
+    if (valid) {
+      Surface *dst = allocSurface(c);
+      dst->vertex1 = tri.vertex1;
+      dst->vertex2 = tri.vertex2;
+      dst->vertex3 = tri.vertex3;
+      dst->normal = tri.normal;
+      dst->originOffset = tri.originOffset;
+      dst->lowerY = tri.lowerY;
+      dst->upperY = tri.upperY;
+      dst->v04 = tri.v04;
+      dst->object = o;
+      dst->type = surfaceType;
+      addSurface(c, dst);
     }
 
     *data += 3;
@@ -176,15 +251,285 @@ static void loadObjColModelFromVertexData(Object *o, s16 **data, s16 *vertexData
 }
 
 
-void loadObjectCollisionModel(Object *o) {
-  s16 vertexData[600];
+// Returns the number of s16s in the collision model, or -1 if it's malformed
+// or runs past maxLength
+s32 collisionModelLength(s16 *data, s32 maxLength) {
+  if (maxLength < 2 || data[0] != 0x40) return -1;
+
+  s32 numVerts = data[1];
+  s32 i = 2 + 3 * numVerts;
+  if (numVerts < 0) return -1;
+
+  while (i < maxLength && data[i] != 0x41) {
+    if (i + 2 > maxLength) return -1;
+    s32 numTris = data[i + 1];
+    i += 2;
+
+    if (numTris < 0 || i + 3 * numTris > maxLength) return -1;
+    for (s32 j = 0; j < 3 * numTris; j++) {
+      if (data[i + j] < 0 || data[i + j] >= numVerts) return -1;
+    }
+    i += 3 * numTris;
+  }
+
+  if (i >= maxLength) return -1;
+  return i + 1;
+}
+
+
+// Whether every triangle of the model is a floor or degenerate when it's
+// placed at pos with any yaw. Only floors are searched in loaded objects.
+bool modelOnlyHasFloors(s16 *model, v3f pos) {
+  s32 numVerts = model[1];
+  s16 *vertexData = (s16 *) malloc((3 * numVerts + 1) * sizeof(s16));
+
+  Object o;
+  memset(&o, 0, sizeof(Object));
+  o.pos = pos;
+
+  bool onlyFloors = true;
+  for (s32 i = 0; i < 0x1000 && onlyFloors; i++) {
+    o.displayAngle.yaw = i << 4;
+
+    s16 *data = model + 1;
+    readObjectCollisionVertices(&o, &data, vertexData);
+
+    while (*data != 0x41 && onlyFloors) {
+      data++;
+      s32 numTris = *data++;
+
+      for (s32 j = 0; j < numTris; j++) {
+        Surface tri;
+        if (readSurfaceData(vertexData, &data, &tri) && surfaceKind(&tri) != LEVEL_FLOORS)
+          onlyFloors = false;
+        data += 3;
+      }
+    }
+  }
+
+  free(vertexData);
+  return onlyFloors;
+}
+
+
+// Makes room in the cache for a model with the given number of vertices and
+// triangles
+static void reserveModel(ModelCache *c, s32 numVerts, s32 numTris) {
+  if (numVerts > c->maxVertices) {
+    c->maxVertices = numVerts > 2 * c->maxVertices ? numVerts : 2 * c->maxVertices;
+    c->vertexData = (s16 *) realloc(c->vertexData, 3 * c->maxVertices * sizeof(s16));
+  }
+
+  if (numTris > c->maxTris) {
+    c->maxTris = numTris > 2 * c->maxTris ? numTris : 2 * c->maxTris;
+    c->surfaceOf = (s32 *) realloc(c->surfaceOf, c->maxTris * sizeof(s32));
+  }
+
+  if (numTris > c->maxSurfaces) {
+    c->maxSurfaces = numTris > 2 * c->maxSurfaces ? numTris : 2 * c->maxSurfaces;
+    c->surfaces = (Surface *) realloc(c->surfaces, c->maxSurfaces * sizeof(Surface));
+    c->nodes = (SurfaceNode *) realloc(c->nodes, c->maxSurfaces * sizeof(SurfaceNode));
+  }
+}
+
+
+static void rebuildModel(ModelCache *c, Object *o) {
+  s16 *data = o->surfaceModel;
+
+  s32 numVerts = data[1];
+  s32 numTris = 0;
+  for (s16 *group = &data[2 + 3 * numVerts]; *group != 0x41; group += 2 + 3 * group[1])
+    numTris += group[1];
+  reserveModel(c, numVerts, numTris);
+
+  c->numSurfaces = 0;
+  c->numNodes = 0;
+  c->numTris = 0;
+  c->list.tail = NULL;
 
+  data++;
+  readObjectCollisionVertices(o, &data, c->vertexData);
+
+  while (*data != 0x41) {
+    loadObjColModelFromVertexData(c, o, &data);
+  }
+
+  c->model = o->surfaceModel;
+  c->version += 1;
+}
+
+
+// Recomputes the cached surfaces for a new transform without reinserting
+// them. Returns false if the list would come out in a different order or with
+// different triangles, in which case it has to be rebuilt.
+static bool updateModelInPlace(ModelCache *c, Object *o) {
   s16 *data = o->surfaceModel;
 
   data++;
-  readObjectCollisionVertices(o, &data, &vertexData[0]);
+  readObjectCollisionVertices(o, &data, c->vertexData);
 
+  s32 index = 0;
   while (*data != 0x41) {
-    loadObjColModelFromVertexData(o, &data, &vertexData[0]);
+    data++;
+    s32 numTris = *data++;
+
+    for (s32 i = 0; i < numTris; i++, index++) {
+      Surface tri;
+      bool valid = readSurfaceData(c->vertexData, &data, &tri);
+      data += 3;
+
+      s32 k = c->surfaceOf[index];
+      if (valid != (k >= 0)) return false;
+      if (!valid) continue;
+
+      // Insertion order only depends on vertex1.y
+      Surface *dst = &c->surfaces[k];
+      if (tri.vertex1.y != dst->vertex1.y) return false;
+
+      dst->vertex1 = tri.vertex1;
+      dst->vertex2 = tri.vertex2;
+      dst->vertex3 = tri.vertex3;
+      dst->normal = tri.normal;
+      dst->originOffset = tri.originOffset;
+      dst->lowerY = tri.lowerY;
+      dst->upperY = tri.upperY;
+      dst->v04 = tri.v04;
+    }
   }
+
+  return true;
+}
+
+
+static ModelCache *findModelCache(Object *o) {
+  for (s32 i = 0; i < numModelCaches; i++) {
+    if (modelCaches[i]->object == o)
+      return modelCaches[i];
+  }
+
+  modelCaches = (ModelCache **) realloc(
+    modelCaches, (numModelCaches + 1) * sizeof(ModelCache *));
+
+  ModelCache *c = (ModelCache *) calloc(1, sizeof(ModelCache));
+  c->object = o;
+  modelCaches[numModelCaches++] = c;
+  return c;
+}
+
+
+static bool sameTransform(ModelCache *c, Object *o) {
+  return c->pos.x == o->pos.x && c->pos.y == o->pos.y && c->pos.z == o->pos.z &&
+    c->angle.pitch == (s16) o->displayAngle.pitch &&
+    c->angle.yaw == (s16) o->displayAngle.yaw &&
+    c->angle.roll == (s16) o->displayAngle.roll;
+}
+
+
+// Merges c's list into allFloors. Both lists are sorted by vertex1.y with
+// ties in insertion order, and c's surfaces come after the ones already
+// loaded, so this gives the same list as adding them one by one.
+static void mergeModel(ModelCache *c) {
+  s32 k = numMergeSteps++;
+  if (k == maxMergeSteps) {
+    maxMergeSteps = maxMergeSteps == 0 ? 4 : 2 * maxMergeSteps;
+    mergeSteps = (MergeStep *) realloc(mergeSteps, maxMergeSteps * sizeof(MergeStep));
+    memset(&mergeSteps[k], 0, (maxMergeSteps - k) * sizeof(MergeStep));
+  }
+
+  MergeStep *step = &mergeSteps[k];
+  if (k < validMergeSteps && step->cache == c && step->version == c->version) {
+    allFloors.tail = step->list;
+    return;
+  }
+
+  // Later steps were merged onto a different list
+  validMergeSteps = k + 1;
+  step->cache = c;
+  step->version = c->version;
+
+  step->count = c->numNodes;
+  if (k == 0) {
+    step->list = c->list.tail;
+    allFloors.tail = step->list;
+    return;
+  }
+  step->count += mergeSteps[k - 1].count;
+
+  if (step->count > step->maxNodes) {
+    step->maxNodes = step->count;
+    step->nodes = (SurfaceNode *) realloc(step->nodes, step->maxNodes * sizeof(SurfaceNode));
+  }
+
+  SurfaceNode *a = allFloors.tail;
+  SurfaceNode *b = c->list.tail;
+  SurfaceNode head;
+  SurfaceNode *last = &head;
+
+  for (s32 i = 0; a != NULL || b != NULL; i++) {
+    SurfaceNode *node = &step->nodes[i];
+    if (b == NULL || (a != NULL && a->head->vertex1.y >= b->head->vertex1.y)) {
+      node->head = a->head;
+      a = a->tail;
+    }
+    else {
+      node->head = b->head;
+      b = b->tail;
+    }
+    last->tail = node;
+    last = node;
+  }
+  last->tail = NULL;
+
+  step->list = head.tail;
+  allFloors.tail = step->list;
+}
+
+
+void loadObjectCollisionModel(Object *o) {
+  ModelCache *c = findModelCache(o);
+
+  if (c->model != o->surfaceModel)
+    rebuildModel(c, o);
+  else if (!sameTransform(c, o) && !updateModelInPlace(c, o))
+    rebuildModel(c, o);
+
+  c->pos = o->pos;
+  c->angle = (v3h) {
+    (s16) o->displayAngle.pitch,
+    (s16) o->displayAngle.yaw,
+    (s16) o->displayAngle.roll,
+  };
+
+  mergeModel(c);
+}
+
+
+// Copies the loaded floors in list order, so that loadSurfaces can rebuild an
+// identical list later
+s32 copySurfaces(Surface *dst, s32 maxCount) {
+  s32 count = 0;
+  for (SurfaceNode *n = allFloors.tail; n != NULL && count < maxCount; n = n->tail)
+    dst[count++] = *n->head;
+  return count;
+}
+
+
+void loadSurfaces(Surface *tris, s32 count, Object *o) {
+  clearSurfaces();
+
+  ModelCache *c = &copiedSurfaces;
+  reserveModel(c, 0, count);
+  c->numSurfaces = 0;
+  c->numNodes = 0;
+  c->list.tail = NULL;
+  c->version += 1;
+
+  for (s32 i = 0; i < count; i++) {
+    Surface *tri = allocSurface(c);
+    *tri = tris[i];
+    tri->object = o;
+    addSurface(c, tri);
+  }
+
+  mergeModel(c);
 }
@@ -5,6 +5,10 @@
 #include "util.h"
 
 
+// Set in v04 (the game's flags) for walls that face mostly along x
+#define SURFACE_FLAG_X_PROJECTION 0x08
+
+
 typedef struct Surface Surface;
 typedef struct SurfaceNode SurfaceNode;
 
@@ -35,11 +39,16 @@ struct SurfaceNode {
 };
 
 
-extern SurfaceNode allFloors;
+extern THREAD_LOCAL SurfaceNode allFloors;
 
 
+bool initSurface(Surface *tri, v3h *v1, v3h *v2, v3h *v3);
 void clearSurfaces(void);
+s32 collisionModelLength(s16 *data, s32 maxLength);
+bool modelOnlyHasFloors(s16 *model, v3f pos);
 void loadObjectCollisionModel(Object *o);
+s32 copySurfaces(Surface *dst, s32 maxCount);
+void loadSurfaces(Surface *tris, s32 count, Object *o);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,269 @@
+#include "thread.h"
+
+#include "util.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+
+s32 numThreads = 0;
+
+
+// Largest number of indices a worker takes from its own range at once. Runs
+// vary from one frame to thousands, so chunks stay small enough that the last
+// few long runs can still be stolen.
+#define MAX_CHUNK 64
+
+
+// Remaining indices [begin, end) of a worker, packed as begin | end << 32 so
+// that the owner taking from the front and thieves taking from the back can
+// both update it with a single compare and swap. Padded to a cache line.
+typedef struct {
+  u64 range;
+  u8 padding[56];
+} WorkRange;
+
+
+typedef struct {
+  ParallelBody body;
+  void *arg;
+  WorkRange *ranges;
+  s32 numRanges;
+} ParallelJob;
+
+
+s32 defaultNumThreads(void) {
+#if defined(WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (s32) info.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (s32) n : 1;
+#endif
+}
+
+
+static u64 packRange(u32 begin, u32 end) {
+  return (u64) begin | (u64) end << 32;
+}
+
+
+// Takes a chunk from the front of the worker's own range
+static bool takeChunk(WorkRange *w, u32 *begin, u32 *end) {
+  u64 old = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+  while (true) {
+    u32 b = (u32) old;
+    u32 e = (u32) (old >> 32);
+    if (b >= e) return false;
+
+    u32 chunk = (e - b) / 16;
+    if (chunk < 1) chunk = 1;
+    if (chunk > MAX_CHUNK) chunk = MAX_CHUNK;
+
+    if (__atomic_compare_exchange_n(&w->range, &old, packRange(b + chunk, e),
+      true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      *begin = b;
+      *end = b + chunk;
+      return true;
+    }
+  }
+}
+
+
+// Moves the back half of the fullest other range into the worker's own
+// (empty) range. Returns false once every range is empty.
+static bool steal(ParallelJob *job, s32 self) {
+  while (true) {
+    s32 victim = -1;
+    u64 old = 0;
+    u32 most = 0;
+
+    for (s32 i = 0; i < job->numRanges; i++) {
+      if (i == self) continue;
+      u64 r = __atomic_load_n(&job->ranges[i].range, __ATOMIC_ACQUIRE);
+      u32 b = (u32) r;
+      u32 e = (u32) (r >> 32);
+      if (b < e && e - b > most) {
+        victim = i;
+        old = r;
+        most = e - b;
+      }
+    }
+    if (victim < 0) return false;
+
+    u32 b = (u32) old;
+    u32 e = (u32) (old >> 32);
+    u32 half = (e - b + 1) / 2;
+    if (__atomic_compare_exchange_n(&job->ranges[victim].range, &old, packRange(b, e - half),
+      false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      __atomic_store_n(&job->ranges[self].range, packRange(e - half, e), __ATOMIC_RELEASE);
+      return true;
+    }
+  }
+}
+
+
+static void runJob(ParallelJob *job, s32 self) {
+  WorkRange *own = &job->ranges[self];
+  u32 begin, end;
+
+  do {
+    while (takeChunk(own, &begin, &end)) {
+      for (u32 i = begin; i < end; i++)
+        job->body((s32) i, job->arg);
+    }
+  } while (steal(job, self));
+}
+
+
+// Workers are started as parallelFor first needs them and then wait for jobs,
+// so that repeated small jobs don't pay for thread creation. Only the first
+// numActive workers take part in a job, so that a smaller thread count or a
+// short job doesn't wake the rest.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t finished;
+  s32 numWorkers;
+  s32 numActive;
+  u32 generation;
+  s32 busy;
+  bool startFailed;
+  ParallelJob *job;
+  WorkRange *ranges;
+} ThreadPool;
+
+static ThreadPool pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  0, 0, 0, 0, false, NULL, NULL,
+};
+
+// Held for the whole of a parallel job, so that jobs from different calling
+// threads run one after another on the shared pool. A parallel body must not
+// call parallelFor itself: the nested call would wait on this lock forever.
+static pthread_mutex_t callerLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void *poolWorker(void *p) {
+  s32 self = (s32) (intptr_t) p;
+
+  // Counts as busy until it has seen the current generation, so that it
+  // can't mistake the next job for one started before it existed
+  pthread_mutex_lock(&pool.lock);
+  u32 seen = pool.generation;
+  if (--pool.busy == 0)
+    pthread_cond_signal(&pool.finished);
+
+  while (true) {
+    while (pool.generation == seen)
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    seen = pool.generation;
+    if (self >= pool.numActive) continue;
+    ParallelJob *job = pool.job;
+    pthread_mutex_unlock(&pool.lock);
+
+    runJob(job, self);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.busy == 0)
+      pthread_cond_signal(&pool.finished);
+  }
+
+  return NULL;
+}
+
+
+// Starts workers until there are n. If a thread can't be created, the pool
+// keeps the workers it has and stops growing.
+static void growPool(s32 n) {
+  if (n <= pool.numWorkers || pool.startFailed) return;
+
+  WorkRange *ranges = (WorkRange *) realloc(pool.ranges, (size_t) n * sizeof(WorkRange));
+  if (ranges == NULL) {
+    fprintf(stderr, "Out of memory for %d worker threads\n", n);
+    pool.startFailed = true;
+    return;
+  }
+  pool.ranges = ranges;
+
+  pthread_mutex_lock(&pool.lock);
+  s32 started = 0;
+  for (s32 i = pool.numWorkers; i < n; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, poolWorker, (void *) (intptr_t) i) != 0) {
+      fprintf(stderr, "Could not start worker thread %d, using %d\n", i + 1, i);
+      pool.startFailed = true;
+      break;
+    }
+    pthread_detach(thread);
+    started += 1;
+  }
+  pool.numWorkers += started;
+
+  pool.busy += started;
+  while (pool.busy > 0)
+    pthread_cond_wait(&pool.finished, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+
+// Calls body(i, arg) for every i in [0, count), spread across numThreads
+// threads. Each worker starts with an equal slice of the indices and steals
+// from the others once it runs out, so uneven run lengths don't leave threads
+// idle. Simulation globals are thread local, so the body must restore the
+// state it needs before simulating. Calls from several threads are serialized,
+// and calls can't be nested inside a body.
+void parallelFor(s32 count, ParallelBody body, void *arg) {
+  s32 n = numThreads > 0 ? numThreads : defaultNumThreads();
+  if (n > count) n = count;
+  if (n <= 1) {
+    for (s32 i = 0; i < count; i++)
+      body(i, arg);
+    return;
+  }
+
+  pthread_mutex_lock(&callerLock);
+  growPool(n);
+  if (n > pool.numWorkers) n = pool.numWorkers;
+  if (n <= 1) {
+    pthread_mutex_unlock(&callerLock);
+    for (s32 i = 0; i < count; i++)
+      body(i, arg);
+    return;
+  }
+
+  ParallelJob job;
+  job.body = body;
+  job.arg = arg;
+  job.numRanges = n;
+  job.ranges = pool.ranges;
+  for (s32 i = 0; i < job.numRanges; i++) {
+    u32 begin = (u32) ((s64) count * i / job.numRanges);
+    u32 end = (u32) ((s64) count * (i + 1) / job.numRanges);
+    job.ranges[i].range = packRange(begin, end);
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.job = &job;
+  pool.numActive = n;
+  pool.busy = n;
+  pool.generation += 1;
+  pthread_cond_broadcast(&pool.wake);
+
+  while (pool.busy > 0)
+    pthread_cond_wait(&pool.finished, &pool.lock);
+  pool.job = NULL;
+  pthread_mutex_unlock(&pool.lock);
+  pthread_mutex_unlock(&callerLock);
+}
@@ -0,0 +1,18 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+
+#include "util.h"
+
+
+extern s32 numThreads;
+
+
+typedef void (*ParallelBody)(s32 index, void *arg);
+
+
+s32 defaultNumThreads(void);
+void parallelFor(s32 count, ParallelBody body, void *arg);
+
+
+#endif
@@ -0,0 +1,98 @@
+#include "trajectory.h"
+
+#include "cog.h"
+#include "state.h"
+#include "surface.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+
+CogTrajectory *buildCogTrajectory(SimState *start, s32 numFrames, bool cacheFloors) {
+  SimState saved;
+  saveState(&saved);
+  restoreState(start);
+
+  CogTrajectory *t = (CogTrajectory *) malloc(sizeof(CogTrajectory));
+  t->numFrames = numFrames;
+  t->yaw = (s16 *) malloc(numFrames * sizeof(s16));
+  t->yawVel = (f32 *) malloc(numFrames * sizeof(f32));
+  t->yawVelTarget = (f32 *) malloc(numFrames * sizeof(f32));
+  t->rngCall = (s8 *) malloc(numFrames * sizeof(s8));
+  t->numFloors = NULL;
+  t->floors = NULL;
+
+  if (cacheFloors) {
+    t->numFloors = (u8 *) malloc(numFrames * sizeof(u8));
+    t->floors = (Surface *) malloc(
+      (size_t) numFrames * TRAJECTORY_MAX_FLOORS * sizeof(Surface));
+  }
+
+  for (s32 i = 0; i < numFrames; i++) {
+    updateTtcCog(&cog);
+    t->yaw[i] = (s16) cog.displayAngle.yaw;
+    t->yawVel[i] = cog.yawVel;
+    t->yawVelTarget[i] = cog.yawVelTarget;
+    t->rngCall[i] = cogRngCall;
+
+    if (cacheFloors) {
+      clearSurfaces();
+      loadObjectCollisionModel(&cog);
+      t->numFloors[i] = (u8) copySurfaces(
+        &t->floors[i * TRAJECTORY_MAX_FLOORS], TRAJECTORY_MAX_FLOORS);
+    }
+  }
+
+  t->endCog = cog;
+  t->endRngState = rngState;
+  t->endRngOverride = cogRngOverride;
+
+  restoreState(&saved);
+  return t;
+}
+
+
+void freeCogTrajectory(CogTrajectory *t) {
+  free(t->yaw);
+  free(t->yawVel);
+  free(t->yawVelTarget);
+  free(t->rngCall);
+  free(t->numFloors);
+  free(t->floors);
+  free(t);
+}
+
+
+// Does the equivalent of updateTtcCog + reloading the cog's collision for the
+// given frame. Past the end of the trajectory, the simulation continues from
+// the cached end state.
+void followCogTrajectory(CogTrajectory *t, s32 frame) {
+  if (frame >= t->numFrames) {
+    if (frame == t->numFrames) {
+      cog = t->endCog;
+      rngState = t->endRngState;
+      cogRngOverride = t->endRngOverride;
+    }
+
+    clearSurfaces();
+    updateTtcCog(&cog);
+    loadObjectCollisionModel(&cog);
+    return;
+  }
+
+  cog.displayAngle.yaw = t->yaw[frame];
+  cog.yawVel = t->yawVel[frame];
+  cog.yawVelTarget = t->yawVelTarget[frame];
+  cogRngCall = t->rngCall[frame];
+  if (cogRngCall != 127)
+    numCogRngCalls += 1;
+
+  if (t->floors != NULL) {
+    loadSurfaces(
+      &t->floors[frame * TRAJECTORY_MAX_FLOORS], t->numFloors[frame], &cog);
+  }
+  else {
+    clearSurfaces();
+    loadObjectCollisionModel(&cog);
+  }
+}
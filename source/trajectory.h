@@ -0,0 +1,40 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+
+#include "state.h"
+#include "surface.h"
+#include "util.h"
+
+
+#define TRAJECTORY_MAX_FLOORS 4
+
+// Runs rarely last this long; past the end the cog is simulated as usual
+#define MAX_SHARED_TRAJECTORY 16384
+
+
+// The cog's motion doesn't depend on Mario, so for a fixed start state it can
+// be computed once and shared read-only by every run that starts from it.
+struct CogTrajectory {
+  s32 numFrames;
+  s16 *yaw;
+  f32 *yawVel;
+  f32 *yawVelTarget;
+  s8 *rngCall;
+
+  // Optional, NULL unless built with cacheFloors
+  u8 *numFloors;
+  Surface *floors;
+
+  Object endCog;
+  u16 endRngState;
+  s8 *endRngOverride;
+};
+
+
+CogTrajectory *buildCogTrajectory(SimState *start, s32 numFrames, bool cacheFloors);
+void freeCogTrajectory(CogTrajectory *t);
+void followCogTrajectory(CogTrajectory *t, s32 frame);
+
+
+#endif
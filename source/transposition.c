@@ -0,0 +1,163 @@
+#include "transposition.h"
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+s32 ttSizeMb = 64;
+
+
+// Rounds down to a power of two number of buckets, at least one
+TranspositionTable *createTranspositionTable(u64 bytes) {
+  u64 numBuckets = 1;
+  while (2 * numBuckets * TT_BUCKET_SIZE * sizeof(TtEntry) <= bytes)
+    numBuckets *= 2;
+
+  TranspositionTable *t = (TranspositionTable *) calloc(1, sizeof(TranspositionTable));
+  t->entries = (TtEntry *) calloc(numBuckets * TT_BUCKET_SIZE, sizeof(TtEntry));
+  if (t->entries == NULL) {
+    fprintf(stderr, "Not enough memory for a %llu MB transposition table\n",
+      (unsigned long long) (bytes >> 20));
+    exit(1);
+  }
+  t->bucketMask = numBuckets - 1;
+  return t;
+}
+
+
+void freeTranspositionTable(TranspositionTable *t) {
+  if (t == NULL) return;
+  free(t->entries);
+  free(t);
+}
+
+
+static TtEntry *findBucket(TranspositionTable *t, u32 *key) {
+  u64 h = 0;
+  for (s32 i = 0; i < TT_KEY_WORDS; i++) {
+    h ^= key[i];
+    h = splitMix64(&h);
+  }
+  return &t->entries[(h & t->bucketMask) * TT_BUCKET_SIZE];
+}
+
+
+// Copies the entry if no writer touched it meanwhile
+static bool readEntry(TtEntry *e, TtEntry *copy) {
+  u32 version = __atomic_load_n(&e->version, __ATOMIC_ACQUIRE);
+  if (version & 1) return false;
+
+  for (s32 i = 0; i < TT_KEY_WORDS; i++)
+    copy->key[i] = __atomic_load_n(&e->key[i], __ATOMIC_RELAXED);
+  copy->value = __atomic_load_n(&e->value, __ATOMIC_RELAXED);
+  copy->priority = __atomic_load_n(&e->priority, __ATOMIC_RELAXED);
+  copy->used = __atomic_load_n(&e->used, __ATOMIC_RELAXED);
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&e->version, __ATOMIC_RELAXED) == version;
+}
+
+
+static bool sameKey(u32 *a, u32 *b) {
+  return memcmp(a, b, TT_KEY_WORDS * sizeof(u32)) == 0;
+}
+
+
+bool ttProbe(TranspositionTable *t, u32 *key, u64 *value, TtStats *stats) {
+  stats->probes += 1;
+
+  TtEntry *bucket = findBucket(t, key);
+  for (s32 i = 0; i < TT_BUCKET_SIZE; i++) {
+    TtEntry copy;
+    if (readEntry(&bucket[i], &copy) && copy.used && sameKey(copy.key, key)) {
+      stats->hits += 1;
+      *value = copy.value;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+// Stores into the entry with the same key if there is one, otherwise into an
+// empty entry or the one with the lowest priority, as long as that isn't
+// higher than priority
+void ttStore(TranspositionTable *t, u32 *key, u64 value, u16 priority, TtStats *stats) {
+  TtEntry *bucket = findBucket(t, key);
+
+  TtEntry *target = NULL;
+  u16 targetPriority = 0;
+  bool replacing = false;
+  for (s32 i = 0; i < TT_BUCKET_SIZE; i++) {
+    TtEntry copy;
+    if (!readEntry(&bucket[i], &copy)) continue;
+
+    if (copy.used && sameKey(copy.key, key)) {
+      target = &bucket[i];
+      replacing = false;
+      break;
+    }
+    if (!copy.used) {
+      if (target == NULL || replacing) {
+        target = &bucket[i];
+        replacing = false;
+      }
+    }
+    else if (copy.priority <= priority &&
+      (target == NULL || (replacing && copy.priority < targetPriority)))
+    {
+      target = &bucket[i];
+      targetPriority = copy.priority;
+      replacing = true;
+    }
+  }
+  if (target == NULL) return;
+
+  u32 version = __atomic_load_n(&target->version, __ATOMIC_RELAXED);
+  if ((version & 1) || !__atomic_compare_exchange_n(&target->version, &version, version + 1,
+    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+  {
+    stats->busy += 1;
+    return;
+  }
+
+  for (s32 i = 0; i < TT_KEY_WORDS; i++)
+    __atomic_store_n(&target->key[i], key[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&target->value, value, __ATOMIC_RELAXED);
+  __atomic_store_n(&target->priority, priority, __ATOMIC_RELAXED);
+  __atomic_store_n(&target->used, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&target->version, version + 2, __ATOMIC_RELEASE);
+
+  stats->stores += 1;
+  if (replacing)
+    stats->replacements += 1;
+}
+
+
+// Not atomic, so callers must not add stats from several threads at once
+void ttAddStats(TranspositionTable *t, TtStats *stats) {
+  t->stats.probes += stats->probes;
+  t->stats.hits += stats->hits;
+  t->stats.stores += stats->stores;
+  t->stats.replacements += stats->replacements;
+  t->stats.busy += stats->busy;
+}
+
+
+void printTtStats(TranspositionTable *t) {
+  TtStats *s = &t->stats;
+  u64 numEntries = (t->bucketMask + 1) * TT_BUCKET_SIZE;
+
+  printf("Transposition table: %llu MB, %llu probes, %llu hits (%.1f%%), "
+    "%llu stores, %llu replacements, %llu skipped while busy\n",
+    (unsigned long long) (numEntries * sizeof(TtEntry) >> 20),
+    (unsigned long long) s->probes,
+    (unsigned long long) s->hits,
+    s->probes > 0 ? 100.0 * s->hits / s->probes : 0.0,
+    (unsigned long long) s->stores,
+    (unsigned long long) s->replacements,
+    (unsigned long long) s->busy);
+}
@@ -0,0 +1,58 @@
+#ifndef TRANSPOSITION_H
+#define TRANSPOSITION_H
+
+
+#include "util.h"
+
+
+// Words of state that identify a table entry, compared bit for bit
+#define TT_KEY_WORDS 5
+
+#define TT_BUCKET_SIZE 4
+
+
+extern s32 ttSizeMb;
+
+
+// An entry is only read if its version is even and unchanged afterwards, and
+// a writer makes it odd while writing. Writers that find an entry busy skip
+// their store instead of waiting, so no thread ever blocks.
+typedef struct {
+  u32 version;
+  u32 key[TT_KEY_WORDS];
+  u64 value;
+  u16 priority;
+  u16 used;
+} TtEntry;
+
+
+// Counted by each thread on its own and added to the table's totals with
+// ttAddStats, so that probes don't contend for a shared counter
+typedef struct {
+  u64 probes;
+  u64 hits;
+  u64 stores;
+  u64 replacements;
+  u64 busy;
+} TtStats;
+
+
+// Fixed-size hash table shared by every search thread. Each bucket holds
+// TT_BUCKET_SIZE entries, and when it's full the entry with the lowest
+// priority (e.g. the smallest subtree) is replaced.
+typedef struct {
+  TtEntry *entries;
+  u64 bucketMask;
+  TtStats stats;
+} TranspositionTable;
+
+
+TranspositionTable *createTranspositionTable(u64 bytes);
+void freeTranspositionTable(TranspositionTable *t);
+bool ttProbe(TranspositionTable *t, u32 *key, u64 *value, TtStats *stats);
+void ttStore(TranspositionTable *t, u32 *key, u64 value, u16 priority, TtStats *stats);
+void ttAddStats(TranspositionTable *t, TtStats *stats);
+void printTtStats(TranspositionTable *t);
+
+
+#endif
@@ -0,0 +1,239 @@
+#include "checkpoint.h"
+#include "state.h"
+#include "thread.h"
+#include "trajectory.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Most variants a search may simulate, which keeps the variant array and
+// checkpoint within a few GB
+#define MAX_ULP_VARIANTS (1 << 27)
+
+
+typedef struct {
+  s32 dx;
+  s32 dz;
+  s32 dh;
+  SimResult r;
+} UlpVariant;
+
+
+typedef struct {
+  SimState start;
+  s32 radius;
+  s32 samples;
+  s32 maxFrames;
+  Shard *shard;
+  UlpVariant *variants;
+  Checkpoint *checkpoint;
+} UlpSearch;
+
+
+// A fixed pseudorandom permutation of [0, n). Shuffles within the next power
+// of two with invertible steps and walks the cycle until the value is in range.
+static s32 permuteIndex(s32 index, s32 n) {
+  u32 bits = 1;
+  while ((1u << bits) < (u32) n) bits += 1;
+  u32 mask = (1u << bits) - 1;
+  u32 shift = (bits + 1) / 2;
+
+  u32 x = (u32) index;
+  do {
+    for (s32 round = 0; round < 3; round++) {
+      x = (x * 0x9E3779B1u + 0x7F4A7C15u) & mask;
+      x ^= x >> shift;
+    }
+  } while (x >= (u32) n);
+  return (s32) x;
+}
+
+
+// Sample 0 is the unmodified start, and the others are distinct points of the
+// rest of the cube, so no variant is simulated twice
+static void pickOffsets(UlpSearch *s, s32 index, UlpVariant *v) {
+  s32 width = 2 * s->radius + 1;
+  s32 cube = width * width * width;
+
+  if (s->samples > 0) {
+    s32 center = cube / 2;
+    if (index == 0)
+      index = center;
+    else {
+      index = permuteIndex(index - 1, cube - 1);
+      if (index >= center) index += 1;
+    }
+  }
+
+  v->dx = index % width - s->radius;
+  v->dz = index / width % width - s->radius;
+  v->dh = index / width / width - s->radius;
+}
+
+
+static void simulateVariant(s32 i, void *arg) {
+  UlpSearch *s = (UlpSearch *) arg;
+  UlpVariant *v = &s->variants[i];
+  s32 index = shardUnit(s->shard, i);
+
+  pickOffsets(s, index, v);
+  if (isUnitDone(s->checkpoint, index)) {
+    v->r = *unitResult(s->checkpoint, index);
+    return;
+  }
+
+  restoreState(&s->start);
+  mario.pos.x = offsetUlps(mario.pos.x, v->dx);
+  mario.pos.z = offsetUlps(mario.pos.z, v->dz);
+  mario.hSpeed = offsetUlps(mario.hSpeed, v->dh);
+
+  v->r = runUntilFailure(s->maxFrames);
+  finishUnit(s->checkpoint, index, &v->r);
+}
+
+
+static int compareVariants(const void *p1, const void *p2) {
+  const UlpVariant *v1 = (const UlpVariant *) p1;
+  const UlpVariant *v2 = (const UlpVariant *) p2;
+
+  if (v1->r.frames != v2->r.frames)
+    return v1->r.frames > v2->r.frames ? -1 : 1;
+  if (v1->r.hSpeed != v2->r.hSpeed)
+    return v1->r.hSpeed > v2->r.hSpeed ? -1 : 1;
+
+  s32 d1 = abs(v1->dx) + abs(v1->dz) + abs(v1->dh);
+  s32 d2 = abs(v2->dx) + abs(v2->dz) + abs(v2->dh);
+  if (d1 != d2)
+    return d1 < d2 ? -1 : 1;
+  if (v1->dx != v2->dx) return v1->dx < v2->dx ? -1 : 1;
+  if (v1->dz != v2->dz) return v1->dz < v2->dz ? -1 : 1;
+  return v1->dh < v2->dh ? -1 : v1->dh > v2->dh;
+}
+
+
+static void printVariant(UlpSearch *s, s32 rank, UlpVariant *v) {
+  MarioState *m = &s->start.mario;
+
+  printf("%3d. \x1b[1m%d\x1b[0m frames, %d cog RNG updates, final H speed %f\n",
+    rank, v->r.frames, v->r.numCogRngCalls, v->r.hSpeed);
+  printf("     x = 0x%08X (%+d)  z = 0x%08X (%+d)  hSpeed = 0x%08X (%+d)\n",
+    floatBits(offsetUlps(m->pos.x, v->dx)), v->dx,
+    floatBits(offsetUlps(m->pos.z, v->dz)), v->dz,
+    floatBits(offsetUlps(m->hSpeed, v->dh)), v->dh);
+}
+
+
+static void printVariants(UlpSearch *s, s32 count, s32 topCount) {
+  qsort(s->variants, count, sizeof(UlpVariant), compareVariants);
+
+  s32 baseline = -1;
+  for (s32 i = 0; i < count; i++) {
+    UlpVariant *v = &s->variants[i];
+    if (v->dx == 0 && v->dz == 0 && v->dh == 0) baseline = i;
+  }
+  if (baseline >= 0)
+    printf("Unmodified start lasts %d frames (rank %d)\n",
+      s->variants[baseline].r.frames, baseline + 1);
+
+  if (topCount > count) topCount = count;
+  for (s32 i = 0; i < topCount; i++)
+    printVariant(s, i + 1, &s->variants[i]);
+}
+
+
+// Simulates every float start value within radius ULPs of mario's x, z and
+// hSpeed (or a random sample of them) and reports the longest survivors. On
+// failure returns false and sets *error.
+bool runUlpSearch(s32 radius, s32 samples, s32 maxFrames, s32 topCount,
+  CheckpointConfig *checkpoint, Shard *shard, char **error)
+{
+  UlpSearch s;
+  saveState(&s.start);
+  s.radius = radius;
+  s.samples = samples;
+  s.maxFrames = maxFrames;
+  s.shard = shard;
+
+  u64 width = 2 * (u64) radius + 1;
+  u64 cube = width <= 1024 ? width * width * width : UINT64_MAX;
+  if (cube > MAX_ULP_VARIANTS) {
+    *error = "ULP radius gives more than the limit of 2^27 variants";
+    return false;
+  }
+  if ((u64) samples >= cube)
+    samples = 0;
+  s.samples = samples;
+
+  s32 total = samples > 0 ? samples : (s32) cube;
+  s32 count = shardSize(shard, total);
+  s.variants = (UlpVariant *) malloc(count * sizeof(UlpVariant));
+  if (s.variants == NULL) {
+    *error = "Out of memory for the ULP variants";
+    return false;
+  }
+
+  u64 key = hashStartState(&s.start);
+  key = mixHash(key, (u64) radius);
+  key = mixHash(key, (u64) samples);
+  key = mixHash(key, (u64) maxFrames);
+
+  s32 params[CHECKPOINT_PARAMS] = {
+    radius, samples, maxFrames,
+    (s32) floatBits(s.start.mario.pos.x),
+    (s32) floatBits(s.start.mario.pos.z),
+    (s32) floatBits(s.start.mario.hSpeed),
+  };
+  s.checkpoint = openCheckpoint(checkpoint, CHECKPOINT_ULP, key, total, params, shard);
+
+  // Every variant shares the same cog motion
+  s.start.cogTrajectory = buildCogTrajectory(&s.start,
+    maxFrames < MAX_SHARED_TRAJECTORY ? maxFrames : MAX_SHARED_TRAJECTORY, true);
+  s.start.trajectoryFrame = 0;
+
+  if (shard->count > 1)
+    printf("Simulating %d of %d variants within %d ULPs (shard %d/%d)\n",
+      count, total, radius, shard->index + 1, shard->count);
+  else
+    printf("Simulating %d variants within %d ULPs\n", count, radius);
+  parallelFor(count, simulateVariant, &s);
+  closeCheckpoint(s.checkpoint);
+
+  freeCogTrajectory(s.start.cogTrajectory);
+
+  printVariants(&s, count, topCount);
+  free(s.variants);
+  return true;
+}
+
+
+// Reports the variants in merged shard results. Returns false if the
+// variants don't fit in memory.
+bool mergeUlpResults(Checkpoint *c, s32 topCount) {
+  UlpSearch s;
+  memset(&s, 0, sizeof(UlpSearch));
+  s.radius = c->params[0];
+  s.samples = c->params[1];
+  s.start.mario.pos.x = bitsFloat((u32) c->params[3]);
+  s.start.mario.pos.z = bitsFloat((u32) c->params[4]);
+  s.start.mario.hSpeed = bitsFloat((u32) c->params[5]);
+  s.variants = (UlpVariant *) malloc(c->count * sizeof(UlpVariant));
+  if (s.variants == NULL)
+    return false;
+
+  s32 count = 0;
+  for (s32 i = 0; i < c->count; i++) {
+    if (!isUnitDone(c, i)) continue;
+    UlpVariant *v = &s.variants[count++];
+    pickOffsets(&s, i, v);
+    v->r = *unitResult(c, i);
+  }
+
+  printf("Variants within %d ULPs\n", s.radius);
+  printVariants(&s, count, topCount);
+  free(s.variants);
+  return true;
+}
@@ -106,7 +106,7 @@ bool incTowardSymFP(f32 *x, f32 target, f32 delta) {
 }
 
 
-u16 rngState;
+THREAD_LOCAL u16 rngState;
 
 
 u16 randomU16(void) {
@@ -133,6 +133,47 @@ s32 randomUnit() {
 }
 
 
+// Host-side PRNG for sampling, independent of the game's RNG
+u64 splitMix64(u64 *state) {
+  u64 z = (*state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+
+u32 floatBits(f32 x) {
+  union {
+    f32 f;
+    u32 i;
+  } u;
+  u.f = x;
+  return u.i;
+}
+
+
+f32 bitsFloat(u32 x) {
+  union {
+    f32 f;
+    u32 i;
+  } u;
+  u.i = x;
+  return u.f;
+}
+
+
+// Moves n representable floats away from x (n < 0 moves toward -infinity)
+f32 offsetUlps(f32 x, s32 n) {
+  u32 bits = floatBits(x);
+
+  s32 key = (s32) bits >= 0 ? (s32) bits : (s32) (0x80000000u - bits);
+  key += n;
+  bits = key >= 0 ? (u32) key : 0x80000000u - (u32) key;
+
+  return bitsFloat(bits);
+}
+
+
 u32 sineTableRaw[0x1400] = {
   0x00000000,0x3AC90FD5,0x3B490FC6,0x3B96CBC1,0x3BC90F88,0x3BFB5330,0x3C16CB58,
   0x3C2FED02,0x3C490E90,0x3C622FFF,0x3C7B514B,0x3C8A3938,0x3C96C9B6,0x3CA35A1C,
@@ -8,10 +8,12 @@
 typedef int8_t s8; 
 typedef int16_t s16;
 typedef int32_t s32;
+typedef int64_t s64;
 
 typedef uint8_t u8; 
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 
 typedef float f32;
 typedef double f64;
@@ -22,6 +24,10 @@ typedef u8 bool;
 #define false 0
 
 
+// Simulation state is kept in globals, so each worker thread gets its own copy
+#define THREAD_LOCAL __thread
+
+
 typedef f32 Mtxf[4][4];
 typedef f32 (*Mtxfp)[4];
 
@@ -47,7 +53,7 @@ typedef struct {
 } v3h;
 
 
-extern u16 rngState;
+extern THREAD_LOCAL u16 rngState;
 
 
 s16 atan2xy(f32 x, f32 y);
@@ -56,6 +62,10 @@ f32 incTowardAsymF(f32 speed, f32 target, f32 posDelta, f32 negDelta);
 bool incTowardSymFP(f32 *x, f32 target, f32 delta);
 u16 randomU16(void);
 s32 randomUnit();
+u64 splitMix64(u64 *state);
+u32 floatBits(f32 x);
+f32 bitsFloat(u32 x);
+f32 offsetUlps(f32 x, s32 n);
 
 
 extern u32 sineTableRaw[0x1400];
@@ -1,4 +1,5 @@
 #include "cog.h"
+#include "level.h"
 #include "mario.h"
 #include "state.h"
 #include "surface.h"
@@ -20,9 +21,33 @@ static bool unitSquareMode = false;
 static int zoomAmount = 0;
 
 
+static void drawSurface(Surface *tri) {
+  glBegin(GL_LINE_LOOP);
+  glVertex2f(tri->vertex1.x, tri->vertex1.z);
+  glVertex2f(tri->vertex2.x, tri->vertex2.z);
+  glVertex2f(tri->vertex3.x, tri->vertex3.z);
+  glEnd();
+}
+
+
+// Level surfaces of a kind whose y range is near Mario
+static void drawLevelSurfaces(s32 kind) {
+  for (s32 i = 0; i < level->numSurfaces; i++) {
+    Surface *tri = &level->surfaces[i];
+    if (surfaceKind(tri) == kind && tri->lowerY <= mario.pos.y + 200 && tri->upperY >= mario.pos.y - 200)
+      drawSurface(tri);
+  }
+}
+
+
 static void drawWalls(void) {
   glColor3f(0.4f, 0.4f, 0.4f);
 
+  if (level != NULL) {
+    drawLevelSurfaces(LEVEL_WALLS);
+    return;
+  }
+
   glBegin(GL_LINES);
   glVertex2f(2081, -861);
   glVertex2f(862, -2080);
@@ -33,8 +58,25 @@ static void drawWalls(void) {
 }
 
 
+static void drawUnitSquare(v3f pos) {
+  glBegin(GL_TRIANGLE_STRIP);
+  glVertex2f(pos.x, pos.z);
+  glVertex2f(pos.x + 1, pos.z);
+  glVertex2f(pos.x, pos.z + 1);
+  glVertex2f(pos.x + 1, pos.z + 1);
+  glEnd();
+}
+
+
 static void drawUnitSquares(s16 x0, s16 z0, s16 x1, s16 z1) {
+  if (z1 <= z0) return;
+  v3f *points = (v3f *) malloc((z1 - z0) * sizeof(v3f));
+  f32 *heights = (f32 *) malloc((z1 - z0) * sizeof(f32));
+  Surface **floors = (Surface **) malloc((z1 - z0) * sizeof(Surface *));
+
   for (s16 x = x0; x < x1; x++) {
+    // Each column's points are tested against the floors together
+    s32 n = 0;
     for (s16 z = z0; z < z1; z++) {
       v3f pos = { x, cog.pos.y, z };
 
@@ -43,29 +85,23 @@ static void drawUnitSquares(s16 x0, s16 z0, s16 x1, s16 z1) {
       f32 dist = sqrtf(dx*dx + dz*dz);
       if (dist > 350) continue;
 
-      Surface *floor = NULL;
-      if (!(dist < 200))
-        findFloor(pos, &floor);
-
-      if (dist < 200 || floor != NULL) {
-        glBegin(GL_TRIANGLE_STRIP);
-        glVertex2f(pos.x, pos.z);
-        glVertex2f(pos.x + 1, pos.z);
-        glVertex2f(pos.x, pos.z + 1);
-        glVertex2f(pos.x + 1, pos.z + 1);
-        glEnd();
-      }
+      if (dist < 200)
+        drawUnitSquare(pos);
+      else
+        points[n++] = pos;
     }
-  }
-}
 
+    findFloorBatch(points, n, heights, floors);
 
-static void drawSurface(Surface *tri) {
-  glBegin(GL_LINE_LOOP);
-  glVertex2f(tri->vertex1.x, tri->vertex1.z);
-  glVertex2f(tri->vertex2.x, tri->vertex2.z);
-  glVertex2f(tri->vertex3.x, tri->vertex3.z);
-  glEnd();
+    for (s32 i = 0; i < n; i++) {
+      if (floorLands(floors[i], heights[i], points[i].y))
+        drawUnitSquare(points[i]);
+    }
+  }
+
+  free(points);
+  free(heights);
+  free(floors);
 }
 
 
@@ -80,6 +116,11 @@ static void drawSurfaces(v3f center, f32 span) {
     drawUnitSquares(x0, z0, x1, z1);
   }
   else {
+    if (level != NULL) {
+      glColor3f(0.6f, 0.6f, 0.6f);
+      drawLevelSurfaces(LEVEL_FLOORS);
+    }
+
     glColor3f(0.8f, 0.8f, 0.8f);
     for (SurfaceNode *n = allFloors.tail; n != NULL; n = n->tail)
       drawSurface(n->head);
@@ -106,11 +147,7 @@ static void drawMario(MarioState *m) {
   glVertex2f(m->pos.x, m->pos.z);
   glEnd();
 
-  v3f qstep = {
-    m->pos.x + m->vel.x / 4.0f,
-    m->pos.y + m->vel.y / 4.0f,
-    m->pos.z + m->vel.z / 4.0f,
-  };
+  v3f qstep = quarterStep(m);
 
   glBegin(GL_LINES);
   glVertex2f(m->pos.x, m->pos.z);